@@ -1,10 +1,31 @@
 #include "AsyncMqttClient.hpp"
 
+#include <algorithm>
+
+#ifndef MQTT_WRITE_BATCH
+#define MQTT_WRITE_BATCH 8  // queued packets handed to the TCP stack per write call
+#endif
+
+#ifndef MQTT_MAX_INFLIGHT
+#define MQTT_MAX_INFLIGHT 8  // default for setMaxInflight(), 1 waits for each ack before the next QoS>0 packet
+#endif
+
+// Packets that wait in the in-flight table for the answer to their packet id once sent. A PUBREC we
+// send needs nothing kept: the server repeats its PUBLISH or PUBREL until it gets our answer.
+static bool awaitsAck(AsyncMqttClientInternals::OutPacket* packet) {
+  return !packet->released() && packet->packetType() != AsyncMqttClientInternals::PacketType.PUBREC;
+}
+
+// An in-flight slot holds the packet of its id and the order it was sent in, 0 while it is still being sent.
+typedef std::pair<AsyncMqttClientInternals::OutPacket*, uint32_t> InflightSlot;
+
 AsyncMqttClient::AsyncMqttClient()
 : _client()
 , _head(nullptr)
 , _tail(nullptr)
 , _sent(0)
+, _inflight(MQTT_MAX_INFLIGHT, InflightSlot(nullptr, 0))
+, _inflightOrder(0)
 , _state(DISCONNECTED)
 , _disconnectReason(AsyncMqttClientDisconnectReason::TCP_DISCONNECTED)
 , _lastClientActivity(0)
@@ -95,6 +116,18 @@ AsyncMqttClient& AsyncMqttClient::setMaxTopicLength(uint16_t maxTopicLength) {
   return *this;
 }
 
+AsyncMqttClient& AsyncMqttClient::setMaxInflight(uint8_t maxInflight) {
+  // the table is empty while disconnected, packets from a kept session are queued again
+  if (_state != DISCONNECTED) {
+    log_w("setMaxInflight(%u) ignored while connected", maxInflight);
+    return *this;
+  }
+  SEMAPHORE_TAKE(*this);
+  _inflight.assign(maxInflight ? maxInflight : 1, InflightSlot(nullptr, 0));
+  SEMAPHORE_GIVE();
+  return *this;
+}
+
 AsyncMqttClient& AsyncMqttClient::setCredentials(const char* username, const char* password) {
   _username = username;
   _password = password;
@@ -348,13 +381,25 @@ void AsyncMqttClient::_onPoll() {
 /* QUEUE */
 
 void AsyncMqttClient::_insert(AsyncMqttClientInternals::OutPacket* packet) {
-  // We only use this for QoS2 PUBREL so there must be a PUBLISH packet present.
-  // The queue therefore cannot be empty and _head points to this PUBLISH packet.
+  // We only use this for the QoS2 PUBREL and PUBCOMP answers. They go ahead of the queued packets,
+  // which may wait for room in the in-flight window, but behind a packet that is partly sent and
+  // behind the answers inserted before them, as PUBRELs must follow the order of the PUBRECs.
   SEMAPHORE_TAKE();
   log_i("new insert #%u", packet->packetType());
-  packet->next = _head->next;
-  _head->next = packet;
-  if (_head == _tail) {  // PUB packet is the only one in the queue
+  AsyncMqttClientInternals::OutPacket* prev = _sent ? _head : nullptr;
+  AsyncMqttClientInternals::OutPacket* next = prev ? prev->next : _head;
+  while (next && (next->packetType() == AsyncMqttClientInternals::PacketType.PUBREL ||
+                  next->packetType() == AsyncMqttClientInternals::PacketType.PUBCOMP)) {
+    prev = next;
+    next = next->next;
+  }
+  packet->next = next;
+  if (prev) {
+    prev->next = packet;
+  } else {
+    _head = packet;
+  }
+  if (!next) {
     _tail = packet;
   }
   SEMAPHORE_GIVE();
@@ -397,40 +442,74 @@ void AsyncMqttClient::_handleQueue() {
   bool disconnect = false;
 
   while (_head && _client.space() > 10) {  // safe but arbitrary value, send at least 10 bytes
-    // 1. try to send
-    if (_head->size() > _sent) {
-      // On SSL the TCP library returns the total amount of bytes, not just the unencrypted payload length.
-      // So we calculate the amount to be written ourselves.
-      size_t willSend = std::min(_head->size() - _sent, _client.space());
-      size_t realSent = _client.add(reinterpret_cast<const char*>(_head->data(_sent)), willSend, ASYNC_WRITE_FLAG_COPY);  // flag is set by LWIP anyway, added for clarity
-      _sent += willSend;
-      (void)realSent;
-      _client.send();
+    // 1. gather what is left of the head and of the packets that can follow it right away,
+    //    so the whole batch goes out with a single call into the TCP/IP thread
+    async_write_buf_t bufs[MQTT_WRITE_BATCH];
+    size_t count = 0;
+    size_t room = _client.space();
+    size_t offset = _sent;
+    for (AsyncMqttClientInternals::OutPacket* packet = _head; packet && room && count < MQTT_WRITE_BATCH; packet = packet->next) {
+      if (awaitsAck(packet)) {
+        // the slot of its packet id is taken before the first byte goes out, so two packets of a batch cannot share it
+        InflightSlot& slot = _inflight[packet->packetId() % _inflight.size()];
+        if (slot.first && slot.first != packet) break;  // the in-flight window is full, keep the order and wait for an ack
+        slot.first = packet;
+      }
+      if (packet->size() > offset) {
+        // On SSL the TCP library returns the total amount of bytes, not just the unencrypted payload length.
+        // So we calculate the amount to be written ourselves.
+        size_t willSend = std::min(packet->size() - offset, room);
+        bufs[count].data = reinterpret_cast<const char*>(packet->data(offset));
+        bufs[count].size = willSend;
+        ++count;
+        room -= willSend;
+        if (offset + willSend < packet->size()) break;
+      }
+      offset = 0;
+    }
+    size_t realSent = 0;
+    if (count) {
+      realSent = _client.writev(bufs, count, ASYNC_WRITE_FLAG_COPY);  // flag is set by LWIP anyway, added for clarity
       _lastClientActivity = millis();
       _lastPingRequestTime = 0;
-      #if ASYNC_TCP_SSL_ENABLED
-      log_i("snd #%u: (tls: %u) %u/%u", _head->packetType(), realSent, _sent, _head->size());
-      #else
-      log_i("snd #%u: %u/%u", _head->packetType(), _sent, _head->size());
-      #endif
-      if (_head->packetType() == AsyncMqttClientInternals::PacketType.DISCONNECT) {
-        disconnect = true;
-      }
     }
+    (void)realSent;
+
+    size_t consumed = 0;
+    bool progress = false;
+    while (_head) {
+      if (_head->size() > _sent) {
+        if (consumed == count) break;
+        _sent += bufs[consumed++].size;
+        progress = true;
+        #if ASYNC_TCP_SSL_ENABLED
+        log_i("snd #%u: (tls: %u) %u/%u", _head->packetType(), realSent, _sent, _head->size());
+        #else
+        log_i("snd #%u: %u/%u", _head->packetType(), _sent, _head->size());
+        #endif
+        if (_head->packetType() == AsyncMqttClientInternals::PacketType.DISCONNECT) {
+          disconnect = true;
+        }
+      }
 
-    // 2. stop processing when we have to wait for an MQTT acknowledgment
-    if (_head->size() == _sent) {
-      if (_head->released()) {
-        log_i("p #%d rel", _head->packetType());
-        AsyncMqttClientInternals::OutPacket* tmp = _head;
-        _head = _head->next;
-        if (!_head) _tail = nullptr;
-        delete tmp;
-        _sent = 0;
+      // 2. a packet that went out completely leaves the queue, it waits in the in-flight table for its ack if it needs one
+      if (_head->size() != _sent) break;
+      AsyncMqttClientInternals::OutPacket* tmp = _head;
+      _head = _head->next;
+      if (!_head) _tail = nullptr;
+      _sent = 0;
+      progress = true;
+      if (awaitsAck(tmp)) {
+        log_i("p #%d in flight", tmp->packetType());
+        tmp->next = nullptr;
+        if (++_inflightOrder == 0) ++_inflightOrder;  // 0 marks a packet still being sent
+        _inflight[tmp->packetId() % _inflight.size()].second = _inflightOrder;
       } else {
-        break;  // sending is complete however send next only after mqtt confirmation
+        log_i("p #%d rel", tmp->packetType());
+        delete tmp;
       }
     }
+    if (!progress) break;  // the head waits for room in the in-flight window
   }
 
   SEMAPHORE_GIVE();
@@ -442,49 +521,59 @@ void AsyncMqttClient::_handleQueue() {
 
 void AsyncMqttClient::_clearQueue(bool keepSessionData) {
   SEMAPHORE_TAKE();
-  AsyncMqttClientInternals::OutPacket* packet = _head;
+  // the packets waiting for an ack were sent before anything still queued, so they come first, in the order they were sent
+  std::vector<InflightSlot> sent;
+  for (const InflightSlot& slot : _inflight) {
+    if (slot.first && slot.second) sent.push_back(slot);
+  }
+  std::sort(sent.begin(), sent.end(), [](const InflightSlot& a, const InflightSlot& b) {
+    return static_cast<int32_t>(a.second - b.second) < 0;
+  });
+  AsyncMqttClientInternals::OutPacket* lists[2] = {nullptr, _head};
+  for (size_t i = sent.size(); i-- > 0;) {
+    sent[i].first->next = lists[0];
+    lists[0] = sent[i].first;
+  }
   _head = nullptr;
   _tail = nullptr;
+  _inflight.assign(_inflight.size(), InflightSlot(nullptr, 0));
 
-  while (packet) {
-    /* MQTT spec 3.1.2.4 Clean Session:
-     *  - QoS 1 and QoS 2 messages which have been sent to the Server, but have not been completely acknowledged.
-     *  - QoS 2 messages which have been received from the Server, but have not been completely acknowledged.
-     * + (unsent PUB messages with QoS > 0)
-     * 
-     * To be kept:
-     * - possibly first message (sent to server but not acked)
-     * - PUBREC messages (QoS 2 PUB received but not acked)
-     * - PUBCOMP messages (QoS 2 PUBREL received but not acked)
-     */
-    if (keepSessionData) {
-      if (packet->qos() > 0 && packet->size() <= _sent) {  // check for qos includes check for PUB-packet type
-        reinterpret_cast<AsyncMqttClientInternals::PublishOutPacket*>(packet)->setDup();
-        AsyncMqttClientInternals::OutPacket* next = packet->next;
-        log_i("keep #%u", packet->packetType());
-        SEMAPHORE_GIVE();
-        _addBack(packet);
-        SEMAPHORE_TAKE();
-        packet = next;
-      } else if (packet->qos() > 0 ||
-                 packet->packetType() == AsyncMqttClientInternals::PacketType.PUBREC ||
-                 packet->packetType() == AsyncMqttClientInternals::PacketType.PUBCOMP) {
-        AsyncMqttClientInternals::OutPacket* next = packet->next;
+  for (int i = 0; i < 2; ++i) {
+    AsyncMqttClientInternals::OutPacket* packet = lists[i];
+    while (packet) {
+      AsyncMqttClientInternals::OutPacket* next = packet->next;
+      /* MQTT spec 3.1.2.4 Clean Session:
+       *  - QoS 1 and QoS 2 messages which have been sent to the Server, but have not been completely acknowledged.
+       *  - QoS 2 messages which have been received from the Server, but have not been completely acknowledged.
+       * + (unsent PUB messages with QoS > 0)
+       *
+       * To be kept, in their order (spec 4.6):
+       * - PUB messages in flight (sent to server but not acked), resent with DUP
+       * - PUBREL messages (QoS 2 PUBREC received but not completed)
+       * - PUBREC messages (QoS 2 PUB received but not acked)
+       * - PUBCOMP messages (QoS 2 PUBREL received but not acked)
+       *
+       * Delete everything when not keeping session data
+       */
+      if (keepSessionData &&
+          (packet->qos() > 0 ||  // check for qos includes check for PUB-packet type
+           packet->packetType() == AsyncMqttClientInternals::PacketType.PUBREL ||
+           packet->packetType() == AsyncMqttClientInternals::PacketType.PUBREC ||
+           packet->packetType() == AsyncMqttClientInternals::PacketType.PUBCOMP)) {
+        if (i == 0 && packet->qos() > 0) {
+          reinterpret_cast<AsyncMqttClientInternals::PublishOutPacket*>(packet)->setDup();
+        }
         log_i("keep #%u", packet->packetType());
-        SEMAPHORE_GIVE();
-        _addBack(packet);
-        SEMAPHORE_TAKE();
-        packet = next;
+        packet->next = nullptr;
+        if (_tail) {
+          _tail->next = packet;
+        } else {
+          _head = packet;
+        }
+        _tail = packet;
       } else {
-        AsyncMqttClientInternals::OutPacket* next = packet->next;
         delete packet;
-        packet = next;
       }
-    /* Delete everything when not keeping session data
-     */
-    } else {
-      AsyncMqttClientInternals::OutPacket* next = packet->next;
-      delete packet;
       packet = next;
     }
   }
@@ -492,6 +581,16 @@ void AsyncMqttClient::_clearQueue(bool keepSessionData) {
   SEMAPHORE_GIVE();
 }
 
+AsyncMqttClientInternals::OutPacket* AsyncMqttClient::_takeInflight(uint16_t packetId, uint8_t packetType) {
+  // called with the semaphore taken, returns the sent packet the ack is for
+  InflightSlot& slot = _inflight[packetId % _inflight.size()];
+  if (!slot.first || slot.first->packetId() != packetId || slot.first->packetType() != packetType) return nullptr;
+  if (!slot.second) return nullptr;  // the packet with this id is still being sent, the ack is a duplicate from before
+  AsyncMqttClientInternals::OutPacket* packet = slot.first;
+  slot = InflightSlot(nullptr, 0);
+  return packet;
+}
+
 /* MQTT */
 void AsyncMqttClient::_onPingResp() {
   log_i("PINGRESP");
@@ -524,11 +623,12 @@ void AsyncMqttClient::_onSubAck(uint16_t packetId, char status) {
   log_i("SUBACK");
   _freeCurrentParsedPacket();
   SEMAPHORE_TAKE();
-  if (_head && _head->packetId() == packetId) {
-    _head->release();
+  AsyncMqttClientInternals::OutPacket* packet = _takeInflight(packetId, AsyncMqttClientInternals::PacketType.SUBSCRIBE);
+  SEMAPHORE_GIVE();
+  if (packet) {
     log_i("SUB released");
+    delete packet;
   }
-  SEMAPHORE_GIVE();
 
   for (auto callback : _onSubscribeUserCallbacks) callback(packetId, status);
 
@@ -539,11 +639,12 @@ void AsyncMqttClient::_onUnsubAck(uint16_t packetId) {
   log_i("UNSUBACK");
   _freeCurrentParsedPacket();
   SEMAPHORE_TAKE();
-  if (_head && _head->packetId() == packetId) {
-    _head->release();
+  AsyncMqttClientInternals::OutPacket* packet = _takeInflight(packetId, AsyncMqttClientInternals::PacketType.UNSUBSCRIBE);
+  SEMAPHORE_GIVE();
+  if (packet) {
     log_i("UNSUB released");
+    delete packet;
   }
-  SEMAPHORE_GIVE();
 
   for (auto callback : _onUnsubscribeUserCallbacks) callback(packetId);
 
@@ -613,12 +714,9 @@ void AsyncMqttClient::_onPubRel(uint16_t packetId) {
   pendingAck.packetType = AsyncMqttClientInternals::PacketType.PUBCOMP;
   pendingAck.headerFlag = AsyncMqttClientInternals::HeaderFlag.PUBCOMP_RESERVED;
   pendingAck.packetId = packetId;
-  if (_head && _head->packetId() == packetId) {
-    AsyncMqttClientInternals::OutPacket* msg = new AsyncMqttClientInternals::PubAckOutPacket(pendingAck);
-    _head->release();
-    _insert(msg);
-    log_i("PUBREC released");
-  }
+  AsyncMqttClientInternals::OutPacket* msg = new AsyncMqttClientInternals::PubAckOutPacket(pendingAck);
+  _insert(msg);  // our PUBREC was not kept, answer every PUBREL including those repeated after a reconnect
+  log_i("snd PUBCOMP");
 
   for (size_t i = 0; i < _pendingPubRels.size(); i++) {
     if (_pendingPubRels[i].packetId == packetId) {
@@ -630,20 +728,24 @@ void AsyncMqttClient::_onPubRel(uint16_t packetId) {
 
 void AsyncMqttClient::_onPubAck(uint16_t packetId) {
   _freeCurrentParsedPacket();
-  if (_head && _head->packetId() == packetId) {
-    _head->release();
+  SEMAPHORE_TAKE();
+  AsyncMqttClientInternals::OutPacket* packet = _takeInflight(packetId, AsyncMqttClientInternals::PacketType.PUBLISH);
+  SEMAPHORE_GIVE();
+  if (packet) {
     log_i("PUB released");
+    delete packet;
   }
 
   for (auto callback : _onPublishUserCallbacks) callback(packetId);
+
+  _handleQueue();  // a slot of the in-flight window is free again
 }
 
 void AsyncMqttClient::_onPubRec(uint16_t packetId) {
   _freeCurrentParsedPacket();
 
-  // We will only be sending 1 QoS>0 PUB message at a time (to honor message
-  // ordering). So no need to store ACKS in a separate container as it will
-  // be stored in the outgoing queue until a PUBCOMP comes in.
+  // The PUBREL takes the place of the PUB message in the in-flight table once it is
+  // sent and stays there until the PUBCOMP comes in.
   AsyncMqttClientInternals::PendingAck pendingAck;
   pendingAck.packetType = AsyncMqttClientInternals::PacketType.PUBREL;
   pendingAck.headerFlag = AsyncMqttClientInternals::HeaderFlag.PUBREL_RESERVED;
@@ -651,9 +753,12 @@ void AsyncMqttClient::_onPubRec(uint16_t packetId) {
   log_i("snd PUBREL");
 
   AsyncMqttClientInternals::OutPacket* msg = new AsyncMqttClientInternals::PubAckOutPacket(pendingAck);
-  if (_head && _head->packetId() == packetId) {
-    _head->release();
+  SEMAPHORE_TAKE();
+  AsyncMqttClientInternals::OutPacket* packet = _takeInflight(packetId, AsyncMqttClientInternals::PacketType.PUBLISH);
+  SEMAPHORE_GIVE();
+  if (packet) {
     log_i("PUB released");
+    delete packet;
   }
   _insert(msg);
 }
@@ -661,13 +766,17 @@ void AsyncMqttClient::_onPubRec(uint16_t packetId) {
 void AsyncMqttClient::_onPubComp(uint16_t packetId) {
   _freeCurrentParsedPacket();
 
-  // _head points to the PUBREL package
-  if (_head && _head->packetId() == packetId) {
-    _head->release();
+  SEMAPHORE_TAKE();
+  AsyncMqttClientInternals::OutPacket* packet = _takeInflight(packetId, AsyncMqttClientInternals::PacketType.PUBREL);
+  SEMAPHORE_GIVE();
+  if (packet) {
     log_i("PUBREL released");
+    delete packet;
   }
 
   for (auto callback : _onPublishUserCallbacks) callback(packetId);
+
+  _handleQueue();  // a slot of the in-flight window is free again
 }
 
 void AsyncMqttClient::_sendPing() {
@@ -30,18 +30,29 @@ extern "C"{
 #include "lwip/err.h"
 }
 #include "esp_task_wdt.h"
+#if ASYNC_TCP_SSL_ENABLED
+#include "mbedtls/ssl.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/md.h"
+#endif
+#include <atomic>
+#include <new>
 
 /*
  * TCP/IP Event Task
  * */
 
 typedef enum {
-    LWIP_TCP_SENT, LWIP_TCP_RECV, LWIP_TCP_FIN, LWIP_TCP_ERROR, LWIP_TCP_POLL, LWIP_TCP_CLEAR, LWIP_TCP_ACCEPT, LWIP_TCP_CONNECTED, LWIP_TCP_DNS
+    LWIP_TCP_SENT, LWIP_TCP_RECV, LWIP_TCP_FIN, LWIP_TCP_ERROR, LWIP_TCP_POLL, LWIP_TCP_CLEAR, LWIP_TCP_ACCEPT, LWIP_TCP_CONNECTED, LWIP_TCP_DNS, LWIP_TCP_TIMER, LWIP_TCP_SUBMITTED
 } lwip_event_t;
 
-typedef struct {
+typedef struct lwip_event_packet {
         lwip_event_t event;
         void *arg;
+        struct lwip_event_packet * next; //in its lane of the scheduler
+        uint32_t seq;
+        uint32_t queued_at; //micros() when it was queued
         union {
                 struct {
                         void * pcb;
@@ -73,90 +84,1056 @@ typedef struct {
                         const char * name;
                         ip_addr_t addr;
                 } dns;
+                struct {
+                        async_tx_ref * ref;
+                        uint32_t len;
+                        bool done;
+                        int8_t err;
+                } submitted;
         };
 } lwip_event_packet_t;
 
-static xQueueHandle _async_queue;
-static TaskHandle_t _async_service_task_handle = NULL;
+/*
+ * Every client is pinned to one of CONFIG_ASYNC_TCP_WORKERS shards by the
+ * address of its object. Each shard has its own scheduler and service task,
+ * so the events of one connection stay in order while different connections
+ * can be handled in parallel.
+ * */
+
+static TaskHandle_t _async_service_task_handles[CONFIG_ASYNC_TCP_WORKERS];
+
+/*
+ * Event Packet Pool
+ *
+ * Lock-free LIFO of preallocated event packets, so that the lwIP callbacks
+ * do not touch the heap. The head holds the index of the first free packet
+ * in the low 16 bits and an ABA tag in the high 16 bits. The pool is a bit
+ * larger than the queues to cover the packets being handled by the service
+ * tasks and the ones held by producers that wait for room in a queue.
+ * */
+
+#define ASYNC_EVENT_POOL_SIZE (CONFIG_ASYNC_TCP_EVENT_QUEUE_SIZE * CONFIG_ASYNC_TCP_WORKERS + 8)
+#define ASYNC_EVENT_POOL_NONE 0xFFFF
+
+static lwip_event_packet_t _event_pool[ASYNC_EVENT_POOL_SIZE];
+static std::atomic<uint16_t> _event_pool_next[ASYNC_EVENT_POOL_SIZE];
+static std::atomic<uint32_t> _event_pool_head(ASYNC_EVENT_POOL_NONE);
+static std::atomic<uint32_t> _event_pool_used(0);
+static std::atomic<uint32_t> _event_pool_high_water(0);
+static std::atomic<uint32_t> _event_pool_exhausted(0);
+static std::atomic<uint32_t> _event_pool_failed(0);
+
+static bool _event_pool_ready = []() {
+    for (int i = 0; i < ASYNC_EVENT_POOL_SIZE; ++ i) {
+        _event_pool_next[i].store((i + 1 < ASYNC_EVENT_POOL_SIZE)?(i + 1):ASYNC_EVENT_POOL_NONE, std::memory_order_relaxed);
+    }
+    _event_pool_head.store(0, std::memory_order_release);
+    return true;
+}();
+
+static inline bool _is_pool_event(lwip_event_packet_t * e){
+    return e >= _event_pool && e < (_event_pool + ASYNC_EVENT_POOL_SIZE);
+}
+
+static lwip_event_packet_t * _alloc_event(){
+    uint32_t head = _event_pool_head.load(std::memory_order_acquire);
+    while((head & 0xFFFF) != ASYNC_EVENT_POOL_NONE){
+        uint16_t index = head & 0xFFFF;
+        uint32_t next = ((head + 0x10000) & 0xFFFF0000) | _event_pool_next[index].load(std::memory_order_relaxed);
+        if(_event_pool_head.compare_exchange_weak(head, next, std::memory_order_acq_rel, std::memory_order_acquire)){
+            uint32_t used = _event_pool_used.fetch_add(1, std::memory_order_relaxed) + 1;
+            uint32_t high_water = _event_pool_high_water.load(std::memory_order_relaxed);
+            while(used > high_water && !_event_pool_high_water.compare_exchange_weak(high_water, used, std::memory_order_relaxed));
+            return &_event_pool[index];
+        }
+    }
+    //pool is empty, keep the event rather than lose it
+    _event_pool_exhausted.fetch_add(1, std::memory_order_relaxed);
+    lwip_event_packet_t * e = (lwip_event_packet_t *)malloc(sizeof(lwip_event_packet_t));
+    if(!e){
+        _event_pool_failed.fetch_add(1, std::memory_order_relaxed);
+    }
+    return e;
+}
+
+static void _free_event(lwip_event_packet_t * e){
+    if(!_is_pool_event(e)){
+        free(e);
+        return;
+    }
+    uint16_t index = e - _event_pool;
+    uint32_t head = _event_pool_head.load(std::memory_order_relaxed);
+    uint32_t next;
+    do {
+        _event_pool_next[index].store(head & 0xFFFF, std::memory_order_relaxed);
+        next = ((head + 0x10000) & 0xFFFF0000) | index;
+    } while(!_event_pool_head.compare_exchange_weak(head, next, std::memory_order_release, std::memory_order_relaxed));
+    _event_pool_used.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void async_tcp_get_event_pool_stats(async_event_pool_stats_t * stats){
+    if(!stats){
+        return;
+    }
+    stats->size = ASYNC_EVENT_POOL_SIZE;
+    stats->used = _event_pool_used.load(std::memory_order_relaxed);
+    stats->high_water = _event_pool_high_water.load(std::memory_order_relaxed);
+    stats->exhausted = _event_pool_exhausted.load(std::memory_order_relaxed);
+    stats->failed = _event_pool_failed.load(std::memory_order_relaxed);
+}
 
 
-SemaphoreHandle_t _slots_lock;
+/*
+ * Closed Slots
+ *
+ * Every live client owns a slot, and the API calls made on its behalf carry
+ * the slot handle: the index in the low bits and a generation above. When
+ * the client is closed the slot is released and reused with the next
+ * generation, so a call still on its way to the TCP/IP thread finds its
+ * handle stale and leaves the PCB alone. Free slots are kept on a tagged
+ * lock-free LIFO like the event pool, allocation and release are O(1).
+ * */
+
+#define ASYNC_SLOT_NONE 0xFFFF
+
+//8 bits on the ESP32, the host port has far more PCBs
+#if CONFIG_LWIP_MAX_ACTIVE_TCP <= 0xFF
+#define ASYNC_SLOT_INDEX_BITS 8
+#else
+#define ASYNC_SLOT_INDEX_BITS 16
+#endif
+#define ASYNC_SLOT_INDEX_MASK ((1UL << ASYNC_SLOT_INDEX_BITS) - 1)
+#define ASYNC_SLOT_GEN_MASK (0x7FFFFFFFUL >> ASYNC_SLOT_INDEX_BITS)
+
+static_assert(CONFIG_LWIP_MAX_ACTIVE_TCP < ASYNC_SLOT_NONE, "slot index has to fit below ASYNC_SLOT_NONE");
+
 const int _number_of_closed_slots = CONFIG_LWIP_MAX_ACTIVE_TCP;
-static uint32_t _closed_slots[_number_of_closed_slots];
-static uint32_t _closed_index = []() {
-    _slots_lock = xSemaphoreCreateBinary();
-    xSemaphoreGive(_slots_lock);
+static std::atomic<int32_t> _closed_slots[_number_of_closed_slots];//handle of the owner, 0 while free
+static uint32_t _closed_slot_gens[_number_of_closed_slots];//only touched by the owner
+static std::atomic<uint16_t> _closed_slot_next[_number_of_closed_slots];
+static std::atomic<uint32_t> _closed_slot_head(ASYNC_SLOT_NONE);
+
+static bool _closed_slots_ready = []() {
     for (int i = 0; i < _number_of_closed_slots; ++ i) {
-        _closed_slots[i] = 1;
+        _closed_slots[i].store(0, std::memory_order_relaxed);
+        _closed_slot_next[i].store((i + 1 < _number_of_closed_slots)?(i + 1):ASYNC_SLOT_NONE, std::memory_order_relaxed);
     }
-    return 1;
+    _closed_slot_head.store(0, std::memory_order_release);
+    return true;
 }();
 
+//returns the handle of a free slot or -1 when all are taken
+static int32_t _alloc_slot(){
+    uint32_t head = _closed_slot_head.load(std::memory_order_acquire);
+    while((head & 0xFFFF) != ASYNC_SLOT_NONE){
+        uint16_t index = head & 0xFFFF;
+        uint32_t next = ((head + 0x10000) & 0xFFFF0000) | _closed_slot_next[index].load(std::memory_order_relaxed);
+        if(_closed_slot_head.compare_exchange_weak(head, next, std::memory_order_acq_rel, std::memory_order_acquire)){
+            uint32_t gen = (_closed_slot_gens[index] + 1) & ASYNC_SLOT_GEN_MASK;
+            if(!gen){
+                gen = 1;
+            }
+            _closed_slot_gens[index] = gen;
+            int32_t handle = (int32_t)((gen << ASYNC_SLOT_INDEX_BITS) | index);
+            _closed_slots[index].store(handle, std::memory_order_release);
+            return handle;
+        }
+    }
+    return -1;
+}
+
+//safe to call twice for the same handle, only the first call frees the slot
+static void _release_slot(int32_t handle){
+    if(handle < 0){
+        return;
+    }
+    uint16_t index = handle & ASYNC_SLOT_INDEX_MASK;
+    int32_t expected = handle;
+    if(!_closed_slots[index].compare_exchange_strong(expected, 0, std::memory_order_acq_rel)){
+        return;
+    }
+    uint32_t head = _closed_slot_head.load(std::memory_order_relaxed);
+    uint32_t next;
+    do {
+        _closed_slot_next[index].store(head & 0xFFFF, std::memory_order_relaxed);
+        next = ((head + 0x10000) & 0xFFFF0000) | index;
+    } while(!_closed_slot_head.compare_exchange_weak(head, next, std::memory_order_release, std::memory_order_relaxed));
+}
+
+//calls without a slot are always let through
+static inline bool _slot_alive(int32_t handle){
+    return handle < 0 || _closed_slots[handle & ASYNC_SLOT_INDEX_MASK].load(std::memory_order_acquire) == handle;
+}
+
+
+static inline uint32_t _shard_of(void * key){
+#if CONFIG_ASYNC_TCP_WORKERS > 1
+    return ((((uint32_t)(uintptr_t)key >> 2) * 2654435761u) >> 16) % CONFIG_ASYNC_TCP_WORKERS;
+#else
+    (void)key;
+    return 0;
+#endif
+}
+
+static inline uint32_t _event_shard(lwip_event_packet_t * e){
+    //an accepted client is handed over on its own shard, ahead of its first events
+    return _shard_of((e->event == LWIP_TCP_ACCEPT)?(void*)e->accept.client:e->arg);
+}
+
+//shard of the calling task or -1 when it is not one of the service tasks
+static inline int _current_shard(){
+    TaskHandle_t task = xTaskGetCurrentTaskHandle();
+    for(int i = 0; i < CONFIG_ASYNC_TCP_WORKERS; ++ i){
+        if(_async_service_task_handles[i] == task){
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Event Cancellation
+ *
+ * Every queued event is stamped with a sequence number. Closing a client
+ * records a tombstone for its arg with the current sequence, and events of
+ * that arg stamped before it are skipped when they reach the async task.
+ * A clear marker is queued at the back behind all those events; when it is
+ * dispatched none of them can be left and the tombstone is dropped. So a
+ * close is constant time and the queue is never drained or reordered.
+ * */
+
+#define ASYNC_TOMBSTONE_SLOTS (ASYNC_EVENT_POOL_SIZE * 2)
+
+typedef struct {
+    void * arg;
+    uint32_t seq;     //events of arg stamped before this are stale
+    uint16_t markers; //clear markers of arg still in the queue
+} async_tombstone_t;
+
+static std::atomic<uint32_t> _event_seq(0);
+static async_tombstone_t _tombstones[ASYNC_TOMBSTONE_SLOTS];
+static std::atomic<uint32_t> _tombstone_count(0);
+static portMUX_TYPE _tombstones_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static inline uint32_t _tombstone_hash(void * arg){
+    return (((uint32_t)(uintptr_t)arg >> 2) * 2654435761u) % ASYNC_TOMBSTONE_SLOTS;
+}
+
+//call with _tombstones_lock taken
+static int _find_tombstone(void * arg){
+    uint32_t i = _tombstone_hash(arg);
+    for(uint32_t n = 0; n < ASYNC_TOMBSTONE_SLOTS && _tombstones[i].arg; ++ n){
+        if(_tombstones[i].arg == arg){
+            return i;
+        }
+        i = (i + 1) % ASYNC_TOMBSTONE_SLOTS;
+    }
+    return -1;
+}
+
+static bool _add_tombstone(void * arg){
+    bool added = false;
+    portENTER_CRITICAL(&_tombstones_lock);
+    uint32_t seq = ++ _event_seq;
+    uint32_t i = _tombstone_hash(arg);
+    for(uint32_t n = 0; n < ASYNC_TOMBSTONE_SLOTS; ++ n){
+        if(!_tombstones[i].arg){
+            _tombstones[i].arg = arg;
+            _tombstones[i].markers = 0;
+            ++ _tombstone_count;
+        }
+        if(_tombstones[i].arg == arg){
+            _tombstones[i].seq = seq;
+            _tombstones[i].markers++;
+            added = true;
+            break;
+        }
+        i = (i + 1) % ASYNC_TOMBSTONE_SLOTS;
+    }
+    portEXIT_CRITICAL(&_tombstones_lock);
+    return added;
+}
+
+static void _remove_tombstone(void * arg){
+    portENTER_CRITICAL(&_tombstones_lock);
+    int i = _find_tombstone(arg);
+    if(i >= 0 && -- _tombstones[i].markers == 0){
+        //backward shift deletion keeps the probe sequences intact
+        uint32_t hole = i;
+        uint32_t j = hole;
+        _tombstones[hole].arg = NULL;
+        for(;;){
+            j = (j + 1) % ASYNC_TOMBSTONE_SLOTS;
+            if(!_tombstones[j].arg){
+                break;
+            }
+            uint32_t home = _tombstone_hash(_tombstones[j].arg);
+            if(((j - home + ASYNC_TOMBSTONE_SLOTS) % ASYNC_TOMBSTONE_SLOTS) >= ((j - hole + ASYNC_TOMBSTONE_SLOTS) % ASYNC_TOMBSTONE_SLOTS)){
+                _tombstones[hole] = _tombstones[j];
+                _tombstones[j].arg = NULL;
+                hole = j;
+            }
+        }
+        -- _tombstone_count;
+    }
+    portEXIT_CRITICAL(&_tombstones_lock);
+}
+
+static bool _is_stale_event(lwip_event_packet_t * e){
+    if(!_tombstone_count.load(std::memory_order_relaxed)){
+        return false;
+    }
+    bool stale = false;
+    portENTER_CRITICAL(&_tombstones_lock);
+    int i = _find_tombstone(e->arg);
+    if(i >= 0){
+        stale = (int32_t)(e->seq - _tombstones[i].seq) < 0;
+    }
+    portEXIT_CRITICAL(&_tombstones_lock);
+    return stale;
+}
+
+/*
+ * Event Scheduler
+ *
+ * Each shard keeps the events of every connection in a queue of their own,
+ * so a peer that saturates the link cannot starve the quiet ones. The
+ * connections with events take turns in deficit round robin: every turn adds
+ * CONFIG_ASYNC_TCP_SCHED_QUANTUM to the deficit of a connection, a RECV costs
+ * its bytes and any other event ASYNC_SCHED_EVENT_COST. ACCEPT, CONNECTED,
+ * DNS and the timer wake up have a control lane that is served first and
+ * never waits for room. The data events of a shard share
+ * CONFIG_ASYNC_TCP_EVENT_QUEUE_SIZE slots, of which one connection may take
+ * CONFIG_ASYNC_TCP_FLOW_QUEUE_SIZE. Clear markers take no slot and queue
+ * behind the events of their connection, as the cancellation needs.
+ * */
+
+#define ASYNC_SCHED_EVENT_COST 64
+#define ASYNC_FLOW_SLOTS (CONFIG_ASYNC_TCP_EVENT_QUEUE_SIZE + ASYNC_TOMBSTONE_SLOTS)//a flow per data slot and per clear marker
+#define ASYNC_FLOW_BUCKETS 32
+
+static_assert(CONFIG_ASYNC_TCP_FLOW_QUEUE_SIZE > 0, "a connection needs at least one event slot");
+
+typedef struct async_flow {
+    void * arg;
+    lwip_event_packet_t * head;
+    lwip_event_packet_t * tail;
+    struct async_flow * next;       //in its bucket or in the free list
+    struct async_flow * next_turn;  //in the round robin
+    int32_t deficit;
+    uint16_t used;                  //data slots taken
+} async_flow_t;
+
+typedef struct {
+    portMUX_TYPE lock;
+    lwip_event_packet_t * control_head;
+    lwip_event_packet_t * control_tail;
+    async_flow_t * turn_head;       //the flow being served
+    async_flow_t * turn_tail;
+    async_flow_t * buckets[ASYNC_FLOW_BUCKETS];
+    async_flow_t * free_flows;
+    async_flow_t flows[ASYNC_FLOW_SLOTS];
+    uint32_t queued;
+    uint32_t used;                  //data slots taken
+    uint32_t producers_waiting;
+    SemaphoreHandle_t ready;        //given when the first event is queued
+    SemaphoreHandle_t room;         //given when a slot is freed while producers wait
+} async_sched_t;
+
+static async_sched_t _scheds[CONFIG_ASYNC_TCP_WORKERS];
+
+static bool _scheds_ready = []() {
+    for(int i = 0; i < CONFIG_ASYNC_TCP_WORKERS; ++ i){
+        async_sched_t & s = _scheds[i];
+        portMUX_TYPE unlocked = portMUX_INITIALIZER_UNLOCKED;
+        s.lock = unlocked;
+        for(int f = 0; f < ASYNC_FLOW_SLOTS; ++ f){
+            s.flows[f].next = (f + 1 < ASYNC_FLOW_SLOTS)?&s.flows[f + 1]:NULL;
+        }
+        s.free_flows = &s.flows[0];
+    }
+    return true;
+}();
 
 static inline bool _init_async_event_queue(){
-    if(!_async_queue){
-        _async_queue = xQueueCreate(32, sizeof(lwip_event_packet_t *));
-        if(!_async_queue){
+    for(int i = 0; i < CONFIG_ASYNC_TCP_WORKERS; ++ i){
+        async_sched_t & s = _scheds[i];
+        if(!s.room){
+            s.room = xSemaphoreCreateBinary();
+        }
+        if(!s.ready){
+            s.ready = xSemaphoreCreateBinary();
+        }
+        if(!s.room || !s.ready){
             return false;
         }
     }
     return true;
 }
 
-static inline bool _send_async_event(lwip_event_packet_t ** e){
-    return _async_queue && xQueueSend(_async_queue, e, portMAX_DELAY) == pdPASS;
+static inline bool _is_control_event(lwip_event_t event){
+    return event == LWIP_TCP_ACCEPT || event == LWIP_TCP_CONNECTED || event == LWIP_TCP_DNS || event == LWIP_TCP_TIMER || event == LWIP_TCP_SUBMITTED;
 }
 
-static inline bool _prepend_async_event(lwip_event_packet_t ** e){
-    return _async_queue && xQueueSendToFront(_async_queue, e, portMAX_DELAY) == pdPASS;
+static inline bool _takes_slot(lwip_event_t event){
+    return event != LWIP_TCP_CLEAR && !_is_control_event(event);
 }
 
-static inline bool _get_async_event(lwip_event_packet_t ** e){
-    return _async_queue && xQueueReceive(_async_queue, e, portMAX_DELAY) == pdPASS;
+static inline uint32_t _event_cost(lwip_event_packet_t * e){
+    return (e->event == LWIP_TCP_RECV && e->recv.pb)?e->recv.pb->tot_len:ASYNC_SCHED_EVENT_COST;
 }
 
-static bool _remove_events_with_arg(void * arg){
-    lwip_event_packet_t * first_packet = NULL;
-    lwip_event_packet_t * packet = NULL;
+static inline uint32_t _flow_bucket(void * arg){
+    return (((uint32_t)(uintptr_t)arg >> 2) * 2654435761u >> 16) % ASYNC_FLOW_BUCKETS;
+}
+
+//call with the scheduler locked
+static async_flow_t * _find_flow(async_sched_t & s, void * arg, bool create){
+    async_flow_t ** bucket = &s.buckets[_flow_bucket(arg)];
+    for(async_flow_t * f = *bucket; f; f = f->next){
+        if(f->arg == arg){
+            return f;
+        }
+    }
+    async_flow_t * f = s.free_flows;
+    if(!create || !f){
+        return NULL;
+    }
+    s.free_flows = f->next;
+    f->arg = arg;
+    f->head = f->tail = NULL;
+    f->next_turn = NULL;
+    f->deficit = 0;
+    f->used = 0;
+    f->next = *bucket;
+    *bucket = f;
+    return f;
+}
 
-    if(!_async_queue){
+//call with the scheduler locked, the flow has no events left
+static void _release_flow(async_sched_t & s, async_flow_t * flow){
+    async_flow_t ** link = &s.buckets[_flow_bucket(flow->arg)];
+    while(*link != flow){
+        link = &(*link)->next;
+    }
+    *link = flow->next;
+    flow->next = s.free_flows;
+    s.free_flows = flow;
+}
+
+//call with the scheduler locked, a turn starts with a new quantum
+static inline void _queue_turn(async_sched_t & s, async_flow_t * flow){
+    flow->deficit += CONFIG_ASYNC_TCP_SCHED_QUANTUM;
+    flow->next_turn = NULL;
+    if(s.turn_tail){
+        s.turn_tail->next_turn = flow;
+    } else {
+        s.turn_head = flow;
+    }
+    s.turn_tail = flow;
+}
+
+//queues the event and stamps it, ticks is 0 or portMAX_DELAY
+//overflow queues a data event past the slot limits, the event pool still bounds it
+static bool _sched_push(uint32_t shard, lwip_event_packet_t * e, TickType_t ticks, bool overflow = false){
+    async_sched_t & s = _scheds[shard];
+    if(!s.ready){
         return false;
     }
-    //figure out which is the first packet so we can keep the order
-    while(!first_packet){
-        if(xQueueReceive(_async_queue, &first_packet, 0) != pdPASS){
-            return false;
+    bool control = _is_control_event(e->event);
+    bool slot = _takes_slot(e->event);
+    e->next = NULL;
+    for(;;){
+        portENTER_CRITICAL(&s.lock);
+        async_flow_t * flow = control?NULL:_find_flow(s, e->arg, true);
+        bool room = control || (flow && (!slot || overflow || (s.used < CONFIG_ASYNC_TCP_EVENT_QUEUE_SIZE && flow->used < CONFIG_ASYNC_TCP_FLOW_QUEUE_SIZE)));
+        if(room){
+            e->seq = ++ _event_seq;
+            e->queued_at = micros();
+            if(control){
+                if(s.control_tail){
+                    s.control_tail->next = e;
+                } else {
+                    s.control_head = e;
+                }
+                s.control_tail = e;
+            } else {
+                if(flow->tail){
+                    flow->tail->next = e;
+                } else {
+                    flow->head = e;
+                    _queue_turn(s, flow);
+                }
+                flow->tail = e;
+                if(slot){
+                    flow->used++;
+                    s.used++;
+                }
+            }
+            bool wake = (++ s.queued == 1);
+            portEXIT_CRITICAL(&s.lock);
+            if(wake){
+                xSemaphoreGive(s.ready);
+            }
+            return true;
+        }
+        if(flow && !flow->head){
+            _release_flow(s, flow);
         }
-        //discard packet if matching
-        if((int)first_packet->arg == (int)arg){
-            free(first_packet);
-            first_packet = NULL;
-        //return first packet to the back of the queue
-        } else if(xQueueSend(_async_queue, &first_packet, portMAX_DELAY) != pdPASS){
+        if(!ticks || !flow){
+            portEXIT_CRITICAL(&s.lock);
             return false;
         }
+        ++ s.producers_waiting;
+        portEXIT_CRITICAL(&s.lock);
+        xSemaphoreTake(s.room, portMAX_DELAY);
+        portENTER_CRITICAL(&s.lock);
+        -- s.producers_waiting;
+        portEXIT_CRITICAL(&s.lock);
     }
+}
 
-    while(xQueuePeek(_async_queue, &packet, 0) == pdPASS && packet != first_packet){
-        if(xQueueReceive(_async_queue, &packet, 0) != pdPASS){
-            return false;
+//next event of the shard or NULL, only called by its service task
+static lwip_event_packet_t * _sched_take(int shard){
+    async_sched_t & s = _scheds[shard];
+    lwip_event_packet_t * e = NULL;
+    bool room = false;
+    portENTER_CRITICAL(&s.lock);
+    if(s.control_head){
+        e = s.control_head;
+        s.control_head = e->next;
+        if(!s.control_head){
+            s.control_tail = NULL;
         }
-        if((int)packet->arg == (int)arg){
-            free(packet);
-            packet = NULL;
-        } else if(xQueueSend(_async_queue, &packet, portMAX_DELAY) != pdPASS){
+    } else {
+        while(s.turn_head){
+            async_flow_t * flow = s.turn_head;
+            uint32_t cost = _event_cost(flow->head);
+            if(flow->deficit < (int32_t)cost && s.turn_head != s.turn_tail){
+                //turn is over, the flow keeps its deficit for the next one
+                s.turn_head = flow->next_turn;
+                _queue_turn(s, flow);
+                continue;
+            }
+            e = flow->head;
+            flow->head = e->next;
+            flow->deficit -= cost;
+            if(_takes_slot(e->event)){
+                flow->used--;
+                s.used--;
+                room = s.producers_waiting != 0;
+            }
+            if(!flow->head){
+                flow->tail = NULL;
+                s.turn_head = flow->next_turn;
+                if(!s.turn_head){
+                    s.turn_tail = NULL;
+                }
+                _release_flow(s, flow);
+            }
+            break;
+        }
+    }
+    if(e){
+        -- s.queued;
+    }
+    portEXIT_CRITICAL(&s.lock);
+    if(room){
+        xSemaphoreGive(s.room);
+    }
+    return e;
+}
+
+//waits for the next event or the timeout, false on timeout
+static inline bool _sched_wait(int shard, TickType_t ticks){
+    return xSemaphoreTake(_scheds[shard].ready, ticks) == pdPASS;
+}
+
+//data slots left on the shard
+static inline uint32_t _sched_space(uint32_t shard){
+    return CONFIG_ASYNC_TCP_EVENT_QUEUE_SIZE - _scheds[shard].used;
+}
+
+/*
+ * Event Loop Instrumentation
+ *
+ * Relaxed atomic counters per event type, bumped by the producers when an
+ * event is queued and by the service tasks when it is dispatched, together
+ * with a log2 histogram of the time in between. The queue depth is sampled
+ * by each service task after it took an event, which sees every peak.
+ * */
+
+typedef struct {
+    std::atomic<uint32_t> queued;
+    std::atomic<uint32_t> dispatched;
+    std::atomic<uint32_t> cancelled;
+    std::atomic<uint32_t> lost;
+    std::atomic<uint32_t> latency_max_us;
+    std::atomic<uint32_t> latency[ASYNC_TCP_LATENCY_BUCKETS];
+} async_event_counters_t;
+
+static_assert(LWIP_TCP_SUBMITTED + 1 == ASYNC_TCP_EVENT_TYPES, "ASYNC_TCP_EVENT_TYPES does not match lwip_event_t");
+
+static async_event_counters_t _event_stats[ASYNC_TCP_EVENT_TYPES];
+static uint32_t _queue_high_water[CONFIG_ASYNC_TCP_WORKERS];
+
+static const char * _event_names[ASYNC_TCP_EVENT_TYPES] = {
+    "sent", "recv", "fin", "error", "poll", "clear", "accept", "connected", "dns", "timer", "submitted"
+};
+
+static inline void _event_queued(lwip_event_t event){
+    _event_stats[event].queued.fetch_add(1, std::memory_order_relaxed);
+}
+
+static inline void _event_lost(lwip_event_t event){
+    _event_stats[event].lost.fetch_add(1, std::memory_order_relaxed);
+}
+
+static void _event_dispatched(lwip_event_packet_t * e){
+    async_event_counters_t & stats = _event_stats[e->event];
+    uint32_t latency = micros() - e->queued_at;
+    uint32_t bucket = (latency < 32)?0:(31 - __builtin_clz(latency) - 4);
+    if(bucket >= ASYNC_TCP_LATENCY_BUCKETS){
+        bucket = ASYNC_TCP_LATENCY_BUCKETS - 1;
+    }
+    stats.dispatched.fetch_add(1, std::memory_order_relaxed);
+    stats.latency[bucket].fetch_add(1, std::memory_order_relaxed);
+    uint32_t max = stats.latency_max_us.load(std::memory_order_relaxed);
+    while(latency > max && !stats.latency_max_us.compare_exchange_weak(max, latency, std::memory_order_relaxed));
+}
+
+//only the service task of the shard writes its high water
+static inline void _note_queue_depth(int shard, uint32_t depth){
+    if(depth > _queue_high_water[shard]){
+        _queue_high_water[shard] = depth;
+    }
+}
+
+const char * async_tcp_event_name(uint8_t type){
+    return (type < ASYNC_TCP_EVENT_TYPES)?_event_names[type]:"unknown";
+}
+
+void async_tcp_get_stats(async_tcp_stats_t * stats){
+    if(!stats){
+        return;
+    }
+    for(int i = 0; i < ASYNC_TCP_EVENT_TYPES; ++ i){
+        async_event_counters_t & src = _event_stats[i];
+        async_event_stats_t & dst = stats->events[i];
+        dst.queued = src.queued.load(std::memory_order_relaxed);
+        dst.dispatched = src.dispatched.load(std::memory_order_relaxed);
+        dst.cancelled = src.cancelled.load(std::memory_order_relaxed);
+        dst.lost = src.lost.load(std::memory_order_relaxed);
+        dst.latency_max_us = src.latency_max_us.load(std::memory_order_relaxed);
+        for(int b = 0; b < ASYNC_TCP_LATENCY_BUCKETS; ++ b){
+            dst.latency[b] = src.latency[b].load(std::memory_order_relaxed);
+        }
+    }
+    for(int i = 0; i < CONFIG_ASYNC_TCP_WORKERS; ++ i){
+        stats->queue_depth[i] = _scheds[i].queued;
+        stats->queue_high_water[i] = _queue_high_water[i];
+    }
+    async_tcp_get_event_pool_stats(&stats->pool);
+    async_tcp_get_overflow_stats(&stats->overflow);
+    async_tcp_get_ack_stats(&stats->ack);
+    async_tcp_get_submit_stats(&stats->submit);
+}
+
+/*
+ * Queue Overflow Policy
+ *
+ * A client never has more than one POLL queued, further poll ticks are
+ * suppressed until the queued one is dispatched. In ASYNC_QUEUE_NONBLOCK
+ * mode the LwIP thread also never waits for room in a queue on behalf of
+ * the data path: POLL is dropped first when a queue runs low, RECV is
+ * refused so LwIP keeps the data and the receive window closes, and SENT is
+ * folded into the client to be reported with its next event. That also
+ * happens when only the share of the connection is full, which throttles a
+ * busy peer alone. FIN and ERROR are queued past the slot limits instead:
+ * a handler calling into LwIP from the service task would otherwise wait
+ * for the LwIP thread while it waits for room in the queue. There is one of
+ * them per connection and the event pool bounds them.
+ * */
+
+#define ASYNC_POLL_RESERVE (CONFIG_ASYNC_TCP_EVENT_QUEUE_SIZE / 4)
+
+static async_queue_mode_t _queue_mode = ASYNC_QUEUE_BLOCK;
+static std::atomic<uint32_t> _polls_coalesced(0);
+static std::atomic<uint32_t> _polls_dropped(0);
+static std::atomic<uint32_t> _recv_deferred(0);
+static std::atomic<uint32_t> _sent_folded(0);
+static std::atomic<uint32_t> _events_waited(0);
+
+void async_tcp_set_queue_mode(async_queue_mode_t mode){
+    _queue_mode = mode;
+}
+
+async_queue_mode_t async_tcp_get_queue_mode(){
+    return _queue_mode;
+}
+
+void async_tcp_get_overflow_stats(async_queue_overflow_stats_t * stats){
+    if(!stats){
+        return;
+    }
+    stats->polls_coalesced = _polls_coalesced.load(std::memory_order_relaxed);
+    stats->polls_dropped = _polls_dropped.load(std::memory_order_relaxed);
+    stats->recv_deferred = _recv_deferred.load(std::memory_order_relaxed);
+    stats->sent_folded = _sent_folded.load(std::memory_order_relaxed);
+    stats->waited = _events_waited.load(std::memory_order_relaxed);
+}
+
+//the packet may be handled and freed as soon as it is queued, count it by its type
+//overflow is only for FIN and ERROR, see Queue Overflow Policy
+static inline bool _send_async_event(lwip_event_packet_t ** e, bool overflow = false){
+    lwip_event_t event = (*e)->event;
+    uint32_t shard = _event_shard(*e);
+    if(!_sched_push(shard, *e, 0, overflow)){
+        _events_waited.fetch_add(1, std::memory_order_relaxed);
+        if(!_sched_push(shard, *e, portMAX_DELAY)){
+            _event_lost(event);
             return false;
         }
     }
+    _event_queued(event);
+    return true;
+}
+
+//data path events, waits only in ASYNC_QUEUE_BLOCK mode
+static inline bool _try_send_async_event(lwip_event_packet_t ** e){
+    if(_queue_mode == ASYNC_QUEUE_BLOCK){
+        return _send_async_event(e);
+    }
+    lwip_event_t event = (*e)->event;
+    if(!_sched_push(_event_shard(*e), *e, 0)){
+        return false;
+    }
+    _event_queued(event);
+    return true;
+}
+
+//clear markers take no slot, so no task has to wait for them
+static bool _send_clear_marker(lwip_event_packet_t * e){
+    if(!_sched_push(_event_shard(e), e, 0)){
+        _event_lost(LWIP_TCP_CLEAR);
+        return false;
+    }
+    _event_queued(LWIP_TCP_CLEAR);
+    return true;
+}
+
+/*
+ * Timer Wheel
+ *
+ * Each service task keeps a hierarchical wheel of 1ms ticks for the
+ * deadlines of its clients, every client has at most one timer armed for
+ * its next deadline. Level l has 64 slots of 64^l ticks, timers move down a
+ * level when the level below wraps. Bitmaps of the non empty slots let the
+ * wheel jump over idle ticks, so advancing and finding the next expiry cost
+ * the same no matter how many timers are armed. The task sleeps on its
+ * queue until that expiry; arming an earlier timer from another task wakes
+ * it with a LWIP_TCP_TIMER packet. Due timers wait on the firing list of the
+ * wheel and are taken off it one at a time, so a callback or another task
+ * can still cancel or arm again the ones that did not fire yet.
+ * */
+
+#define ASYNC_TIMER_LEVELS 4
+#define ASYNC_TIMER_SLOT_BITS 6
+#define ASYNC_TIMER_SLOTS (1 << ASYNC_TIMER_SLOT_BITS)
+#define ASYNC_TIMER_MASK (ASYNC_TIMER_SLOTS - 1)
+#define ASYNC_TIMER_MAX_DELAY ((1UL << (ASYNC_TIMER_LEVELS * ASYNC_TIMER_SLOT_BITS)) - 1)
+#define ASYNC_TIMER_FIRING (ASYNC_TIMER_LEVELS * ASYNC_TIMER_SLOTS)//slot of a due timer waiting for its callback
+
+typedef struct {
+    async_timer_t * slots[ASYNC_TIMER_LEVELS][ASYNC_TIMER_SLOTS];
+    uint64_t nonempty[ASYNC_TIMER_LEVELS];
+    async_timer_t * firing;//due timers, not counted in armed
+    uint32_t now;        //next tick to process
+    uint32_t armed;
+    bool waiting;        //the service task sleeps on its queue
+    uint32_t wake_at;    //until then, when armed is not 0
+    portMUX_TYPE lock;
+} async_timer_wheel_t;
+
+static async_timer_wheel_t _timer_wheels[CONFIG_ASYNC_TCP_WORKERS];
+
+static bool _timer_wheels_ready = []() {
+    for(int i = 0; i < CONFIG_ASYNC_TCP_WORKERS; ++ i){
+        portMUX_TYPE unlocked = portMUX_INITIALIZER_UNLOCKED;
+        _timer_wheels[i].lock = unlocked;
+    }
+    return true;
+}();
+
+static inline uint32_t _ctz64(uint64_t v){
+    return __builtin_ctzll(v);
+}
+
+//call with the wheel locked
+static void _timer_link(async_timer_wheel_t & w, async_timer_t * t){
+    uint32_t delta = t->expires - w.now;
+    if((int32_t)delta < 0){
+        t->expires = w.now;
+        delta = 0;
+    } else if(delta > ASYNC_TIMER_MAX_DELAY){
+        //fires early and is armed again by its owner
+        t->expires = w.now + ASYNC_TIMER_MAX_DELAY;
+        delta = ASYNC_TIMER_MAX_DELAY;
+    }
+    uint32_t level = 0;
+    while(delta >= (1UL << ((level + 1) * ASYNC_TIMER_SLOT_BITS))){
+        ++ level;
+    }
+    uint32_t index = (t->expires >> (level * ASYNC_TIMER_SLOT_BITS)) & ASYNC_TIMER_MASK;
+    t->slot = level * ASYNC_TIMER_SLOTS + index;
+    t->prev = NULL;
+    t->next = w.slots[level][index];
+    if(t->next){
+        t->next->prev = t;
+    }
+    w.slots[level][index] = t;
+    w.nonempty[level] |= (1ULL << index);
+}
+
+//call with the wheel locked
+static void _timer_unlink(async_timer_wheel_t & w, async_timer_t * t){
+    bool firing = t->slot == ASYNC_TIMER_FIRING;
+    uint32_t level = t->slot / ASYNC_TIMER_SLOTS;
+    uint32_t index = t->slot % ASYNC_TIMER_SLOTS;
+    async_timer_t ** head = firing?&w.firing:&w.slots[level][index];
+    if(t->prev){
+        t->prev->next = t->next;
+    } else {
+        *head = t->next;
+    }
+    if(t->next){
+        t->next->prev = t->prev;
+    }
+    if(!firing && !w.slots[level][index]){
+        w.nonempty[level] &= ~(1ULL << index);
+    }
+    t->prev = t->next = NULL;
+    t->slot = -1;
+}
+
+//call with the wheel locked, takes the timer out of the wheel or off the firing list
+static void _timer_detach(async_timer_wheel_t & w, async_timer_t * t){
+    if(t->slot < 0){
+        return;
+    }
+    if(t->slot != ASYNC_TIMER_FIRING){
+        -- w.armed;
+    }
+    _timer_unlink(w, t);
+}
+
+//call with the wheel locked, moves the timers of the slots reached at tick down
+static void _timer_cascade(async_timer_wheel_t & w, uint32_t tick){
+    for(uint32_t level = 1; level < ASYNC_TIMER_LEVELS; ++ level){
+        uint32_t index = (tick >> (level * ASYNC_TIMER_SLOT_BITS)) & ASYNC_TIMER_MASK;
+        async_timer_t * t = w.slots[level][index];
+        w.slots[level][index] = NULL;
+        w.nonempty[level] &= ~(1ULL << index);
+        while(t){
+            async_timer_t * next = t->next;
+            _timer_link(w, t);
+            t = next;
+        }
+        if(index){
+            break;
+        }
+    }
+}
+
+//call with the wheel locked, moves the timers due until target to the firing list
+static void _timer_advance(async_timer_wheel_t & w, uint32_t target){
+    while((int32_t)(target - w.now) >= 0){
+        uint32_t tick = w.now;
+        if(!(tick & ASYNC_TIMER_MASK)){
+            _timer_cascade(w, tick);
+        }
+        uint32_t index = tick & ASYNC_TIMER_MASK;
+        while(w.slots[0][index]){
+            async_timer_t * t = w.slots[0][index];
+            _timer_unlink(w, t);
+            t->slot = ASYNC_TIMER_FIRING;
+            t->next = w.firing;
+            if(t->next){
+                t->next->prev = t;
+            }
+            w.firing = t;
+            -- w.armed;
+        }
+        //jump to the next busy slot of level 0 or to the end of its round
+        uint32_t next = tick + 1;
+        if(next & ASYNC_TIMER_MASK){
+            uint64_t rest = w.nonempty[0] >> (next & ASYNC_TIMER_MASK);
+            next = rest?(next + _ctz64(rest)):((tick | ASYNC_TIMER_MASK) + 1);
+        }
+        if((int32_t)(next - target) > 0){
+            w.now = target + 1;
+            break;
+        }
+        w.now = next;
+    }
+}
+
+//call with the wheel locked, the tick when the wheel has to be advanced next
+static bool _timer_next_expiry(async_timer_wheel_t & w, uint32_t * expiry){
+    if(!w.armed){
+        return false;
+    }
+    uint32_t best = w.now + ASYNC_TIMER_MAX_DELAY;
+    if(w.nonempty[0]){
+        //level 0 holds the exact expiries of the current round
+        uint32_t shift = w.now & ASYNC_TIMER_MASK;
+        uint64_t bits = w.nonempty[0];
+        uint64_t rotated = shift?((bits >> shift) | (bits << (ASYNC_TIMER_SLOTS - shift))):bits;
+        best = w.now + _ctz64(rotated);
+    }
+    for(uint32_t level = 1; level < ASYNC_TIMER_LEVELS; ++ level){
+        if(!w.nonempty[level]){
+            continue;
+        }
+        //the wheel has to be advanced to the start of the slot to cascade it, the
+        //current slot is only still due when the wheel stands right at its start
+        uint32_t shift = level * ASYNC_TIMER_SLOT_BITS;
+        uint32_t ahead = (w.now & ((1UL << shift) - 1))?1:0;
+        uint32_t from = ((w.now >> shift) + ahead) & ASYNC_TIMER_MASK;
+        uint64_t bits = w.nonempty[level];
+        uint64_t rotated = from?((bits >> from) | (bits << (ASYNC_TIMER_SLOTS - from))):bits;
+        uint32_t distance = _ctz64(rotated) + ahead;
+        uint32_t start = ((w.now >> shift) + distance) << shift;
+        if((int32_t)(start - best) < 0){
+            best = start;
+        }
+    }
+    *expiry = best;
     return true;
 }
 
+static void _timer_wake(int shard){
+    lwip_event_packet_t * e = _alloc_event();
+    if(!e){
+        return;
+    }
+    e->event = LWIP_TCP_TIMER;
+    e->arg = NULL;
+    if(!_sched_push(shard, e, 0)){
+        _free_event(e);
+        return;
+    }
+    _event_queued(LWIP_TCP_TIMER);
+}
+
+static void _timer_arm(int shard, async_timer_t * t, uint32_t expires){
+    async_timer_wheel_t & w = _timer_wheels[shard];
+    bool wake = false;
+    portENTER_CRITICAL(&w.lock);
+    _timer_detach(w, t);
+    t->expires = expires;
+    _timer_link(w, t);
+    ++ w.armed;
+    wake = w.waiting && (w.armed == 1 || (int32_t)(t->expires - w.wake_at) < 0);
+    if(wake){
+        w.wake_at = t->expires;
+    }
+    portEXIT_CRITICAL(&w.lock);
+    if(wake && _current_shard() != shard && _scheds[shard].ready){
+        _timer_wake(shard);
+    }
+}
+
+//runs the callback of t right after the event being dispatched, or wakes the service task for it
+static void _timer_fire(int shard, async_timer_t * t){
+    async_timer_wheel_t & w = _timer_wheels[shard];
+    portENTER_CRITICAL(&w.lock);
+    _timer_detach(w, t);
+    t->slot = ASYNC_TIMER_FIRING;
+    t->prev = NULL;
+    t->next = w.firing;
+    if(t->next){
+        t->next->prev = t;
+    }
+    w.firing = t;
+    portEXIT_CRITICAL(&w.lock);
+    if(_current_shard() != shard && _scheds[shard].ready){
+        _timer_wake(shard);
+    }
+}
+
+static void _timer_cancel(int shard, async_timer_t * t){
+    async_timer_wheel_t & w = _timer_wheels[shard];
+    portENTER_CRITICAL(&w.lock);
+    _timer_detach(w, t);
+    portEXIT_CRITICAL(&w.lock);
+}
+
+//runs on the service task, fires the due timers
+static void _run_timers(int shard){
+    async_timer_wheel_t & w = _timer_wheels[shard];
+    uint32_t now = millis();
+    //a tick handled already is not advanced again, only the service task moves the wheel
+    if((int32_t)(now - w.now) >= 0){
+        portENTER_CRITICAL(&w.lock);
+        if(w.armed){
+            _timer_advance(w, now);
+        } else {
+            w.now = now + 1;
+        }
+        portEXIT_CRITICAL(&w.lock);
+    }
+    for(;;){
+        //one at a time, a callback may delete the owner of a timer that is still due
+        portENTER_CRITICAL(&w.lock);
+        async_timer_t * t = w.firing;
+        if(t){
+            _timer_unlink(w, t);
+        }
+        portEXIT_CRITICAL(&w.lock);
+        if(!t){
+            break;
+        }
+        t->cb(t->arg);
+    }
+}
+
+//runs on the service task right before it waits for the next event
+static TickType_t _timer_wait_ticks(int shard){
+    async_timer_wheel_t & w = _timer_wheels[shard];
+    TickType_t ticks = portMAX_DELAY;
+    uint32_t expiry;
+    portENTER_CRITICAL(&w.lock);
+    if(_timer_next_expiry(w, &expiry)){
+        int32_t ms = expiry - millis();
+        ticks = (ms > 0)?((ms + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS):0;
+        w.wake_at = expiry;
+    }
+    w.waiting = ticks != 0;
+    portEXIT_CRITICAL(&w.lock);
+    return ticks;
+}
+
+static void _submit_release(async_tx_ref * ref);
+static void _submit_retry();
+
 static void _handle_async_event(lwip_event_packet_t * e){
+    _event_dispatched(e);
     if(e->arg == NULL){
         // do nothing when arg is NULL
         //ets_printf("event arg == NULL: 0x%08x\n", e->recv.pcb);
     } else if(e->event == LWIP_TCP_CLEAR){
-        _remove_events_with_arg(e->arg);
+        _remove_tombstone(e->arg);
+    } else if(_is_stale_event(e)){
+        //queued before the client was closed
+        _event_stats[e->event].cancelled.fetch_add(1, std::memory_order_relaxed);
+        if(e->event == LWIP_TCP_SUBMITTED && e->submitted.done){
+            //the close reset the connection, LwIP no longer sends from the buffer
+            _submit_release(e->submitted.ref);
+        } else if(e->event == LWIP_TCP_RECV && e->recv.pb){
+            //nobody acks the data of a closed client
+            pbuf_free(e->recv.pb);
+        }
     } else if(e->event == LWIP_TCP_RECV){
         //ets_printf("-R: 0x%08x\n", e->recv.pcb);
         AsyncClient::_s_recv(e->arg, e->recv.pcb, e->recv.pb, e->recv.err);
@@ -181,35 +1158,63 @@ static void _handle_async_event(lwip_event_packet_t * e){
     } else if(e->event == LWIP_TCP_DNS){
         //ets_printf("D: 0x%08x %s = %s\n", e->arg, e->dns.name, ipaddr_ntoa(&e->dns.addr));
         AsyncClient::_s_dns_found(e->dns.name, &e->dns.addr, e->arg);
+    } else if(e->event == LWIP_TCP_SUBMITTED){
+        AsyncClient::_s_submitted(e->arg, e->submitted.ref, e->submitted.len, e->submitted.done, e->submitted.err);
     }
-    free((void*)(e));
+    _free_event(e);
 }
 
 static void _async_service_task(void *pvParameters){
+    int shard = (int)(intptr_t)pvParameters;
     lwip_event_packet_t * packet = NULL;
     for (;;) {
-        if(_get_async_event(&packet)){
-#if CONFIG_ASYNC_TCP_USE_WDT
-            if(esp_task_wdt_add(NULL) != ESP_OK){
-                log_e("Failed to add async task to WDT");
+        packet = _sched_take(shard);
+        if(!packet){
+            bool got = _sched_wait(shard, _timer_wait_ticks(shard));
+            _timer_wheels[shard].waiting = false;
+            if(!got){
+                _run_timers(shard);
             }
+            continue;
+        }
+#if CONFIG_ASYNC_TCP_USE_WDT
+        //registered only while there is work, a single stuck handler still trips the WDT
+        if(esp_task_wdt_add(NULL) != ESP_OK){
+            log_e("Failed to add async task to WDT");
+        }
+        uint32_t batch_started = micros();
+        uint32_t batch_events = 0;
 #endif
+        //drain the burst without blocking
+        do {
+            _note_queue_depth(shard, _scheds[shard].queued + 1);
             _handle_async_event(packet);
+            _run_timers(shard);
+            _submit_retry();
 #if CONFIG_ASYNC_TCP_USE_WDT
-            if(esp_task_wdt_delete(NULL) != ESP_OK){
-                log_e("Failed to remove loop task from WDT");
+            if(++batch_events >= CONFIG_ASYNC_TCP_WDT_BATCH_EVENTS || (micros() - batch_started) >= CONFIG_ASYNC_TCP_WDT_BATCH_US){
+                esp_task_wdt_reset();
+                batch_started = micros();
+                batch_events = 0;
             }
 #endif
+        } while((packet = _sched_take(shard)) != NULL);
+#if CONFIG_ASYNC_TCP_USE_WDT
+        if(esp_task_wdt_delete(NULL) != ESP_OK){
+            log_e("Failed to remove loop task from WDT");
         }
+#endif
     }
     vTaskDelete(NULL);
-    _async_service_task_handle = NULL;
+    _async_service_task_handles[shard] = NULL;
 }
 /*
 static void _stop_async_task(){
-    if(_async_service_task_handle){
-        vTaskDelete(_async_service_task_handle);
-        _async_service_task_handle = NULL;
+    for(int i = 0; i < CONFIG_ASYNC_TCP_WORKERS; ++ i){
+        if(_async_service_task_handles[i]){
+            vTaskDelete(_async_service_task_handles[i]);
+            _async_service_task_handles[i] = NULL;
+        }
     }
 }
 */
@@ -217,56 +1222,514 @@ static bool _start_async_task(){
     if(!_init_async_event_queue()){
         return false;
     }
-    if(!_async_service_task_handle){
-        xTaskCreateUniversal(_async_service_task, "async_tcp", 8192 * 2, NULL, 3, &_async_service_task_handle, CONFIG_ASYNC_TCP_RUNNING_CORE);
-        if(!_async_service_task_handle){
+    for(int i = 0; i < CONFIG_ASYNC_TCP_WORKERS; ++ i){
+        if(_async_service_task_handles[i]){
+            continue;
+        }
+        _timer_wheels[i].now = millis();
+#if CONFIG_ASYNC_TCP_WORKERS > 1
+        //spread the workers over the cores
+        char name[16];
+        snprintf(name, sizeof(name), "async_tcp_%d", i);
+        xTaskCreateUniversal(_async_service_task, name, CONFIG_ASYNC_TCP_STACK_SIZE, (void*)(intptr_t)i, CONFIG_ASYNC_TCP_PRIORITY, &_async_service_task_handles[i], i % portNUM_PROCESSORS);
+#else
+        xTaskCreateUniversal(_async_service_task, "async_tcp", CONFIG_ASYNC_TCP_STACK_SIZE, (void*)(intptr_t)i, CONFIG_ASYNC_TCP_PRIORITY, &_async_service_task_handles[i], CONFIG_ASYNC_TCP_RUNNING_CORE);
+#endif
+        if(!_async_service_task_handles[i]){
             return false;
         }
     }
     return true;
 }
 
+/*
+ * DNS Cache
+ *
+ * Remembers the IPv4 address of the last hosts passed to connect(host, port),
+ * so a reconnect only pays for the TCP handshake. An entry that is used in
+ * the last eighth of its TTL is refreshed in the background; when a lookup
+ * fails, an expired address is used rather than failing the connect. The
+ * results are stored by the LwIP callbacks, where the host name is valid.
+ * */
+
+#define ASYNC_DNS_NAME_LENGTH 64
+
+typedef struct {
+    char name[ASYNC_DNS_NAME_LENGTH];
+    uint32_t addr;      //0 for a failed lookup
+    uint32_t stored_at; //millis()
+    uint32_t used_at;
+    bool prefetching;
+} async_dns_entry_t;
+
+typedef enum {
+    ASYNC_DNS_NONE, ASYNC_DNS_FRESH, ASYNC_DNS_NEGATIVE, ASYNC_DNS_EXPIRED
+} async_dns_state_t;
+
+#if CONFIG_ASYNC_TCP_DNS_CACHE_SIZE > 0
+static async_dns_entry_t _dns_cache[CONFIG_ASYNC_TCP_DNS_CACHE_SIZE];
+#else
+static async_dns_entry_t * _dns_cache = NULL;
+#endif
+static portMUX_TYPE _dns_cache_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t _dns_ttl = 300000;
+static uint32_t _dns_negative_ttl = 10000;
+static uint32_t _dns_stale = 86400000;
+static std::atomic<uint32_t> _dns_hits(0);
+static std::atomic<uint32_t> _dns_negative_hits(0);
+static std::atomic<uint32_t> _dns_misses(0);
+static std::atomic<uint32_t> _dns_stale_hits(0);
+static std::atomic<uint32_t> _dns_prefetches(0);
+
+void async_tcp_set_dns_cache_ttl(uint32_t ttl, uint32_t negative_ttl, uint32_t stale){
+    _dns_ttl = ttl * 1000;
+    _dns_negative_ttl = negative_ttl * 1000;
+    _dns_stale = stale * 1000;
+}
+
+void async_tcp_flush_dns_cache(){
+    portENTER_CRITICAL(&_dns_cache_lock);
+    for(int i = 0; i < CONFIG_ASYNC_TCP_DNS_CACHE_SIZE; ++ i){
+        _dns_cache[i].name[0] = 0;
+    }
+    portEXIT_CRITICAL(&_dns_cache_lock);
+}
+
+void async_tcp_get_dns_cache_stats(async_dns_cache_stats_t * stats){
+    if(!stats){
+        return;
+    }
+    stats->hits = _dns_hits.load(std::memory_order_relaxed);
+    stats->negative_hits = _dns_negative_hits.load(std::memory_order_relaxed);
+    stats->misses = _dns_misses.load(std::memory_order_relaxed);
+    stats->stale_hits = _dns_stale_hits.load(std::memory_order_relaxed);
+    stats->prefetches = _dns_prefetches.load(std::memory_order_relaxed);
+}
+
+//call with _dns_cache_lock taken
+static async_dns_entry_t * _dns_cache_find(const char * name){
+    if(!name || strlen(name) >= ASYNC_DNS_NAME_LENGTH){
+        return NULL;
+    }
+    for(int i = 0; i < CONFIG_ASYNC_TCP_DNS_CACHE_SIZE; ++ i){
+        if(_dns_cache[i].name[0] && !strcasecmp(_dns_cache[i].name, name)){
+            return &_dns_cache[i];
+        }
+    }
+    return NULL;
+}
+
+//looks up name, *prefetch tells the caller to refresh the entry
+static async_dns_state_t _dns_cache_lookup(const char * name, uint32_t * addr, bool * prefetch){
+    async_dns_state_t state = ASYNC_DNS_NONE;
+    *prefetch = false;
+    portENTER_CRITICAL(&_dns_cache_lock);
+    async_dns_entry_t * entry = _dns_cache_find(name);
+    if(entry){
+        uint32_t now = millis();
+        uint32_t age = now - entry->stored_at;
+        entry->used_at = now;
+        if(!entry->addr){
+            state = (age < _dns_negative_ttl)?ASYNC_DNS_NEGATIVE:ASYNC_DNS_NONE;
+        } else if(age < _dns_ttl){
+            state = ASYNC_DNS_FRESH;
+            *addr = entry->addr;
+            if(age >= _dns_ttl - _dns_ttl / 8 && !entry->prefetching){
+                entry->prefetching = true;
+                *prefetch = true;
+            }
+        } else {
+            state = ASYNC_DNS_EXPIRED;
+            //a prefetch whose answer never came does not block the next one
+            entry->prefetching = false;
+        }
+    }
+    portEXIT_CRITICAL(&_dns_cache_lock);
+    return state;
+}
+
+//a failed lookup (addr 0) does not replace an address that may still be served stale
+static void _dns_cache_store(const char * name, uint32_t addr){
+    if(!CONFIG_ASYNC_TCP_DNS_CACHE_SIZE || !name || strlen(name) >= ASYNC_DNS_NAME_LENGTH){
+        return;
+    }
+    portENTER_CRITICAL(&_dns_cache_lock);
+    uint32_t now = millis();
+    async_dns_entry_t * entry = _dns_cache_find(name);
+    if(!entry){
+        //take a free entry or the least recently used one
+        entry = &_dns_cache[0];
+        for(int i = 0; i < CONFIG_ASYNC_TCP_DNS_CACHE_SIZE; ++ i){
+            if(!_dns_cache[i].name[0]){
+                entry = &_dns_cache[i];
+                break;
+            }
+            if((int32_t)(_dns_cache[i].used_at - entry->used_at) < 0){
+                entry = &_dns_cache[i];
+            }
+        }
+        strcpy(entry->name, name);
+        entry->addr = 0;
+        entry->used_at = now;
+    }
+    entry->prefetching = false;
+    if(addr || !entry->addr){
+        entry->addr = addr;
+        entry->stored_at = now;
+    }
+    portEXIT_CRITICAL(&_dns_cache_lock);
+}
+
+//an expired address of name that may still be used when a lookup failed
+static bool _dns_cache_stale(const char * name, uint32_t * addr){
+    bool found = false;
+    portENTER_CRITICAL(&_dns_cache_lock);
+    async_dns_entry_t * entry = _dns_cache_find(name);
+    if(entry && entry->addr && (millis() - entry->stored_at) < _dns_ttl + _dns_stale){
+        *addr = entry->addr;
+        found = true;
+    }
+    portEXIT_CRITICAL(&_dns_cache_lock);
+    return found;
+}
+
+//In LwIP Thread
+static void _dns_prefetch_found(const char * name, const ip_addr_t * ipaddr, void * /*arg*/){
+    _dns_cache_store(name, ipaddr?ipaddr->u_addr.ip4.addr:0);
+}
+
+static void _dns_prefetch(const char * name){
+    ip_addr_t addr;
+    _dns_prefetches.fetch_add(1, std::memory_order_relaxed);
+    err_t err = dns_gethostbyname(name, &addr, &_dns_prefetch_found, NULL);
+    if(err == ERR_OK){
+        _dns_cache_store(name, addr.u_addr.ip4.addr);
+    } else if(err != ERR_INPROGRESS){
+        //no callback follows, this keeps the address and allows the next prefetch
+        _dns_cache_store(name, 0);
+    }
+}
+
+/*
+ * TLS Sessions
+ *
+ * Secure clients share one mbedTLS client configuration, created by the first
+ * of them. The session of the last handshake with every host and port is kept,
+ * by ID or ticket as the server issued it, and offered by the next connection,
+ * so a reconnect skips the certificate exchange and key agreement when the
+ * server still knows it. A resumed session has the master secret of the one
+ * offered, that is how resumptions are told apart from full handshakes.
+ * */
+
+#if ASYNC_TCP_SSL_ENABLED
+
+#ifndef MBEDTLS_PRIVATE
+#define MBEDTLS_PRIVATE(member) member //mbedTLS 2 has no private members
+#endif
+
+#define ASYNC_TLS_MASTER_LENGTH 48
+#define ASYNC_TLS_ERROR -56 //reported to onError when the handshake or a record fails
+
+typedef struct {
+    char host[ASYNC_DNS_NAME_LENGTH];//empty when free
+    uint16_t port;
+    uint32_t used_at;
+    mbedtls_ssl_session session;
+} async_tls_session_t;
+
+typedef struct {
+    mbedtls_ssl_config conf;
+    mbedtls_entropy_context entropy;
+    mbedtls_ctr_drbg_context drbg;
+    mbedtls_x509_crt ca;
+    SemaphoreHandle_t sessions_lock;
+    async_tls_session_t sessions[(CONFIG_ASYNC_TCP_TLS_SESSION_CACHE > 0)?CONFIG_ASYNC_TCP_TLS_SESSION_CACHE:1];
+} async_tls_config_t;
+
+struct async_tls {
+    mbedtls_ssl_context ssl;
+    char host[ASYNC_DNS_NAME_LENGTH];//the session cache key with port
+    uint16_t port;
+    pbuf* rx;//received records not yet read by mbedTLS
+    size_t rx_offset;//read bytes of the first pbuf
+    size_t rx_read;//read but not yet reported to LwIP
+    char* tx;//records LwIP had no room for
+    size_t tx_len;
+    bool tx_written;//records were handed to LwIP and not yet sent
+    bool rx_held;//decrypted data waits for memory, read again on the next poll
+    bool established;
+    bool offered;
+    unsigned char master[ASYNC_TLS_MASTER_LENGTH];//of the offered session
+};
+
+static std::atomic<uint32_t> _tls_handshakes(0);
+static std::atomic<uint32_t> _tls_resumed(0);
+static std::atomic<uint32_t> _tls_offered(0);
+static std::atomic<uint32_t> _tls_failures(0);
+
+static async_tls_config_t * _tls_config_create(){
+    async_tls_config_t * config = new (std::nothrow) async_tls_config_t;
+    if(!config){
+        return NULL;
+    }
+    mbedtls_ssl_config_init(&config->conf);
+    mbedtls_entropy_init(&config->entropy);
+    mbedtls_ctr_drbg_init(&config->drbg);
+    mbedtls_x509_crt_init(&config->ca);
+    config->sessions_lock = xSemaphoreCreateMutex();
+    for(int i = 0; i < CONFIG_ASYNC_TCP_TLS_SESSION_CACHE; ++ i){
+        config->sessions[i].host[0] = 0;
+        mbedtls_ssl_session_init(&config->sessions[i].session);
+    }
+    int ret = config->sessions_lock?0:MBEDTLS_ERR_SSL_ALLOC_FAILED;
+    if(!ret){
+        ret = mbedtls_ctr_drbg_seed(&config->drbg, mbedtls_entropy_func, &config->entropy, (const unsigned char *)"async_tcp", 9);
+    }
+    if(!ret){
+        ret = mbedtls_ssl_config_defaults(&config->conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
+    }
+    if(ret){
+        log_e("tls setup failed: -0x%04x", -ret);
+        if(config->sessions_lock){
+            vSemaphoreDelete(config->sessions_lock);
+        }
+        mbedtls_ssl_config_free(&config->conf);
+        mbedtls_ctr_drbg_free(&config->drbg);
+        mbedtls_entropy_free(&config->entropy);
+        delete config;
+        return NULL;
+    }
+    mbedtls_ssl_conf_rng(&config->conf, mbedtls_ctr_drbg_random, &config->drbg);
+    mbedtls_ssl_conf_authmode(&config->conf, MBEDTLS_SSL_VERIFY_NONE);
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+    mbedtls_ssl_conf_session_tickets(&config->conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+    return config;
+}
+
+//created once on first use, NULL when mbedTLS could not be set up
+static async_tls_config_t * _tls_config(){
+    static async_tls_config_t * config = _tls_config_create();
+    return config;
+}
+
+bool async_tcp_set_tls_ca(const char * pem){
+    async_tls_config_t * config = _tls_config();
+    if(!config || !pem){
+        return false;
+    }
+    mbedtls_x509_crt_free(&config->ca);
+    mbedtls_x509_crt_init(&config->ca);
+    int ret = mbedtls_x509_crt_parse(&config->ca, (const unsigned char *)pem, strlen(pem) + 1);
+    if(ret){
+        log_e("bad CA: -0x%04x", -ret);
+        return false;
+    }
+    mbedtls_ssl_conf_ca_chain(&config->conf, &config->ca, NULL);
+    mbedtls_ssl_conf_authmode(&config->conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+    return true;
+}
+
+void async_tcp_flush_tls_sessions(){
+    async_tls_config_t * config = _tls_config();
+    if(!config){
+        return;
+    }
+    xSemaphoreTake(config->sessions_lock, portMAX_DELAY);
+    for(int i = 0; i < CONFIG_ASYNC_TCP_TLS_SESSION_CACHE; ++ i){
+        config->sessions[i].host[0] = 0;
+        mbedtls_ssl_session_free(&config->sessions[i].session);
+        mbedtls_ssl_session_init(&config->sessions[i].session);
+    }
+    xSemaphoreGive(config->sessions_lock);
+}
+
+void async_tcp_get_tls_stats(async_tls_stats_t * stats){
+    if(!stats){
+        return;
+    }
+    stats->handshakes = _tls_handshakes.load(std::memory_order_relaxed);
+    stats->resumed = _tls_resumed.load(std::memory_order_relaxed);
+    stats->offered = _tls_offered.load(std::memory_order_relaxed);
+    stats->failures = _tls_failures.load(std::memory_order_relaxed);
+}
+
+int ssl_match_fingerprint(SSL * ssl, const uint8_t * fingerprint){
+    const mbedtls_x509_crt * crt = ssl?mbedtls_ssl_get_peer_cert(&ssl->ssl):NULL;
+    if(!crt || !fingerprint){
+        return -1;
+    }
+    unsigned char sha1[SHA1_SIZE];
+    if(mbedtls_md(mbedtls_md_info_from_type(MBEDTLS_MD_SHA1), crt->raw.p, crt->raw.len, sha1)){
+        return -1;
+    }
+    return memcmp(sha1, fingerprint, SHA1_SIZE)?-1:SSL_OK;
+}
+
+//call with sessions_lock taken
+static async_tls_session_t * _tls_session_find(async_tls_config_t * config, const async_tls * tls){
+    for(int i = 0; i < CONFIG_ASYNC_TCP_TLS_SESSION_CACHE; ++ i){
+        async_tls_session_t * entry = &config->sessions[i];
+        if(entry->host[0] && entry->port == tls->port && !strcasecmp(entry->host, tls->host)){
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static void _tls_session_offer(async_tls * tls){
+    async_tls_config_t * config = _tls_config();
+    xSemaphoreTake(config->sessions_lock, portMAX_DELAY);
+    async_tls_session_t * entry = _tls_session_find(config, tls);
+    if(entry && !mbedtls_ssl_set_session(&tls->ssl, &entry->session)){
+        memcpy(tls->master, entry->session.MBEDTLS_PRIVATE(master), ASYNC_TLS_MASTER_LENGTH);
+        tls->offered = true;
+        entry->used_at = millis();
+        _tls_offered.fetch_add(1, std::memory_order_relaxed);
+    }
+    xSemaphoreGive(config->sessions_lock);
+}
+
+//keeps the session of a completed handshake, true when it resumed the offered one
+static bool _tls_session_store(async_tls * tls){
+    bool resumed = false;
+    async_tls_config_t * config = _tls_config();
+    xSemaphoreTake(config->sessions_lock, portMAX_DELAY);
+    async_tls_session_t * entry = _tls_session_find(config, tls);
+    if(!entry && CONFIG_ASYNC_TCP_TLS_SESSION_CACHE > 0){
+        //a free entry or else the least recently used one
+        entry = &config->sessions[0];
+        for(int i = 0; i < CONFIG_ASYNC_TCP_TLS_SESSION_CACHE && entry->host[0]; ++ i){
+            async_tls_session_t * e = &config->sessions[i];
+            if(!e->host[0] || (int32_t)(e->used_at - entry->used_at) < 0){
+                entry = e;
+            }
+        }
+    }
+    if(entry){
+        mbedtls_ssl_session_free(&entry->session);
+        mbedtls_ssl_session_init(&entry->session);
+        if(!mbedtls_ssl_get_session(&tls->ssl, &entry->session)){
+            strcpy(entry->host, tls->host);
+            entry->port = tls->port;
+            entry->used_at = millis();
+            resumed = tls->offered && !memcmp(tls->master, entry->session.MBEDTLS_PRIVATE(master), ASYNC_TLS_MASTER_LENGTH);
+        } else {
+            entry->host[0] = 0;
+        }
+    }
+    xSemaphoreGive(config->sessions_lock);
+    return resumed;
+}
+
+//a session the server refused to resume with must not be offered again
+static void _tls_session_drop(async_tls * tls){
+    async_tls_config_t * config = _tls_config();
+    xSemaphoreTake(config->sessions_lock, portMAX_DELAY);
+    async_tls_session_t * entry = _tls_session_find(config, tls);
+    if(entry){
+        entry->host[0] = 0;
+        mbedtls_ssl_session_free(&entry->session);
+        mbedtls_ssl_session_init(&entry->session);
+    }
+    xSemaphoreGive(config->sessions_lock);
+}
+
+#endif
+
 /*
  * LwIP Callbacks
  * */
 
 static int8_t _tcp_clear_events(void * arg) {
-    lwip_event_packet_t * e = (lwip_event_packet_t *)malloc(sizeof(lwip_event_packet_t));
+    lwip_event_packet_t * e = _alloc_event();
+    if(!e){
+        log_e("clear event lost");
+        _event_lost(LWIP_TCP_CLEAR);
+        return ERR_MEM;
+    }
     e->event = LWIP_TCP_CLEAR;
     e->arg = arg;
-    if (!_prepend_async_event(&e)) {
-        free((void*)(e));
+    if(!_add_tombstone(arg)){
+        log_e("no room for tombstone");
+        _free_event(e);
+        return ERR_MEM;
+    }
+    if (!_send_clear_marker(e)) {
+        _remove_tombstone(arg);
+        _free_event(e);
     }
     return ERR_OK;
 }
 
 static int8_t _tcp_connected(void * arg, tcp_pcb * pcb, int8_t err) {
     //ets_printf("+C: 0x%08x\n", pcb);
-    lwip_event_packet_t * e = (lwip_event_packet_t *)malloc(sizeof(lwip_event_packet_t));
+    lwip_event_packet_t * e = _alloc_event();
+    if(!e){
+        log_e("connected event lost");
+        _event_lost(LWIP_TCP_CONNECTED);
+        return ERR_OK;
+    }
     e->event = LWIP_TCP_CONNECTED;
     e->arg = arg;
     e->connected.pcb = pcb;
     e->connected.err = err;
-    if (!_prepend_async_event(&e)) {
-        free((void*)(e));
+    if (!_send_async_event(&e)) {
+        _free_event(e);
     }
     return ERR_OK;
 }
 
 static int8_t _tcp_poll(void * arg, struct tcp_pcb * pcb) {
     //ets_printf("+P: 0x%08x\n", pcb);
-    lwip_event_packet_t * e = (lwip_event_packet_t *)malloc(sizeof(lwip_event_packet_t));
+    AsyncClient * client = reinterpret_cast<AsyncClient*>(arg);
+    AsyncClient::_s_lwip_writable(arg);
+    if(client && client->_poll_queued.load(std::memory_order_relaxed)){
+        client->_polls_suppressed.fetch_add(1, std::memory_order_relaxed);
+        _polls_coalesced.fetch_add(1, std::memory_order_relaxed);
+        return ERR_OK;
+    }
+    if(_queue_mode == ASYNC_QUEUE_NONBLOCK && client){
+        if(_sched_space(_shard_of(arg)) <= ASYNC_POLL_RESERVE){
+            _polls_dropped.fetch_add(1, std::memory_order_relaxed);
+            return ERR_OK;
+        }
+    }
+    lwip_event_packet_t * e = _alloc_event();
+    if(!e){
+        return ERR_OK;
+    }
     e->event = LWIP_TCP_POLL;
     e->arg = arg;
     e->poll.pcb = pcb;
-    if (!_send_async_event(&e)) {
-        free((void*)(e));
+    if(client){
+        client->_poll_queued.store(true, std::memory_order_relaxed);
+    }
+    if (!_try_send_async_event(&e)) {
+        if(client){
+            client->_poll_queued.store(false, std::memory_order_relaxed);
+        }
+        _polls_dropped.fetch_add(1, std::memory_order_relaxed);
+        _free_event(e);
     }
     return ERR_OK;
 }
 
 static int8_t _tcp_recv(void * arg, struct tcp_pcb * pcb, struct pbuf *pb, int8_t err) {
-    lwip_event_packet_t * e = (lwip_event_packet_t *)malloc(sizeof(lwip_event_packet_t));
+    lwip_event_packet_t * e = _alloc_event();
+    if(!e){
+        if(pb){
+            //refuse the data, LwIP keeps it and will deliver it again later
+            if(arg){
+                reinterpret_cast<AsyncClient*>(arg)->_rx_refused.fetch_add(1, std::memory_order_relaxed);
+            }
+            return ERR_MEM;
+        }
+        log_e("fin event lost");
+        _event_lost(LWIP_TCP_FIN);
+        //the PCB still has to be closed
+        return AsyncClient::_s_lwip_fin(arg, pcb, err);
+    }
     e->arg = arg;
     if(pb){
         //ets_printf("+R: 0x%08x\n", pcb);
@@ -279,63 +1742,108 @@ static int8_t _tcp_recv(void * arg, struct tcp_pcb * pcb, struct pbuf *pb, int8_
         e->event = LWIP_TCP_FIN;
         e->fin.pcb = pcb;
         e->fin.err = err;
-        //close the PCB in LwIP thread
-        AsyncClient::_s_lwip_fin(e->arg, e->fin.pcb, e->fin.err);
+        //close the PCB in LwIP thread, ERR_ABRT tells LwIP that it was aborted instead
+        int8_t fin_err = AsyncClient::_s_lwip_fin(e->arg, e->fin.pcb, e->fin.err);
+        if (!_send_async_event(&e, _queue_mode == ASYNC_QUEUE_NONBLOCK)) {
+            _free_event(e);
+        }
+        return fin_err;
     }
-    if (!_send_async_event(&e)) {
-        free((void*)(e));
+    if (!_try_send_async_event(&e)) {
+        _free_event(e);
+        //LwIP keeps the data as refused and offers it again, the window stays closed meanwhile
+        _recv_deferred.fetch_add(1, std::memory_order_relaxed);
+        if(arg){
+            reinterpret_cast<AsyncClient*>(arg)->_rx_refused.fetch_add(1, std::memory_order_relaxed);
+        }
+        return ERR_MEM;
     }
     return ERR_OK;
 }
 
 static int8_t _tcp_sent(void * arg, struct tcp_pcb * pcb, uint16_t len) {
     //ets_printf("+S: 0x%08x\n", pcb);
-    lwip_event_packet_t * e = (lwip_event_packet_t *)malloc(sizeof(lwip_event_packet_t));
+    AsyncClient::_s_lwip_writable(arg);
+    lwip_event_packet_t * e = _alloc_event();
+    if(!e){
+        log_e("sent event lost");
+        _event_lost(LWIP_TCP_SENT);
+        return ERR_OK;
+    }
     e->event = LWIP_TCP_SENT;
     e->arg = arg;
     e->sent.pcb = pcb;
     e->sent.len = len;
-    if (!_send_async_event(&e)) {
-        free((void*)(e));
+    if (!_try_send_async_event(&e)) {
+        _free_event(e);
+        //report the acknowledged bytes with the next event of the client
+        reinterpret_cast<AsyncClient*>(arg)->_sent_deferred.fetch_add(len, std::memory_order_relaxed);
+        _sent_folded.fetch_add(1, std::memory_order_relaxed);
     }
     return ERR_OK;
 }
 
 static void _tcp_error(void * arg, int8_t err) {
     //ets_printf("+E: 0x%08x\n", arg);
-    lwip_event_packet_t * e = (lwip_event_packet_t *)malloc(sizeof(lwip_event_packet_t));
+    //LwIP freed the PCB, submissions still in the ring must not reach it
+    AsyncClient::_s_lwip_error(arg);
+    lwip_event_packet_t * e = _alloc_event();
+    if(!e){
+        log_e("error event lost");
+        _event_lost(LWIP_TCP_ERROR);
+        return;
+    }
     e->event = LWIP_TCP_ERROR;
     e->arg = arg;
     e->error.err = err;
-    if (!_send_async_event(&e)) {
-        free((void*)(e));
+    if (!_send_async_event(&e, _queue_mode == ASYNC_QUEUE_NONBLOCK)) {
+        _free_event(e);
     }
 }
 
 static void _tcp_dns_found(const char * name, struct ip_addr * ipaddr, void * arg) {
-    lwip_event_packet_t * e = (lwip_event_packet_t *)malloc(sizeof(lwip_event_packet_t));
+    lwip_event_packet_t * e = _alloc_event();
+    if(!e){
+        log_e("dns event lost");
+        _event_lost(LWIP_TCP_DNS);
+        return;
+    }
     //ets_printf("+DNS: name=%s ipaddr=0x%08x arg=%x\n", name, ipaddr, arg);
     e->event = LWIP_TCP_DNS;
     e->arg = arg;
     e->dns.name = name;
+    uint32_t stale;
     if (ipaddr) {
         memcpy(&e->dns.addr, ipaddr, sizeof(struct ip_addr));
+        _dns_cache_store(name, ipaddr->u_addr.ip4.addr);
+    } else if (_dns_cache_stale(name, &stale)) {
+        memset(&e->dns.addr, 0, sizeof(e->dns.addr));
+        e->dns.addr.type = IPADDR_TYPE_V4;
+        e->dns.addr.u_addr.ip4.addr = stale;
+        _dns_stale_hits.fetch_add(1, std::memory_order_relaxed);
     } else {
         memset(&e->dns.addr, 0, sizeof(e->dns.addr));
+        _dns_cache_store(name, 0);
     }
     if (!_send_async_event(&e)) {
-        free((void*)(e));
+        _free_event(e);
     }
 }
 
 //Used to switch out from LwIP thread
 static int8_t _tcp_accept(void * arg, AsyncClient * client) {
-    lwip_event_packet_t * e = (lwip_event_packet_t *)malloc(sizeof(lwip_event_packet_t));
+    lwip_event_packet_t * e = _alloc_event();
+    if(!e){
+        log_e("accept event lost");
+        _event_lost(LWIP_TCP_ACCEPT);
+        return ERR_MEM;
+    }
     e->event = LWIP_TCP_ACCEPT;
     e->arg = arg;
     e->accept.client = client;
-    if (!_prepend_async_event(&e)) {
-        free((void*)(e));
+    if (!_send_async_event(&e)) {
+        _free_event(e);
+        return ERR_MEM;
     }
     return ERR_OK;
 }
@@ -346,10 +1854,12 @@ static int8_t _tcp_accept(void * arg, AsyncClient * client) {
 
 #include "lwip/priv/tcpip_priv.h"
 
+static void _submit_purge(int32_t closed_slot);
+
 typedef struct {
     struct tcpip_api_call_data call;
     tcp_pcb * pcb;
-    int8_t closed_slot;
+    int32_t closed_slot;
     int8_t err;
     union {
             struct {
@@ -357,6 +1867,13 @@ typedef struct {
                     size_t size;
                     uint8_t apiflags;
             } write;
+            struct {
+                    const async_write_buf_t* bufs;
+                    size_t count;
+                    uint8_t apiflags;
+                    bool output;
+                    size_t written;
+            } writev;
             size_t received;
             struct {
                     ip_addr_t * addr;
@@ -368,25 +1885,34 @@ typedef struct {
                     uint16_t port;
             } bind;
             uint8_t backlog;
+            bool push;//output sends a partial segment even while Nagle waits for an ACK
     };
 } tcp_api_call_t;
 
 static err_t _tcp_output_api(struct tcpip_api_call_data *api_call_msg){
     tcp_api_call_t * msg = (tcp_api_call_t *)api_call_msg;
     msg->err = ERR_CONN;
-    if(msg->closed_slot == -1 || !_closed_slots[msg->closed_slot]) {
+    if(_slot_alive(msg->closed_slot)) {
+        bool nagle = msg->push && !tcp_nagle_disabled(msg->pcb);
+        if(nagle){
+            tcp_nagle_disable(msg->pcb);
+        }
         msg->err = tcp_output(msg->pcb);
+        if(nagle){
+            tcp_nagle_enable(msg->pcb);
+        }
     }
     return msg->err;
 }
 
-static esp_err_t _tcp_output(tcp_pcb * pcb, int8_t closed_slot) {
+static esp_err_t _tcp_output(tcp_pcb * pcb, int32_t closed_slot, bool push = false) {
     if(!pcb){
         return ERR_CONN;
     }
     tcp_api_call_t msg;
     msg.pcb = pcb;
     msg.closed_slot = closed_slot;
+    msg.push = push;
     tcpip_api_call(_tcp_output_api, (struct tcpip_api_call_data*)&msg);
     return msg.err;
 }
@@ -394,13 +1920,13 @@ static esp_err_t _tcp_output(tcp_pcb * pcb, int8_t closed_slot) {
 static err_t _tcp_write_api(struct tcpip_api_call_data *api_call_msg){
     tcp_api_call_t * msg = (tcp_api_call_t *)api_call_msg;
     msg->err = ERR_CONN;
-    if(msg->closed_slot == -1 || !_closed_slots[msg->closed_slot]) {
+    if(_slot_alive(msg->closed_slot)) {
         msg->err = tcp_write(msg->pcb, msg->write.data, msg->write.size, msg->write.apiflags);
     }
     return msg->err;
 }
 
-static esp_err_t _tcp_write(tcp_pcb * pcb, int8_t closed_slot, const char* data, size_t size, uint8_t apiflags) {
+static esp_err_t _tcp_write(tcp_pcb * pcb, int32_t closed_slot, const char* data, size_t size, uint8_t apiflags) {
     if(!pcb){
         return ERR_CONN;
     }
@@ -414,17 +1940,76 @@ static esp_err_t _tcp_write(tcp_pcb * pcb, int8_t closed_slot, const char* data,
     return msg.err;
 }
 
+static err_t _tcp_writev_api(struct tcpip_api_call_data *api_call_msg){
+    tcp_api_call_t * msg = (tcp_api_call_t *)api_call_msg;
+    msg->err = ERR_CONN;
+    msg->writev.written = 0;
+    if(!_slot_alive(msg->closed_slot)) {
+        return msg->err;
+    }
+    msg->err = ERR_OK;
+    size_t last = msg->writev.count;
+    while(last && !msg->writev.bufs[last - 1].size){
+        --last;
+    }
+    for(size_t i = 0; i < last; ++i){
+        const async_write_buf_t & buf = msg->writev.bufs[i];
+        if(!buf.size || !buf.data){
+            continue;
+        }
+        size_t room = tcp_sndbuf(msg->pcb);
+        size_t will_send = (room < buf.size) ? room : buf.size;
+        if(!will_send){
+            break;
+        }
+        //only the end of the batch gets the PSH flag
+        uint8_t apiflags = msg->writev.apiflags;
+        if(i + 1 < last && will_send == buf.size){
+            apiflags |= TCP_WRITE_FLAG_MORE;
+        }
+        msg->err = tcp_write(msg->pcb, buf.data, will_send, apiflags);
+        if(msg->err != ERR_OK){
+            break;
+        }
+        msg->writev.written += will_send;
+        if(will_send < buf.size){
+            break;
+        }
+    }
+    if(msg->writev.output && msg->writev.written){
+        msg->err = tcp_output(msg->pcb);
+    }
+    return msg->err;
+}
+
+static size_t _tcp_writev(tcp_pcb * pcb, int32_t closed_slot, const async_write_buf_t* bufs, size_t count, uint8_t apiflags, bool output, int8_t * err) {
+    if(!pcb){
+        *err = ERR_CONN;
+        return 0;
+    }
+    tcp_api_call_t msg;
+    msg.pcb = pcb;
+    msg.closed_slot = closed_slot;
+    msg.writev.bufs = bufs;
+    msg.writev.count = count;
+    msg.writev.apiflags = apiflags;
+    msg.writev.output = output;
+    tcpip_api_call(_tcp_writev_api, (struct tcpip_api_call_data*)&msg);
+    *err = msg.err;
+    return msg.writev.written;
+}
+
 static err_t _tcp_recved_api(struct tcpip_api_call_data *api_call_msg){
     tcp_api_call_t * msg = (tcp_api_call_t *)api_call_msg;
     msg->err = ERR_CONN;
-    if(msg->closed_slot == -1 || !_closed_slots[msg->closed_slot]) {
+    if(_slot_alive(msg->closed_slot)) {
         msg->err = 0;
         tcp_recved(msg->pcb, msg->received);
     }
     return msg->err;
 }
 
-static esp_err_t _tcp_recved(tcp_pcb * pcb, int8_t closed_slot, size_t len) {
+static esp_err_t _tcp_recved(tcp_pcb * pcb, int32_t closed_slot, size_t len) {
     if(!pcb){
         return ERR_CONN;
     }
@@ -439,13 +2024,18 @@ static esp_err_t _tcp_recved(tcp_pcb * pcb, int8_t closed_slot, size_t len) {
 static err_t _tcp_close_api(struct tcpip_api_call_data *api_call_msg){
     tcp_api_call_t * msg = (tcp_api_call_t *)api_call_msg;
     msg->err = ERR_CONN;
-    if(msg->closed_slot == -1 || !_closed_slots[msg->closed_slot]) {
+    if(_slot_alive(msg->closed_slot)) {
         msg->err = tcp_close(msg->pcb);
+        if(msg->err == ERR_OK) {
+            //the PCB belongs to LwIP now, submissions still in the ring must not reach it
+            _submit_purge(msg->closed_slot);
+            _release_slot(msg->closed_slot);
+        }
     }
     return msg->err;
 }
 
-static esp_err_t _tcp_close(tcp_pcb * pcb, int8_t closed_slot) {
+static esp_err_t _tcp_close(tcp_pcb * pcb, int32_t closed_slot) {
     if(!pcb){
         return ERR_CONN;
     }
@@ -459,13 +2049,15 @@ static esp_err_t _tcp_close(tcp_pcb * pcb, int8_t closed_slot) {
 static err_t _tcp_abort_api(struct tcpip_api_call_data *api_call_msg){
     tcp_api_call_t * msg = (tcp_api_call_t *)api_call_msg;
     msg->err = ERR_CONN;
-    if(msg->closed_slot == -1 || !_closed_slots[msg->closed_slot]) {
+    if(_slot_alive(msg->closed_slot)) {
         tcp_abort(msg->pcb);
+        _submit_purge(msg->closed_slot);
+        _release_slot(msg->closed_slot);
     }
     return msg->err;
 }
 
-static esp_err_t _tcp_abort(tcp_pcb * pcb, int8_t closed_slot) {
+static esp_err_t _tcp_abort(tcp_pcb * pcb, int32_t closed_slot) {
     if(!pcb){
         return ERR_CONN;
     }
@@ -482,7 +2074,7 @@ static err_t _tcp_connect_api(struct tcpip_api_call_data *api_call_msg){
     return msg->err;
 }
 
-static esp_err_t _tcp_connect(tcp_pcb * pcb, int8_t closed_slot, ip_addr_t * addr, uint16_t port, tcp_connected_fn cb) {
+static esp_err_t _tcp_connect(tcp_pcb * pcb, int32_t closed_slot, ip_addr_t * addr, uint16_t port, tcp_connected_fn cb) {
     if(!pcb){
         return ESP_FAIL;
     }
@@ -529,32 +2121,620 @@ static tcp_pcb * _tcp_listen_with_backlog(tcp_pcb * pcb, uint8_t backlog) {
     tcp_api_call_t msg;
     msg.pcb = pcb;
     msg.closed_slot = -1;
-    msg.backlog = backlog?backlog:0xFF;
+    msg.backlog = backlog?backlog:0xFF;//0 is the largest backlog, see setBacklog()
     tcpip_api_call(_tcp_listen_api, (struct tcpip_api_call_data*)&msg);
     return msg.pcb;
 }
 
 
 
+/*
+  Zero-copy buffers
+ */
+
+struct async_tx_ref {
+    AsyncBuffer * buffer;
+    uint32_t end; //_tx_queued after the write, released once _tx_acked passes it
+    async_tx_ref * next;
+};
+
+//guards the in-flight lists of all clients, they are touched by writers and the service tasks
+static portMUX_TYPE _tx_refs_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static void _free_allocated_buffer(void * /*arg*/, const char * data, size_t /*size*/){
+    ::free((void*)data);
+}
+
+AsyncBuffer::AsyncBuffer(const char* data, size_t size, AcBufferReleaseHandler cb, void* arg)
+: _data((char*)data)
+, _size(size)
+, _refs(1)
+, _release_cb(cb)
+, _release_cb_arg(arg)
+{}
+
+AsyncBuffer* AsyncBuffer::allocate(size_t size){
+    char * data = (char*)malloc(size);
+    if(!data) {
+        return NULL;
+    }
+    AsyncBuffer * buffer = new (std::nothrow) AsyncBuffer(data, size, _free_allocated_buffer, NULL);
+    if(!buffer) {
+        ::free(data);
+    }
+    return buffer;
+}
+
+void AsyncBuffer::ref(){
+    _refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+void AsyncBuffer::unref(){
+    if(_refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        if(_release_cb) {
+            _release_cb(_release_cb_arg, _data, _size);
+        }
+        delete this;
+    }
+}
+
+/*
+ * Submission Ring
+ *
+ * submit() and the receive window updates do not wait in tcpip_api_call().
+ * Any task queues them in a bounded lock-free ring (Vyukov's, every entry
+ * carries the position it is ready for) and only the first entry after a
+ * drain posts a call to the TCP/IP thread, so a burst of writes shares one
+ * wakeup. The TCP/IP thread takes all entries in one go, checks the slot of
+ * each like the API calls do, and sends once per run of writes to the same
+ * PCB. A write that does not fit in the send buffer waits in the queue of
+ * its slot, with the writes of the connection behind it, and goes on when
+ * an ACK or a poll of the connection makes room. Every part handed to LwIP
+ * is reported to the shard of the client with a LWIP_TCP_SUBMITTED control
+ * event, so _tx_queued grows before the SENT of those bytes arrives.
+ * */
+
+#define ASYNC_SUBMIT_MASK (CONFIG_ASYNC_TCP_SUBMIT_RING_SIZE - 1)
+
+static_assert((CONFIG_ASYNC_TCP_SUBMIT_RING_SIZE & ASYNC_SUBMIT_MASK) == 0, "CONFIG_ASYNC_TCP_SUBMIT_RING_SIZE has to be a power of two");
+
+typedef struct {
+    std::atomic<uint32_t> seq;//position the entry is ready to be written at, that plus one once it can be taken
+    AsyncClient * client;
+    tcp_pcb * pcb;
+    int32_t closed_slot;
+    async_tx_ref * ref;//the write with its buffer, NULL for a window update
+    uint32_t len;//offset in the buffer, or the bytes to report to the receive window
+} async_submit_t;
+
+//writes waiting for room, only touched by the TCP/IP thread. The end of a waiting reference holds its offset.
+typedef struct {
+    AsyncClient * client;
+    tcp_pcb * pcb;
+    int32_t closed_slot;
+    async_tx_ref * head;
+    async_tx_ref * tail;
+} async_parked_t;
+
+static async_submit_t _submit_ring[CONFIG_ASYNC_TCP_SUBMIT_RING_SIZE];
+static std::atomic<uint32_t> _submit_head(0);
+static uint32_t _submit_tail = 0;//only the TCP/IP thread takes entries
+static std::atomic<bool> _submit_scheduled(false);
+static std::atomic<bool> _submit_stranded(false);//entries wait in the ring without a drain posted
+static async_parked_t _submit_parked[_number_of_closed_slots];
+static uint32_t _submit_parked_slots = 0;
+static std::atomic<uint32_t> _submit_writes(0);
+static std::atomic<uint32_t> _submit_window_updates(0);
+static std::atomic<uint32_t> _submit_ring_full(0);
+static std::atomic<uint32_t> _submit_parks(0);
+static std::atomic<uint32_t> _submit_wakeups(0);
+static std::atomic<uint32_t> _submit_batches(0);
+static uint32_t _submit_max_batch = 0;
+
+static bool _submit_ring_ready = []() {
+    for (int i = 0; i < CONFIG_ASYNC_TCP_SUBMIT_RING_SIZE; ++ i) {
+        _submit_ring[i].seq.store(i, std::memory_order_relaxed);
+    }
+    return true;
+}();
+
+void async_tcp_get_submit_stats(async_submit_stats_t * stats){
+    if(!stats){
+        return;
+    }
+    stats->writes = _submit_writes.load(std::memory_order_relaxed);
+    stats->window_updates = _submit_window_updates.load(std::memory_order_relaxed);
+    stats->ring_full = _submit_ring_full.load(std::memory_order_relaxed);
+    stats->parked = _submit_parks.load(std::memory_order_relaxed);
+    stats->wakeups = _submit_wakeups.load(std::memory_order_relaxed);
+    stats->batches = _submit_batches.load(std::memory_order_relaxed);
+    stats->max_batch = _submit_max_batch;
+}
+
+//nothing was handed to LwIP or the connection was reset, nothing sends from the buffer
+static void _submit_release(async_tx_ref * ref){
+    ref->buffer->unref();
+    delete ref;
+}
+
+//the reference belongs to the client once done is reported
+static void _submit_report(AsyncClient * client, async_tx_ref * ref, uint32_t len, bool done, int8_t err){
+    lwip_event_packet_t * e = _alloc_event();
+    if(!e){
+        //LwIP may still send from the buffer, keep it rather than free it under the PCB
+        log_e("submitted event lost");
+        _event_lost(LWIP_TCP_SUBMITTED);
+        return;
+    }
+    e->event = LWIP_TCP_SUBMITTED;
+    e->arg = client;
+    e->submitted.ref = ref;
+    e->submitted.len = len;
+    e->submitted.done = done;
+    e->submitted.err = err;
+    if (!_send_async_event(&e)) {
+        _free_event(e);
+    }
+}
+
+//hands what fits of the buffer to LwIP, false when the rest has to wait for room
+static bool _submit_write(AsyncClient * client, tcp_pcb * pcb, async_tx_ref * ref, uint32_t * offset){
+    AsyncBuffer * buffer = ref->buffer;
+    size_t size = buffer->size() - *offset;
+    size_t room = tcp_sndbuf(pcb);
+    size_t will_send = (room < size) ? room : size;
+    int8_t err = ERR_MEM;
+    if(will_send) {
+        err = tcp_write(pcb, buffer->data() + *offset, will_send, 0);
+    }
+    if(err == ERR_MEM) {
+        //out of send buffer or segments, the ACK of the queued data makes room
+        return false;
+    }
+    if(err != ERR_OK) {
+        _submit_report(client, ref, 0, true, err);
+        return true;
+    }
+    *offset += will_send;
+    _submit_report(client, ref, will_send, will_send == size, ERR_OK);
+    return will_send == size;
+}
+
+//the slot is gone and the connection with it, LwIP holds none of the buffers any more
+static void _submit_purge(int32_t closed_slot){
+    if(closed_slot < 0 || !_submit_parked_slots){
+        return;
+    }
+    async_parked_t & park = _submit_parked[closed_slot & ASYNC_SLOT_INDEX_MASK];
+    if(!park.head || park.closed_slot != closed_slot){
+        return;
+    }
+    while(park.head){
+        async_tx_ref * ref = park.head;
+        park.head = ref->next;
+        _submit_release(ref);
+    }
+    park.tail = NULL;
+    -- _submit_parked_slots;
+}
+
+//an ACK or a poll of the connection, continue with the writes that waited for room
+static void _submit_resume(int32_t closed_slot){
+    if(closed_slot < 0 || !_submit_parked_slots){
+        return;
+    }
+    async_parked_t & park = _submit_parked[closed_slot & ASYNC_SLOT_INDEX_MASK];
+    if(!park.head || park.closed_slot != closed_slot){
+        return;
+    }
+    bool written = false;
+    while(park.head){
+        async_tx_ref * ref = park.head;
+        //read before the report hands the reference over
+        async_tx_ref * next = ref->next;
+        uint32_t offset = ref->end;
+        bool done = _submit_write(park.client, park.pcb, ref, &offset);
+        written = written || offset != ref->end;
+        if(!done){
+            ref->end = offset;
+            break;
+        }
+        park.head = next;
+    }
+    if(!park.head){
+        park.tail = NULL;
+        -- _submit_parked_slots;
+    }
+    if(written){
+        tcp_output(park.pcb);
+    }
+}
+
+static void _submit_park(const async_submit_t & job, uint32_t offset){
+    async_parked_t & park = _submit_parked[job.closed_slot & ASYNC_SLOT_INDEX_MASK];
+    if(park.head && park.closed_slot != job.closed_slot){
+        //left by an earlier connection of the slot
+        _submit_purge(park.closed_slot);
+    }
+    job.ref->end = offset;
+    job.ref->next = NULL;
+    if(park.head){
+        park.tail->next = job.ref;
+    } else {
+        park.client = job.client;
+        park.pcb = job.pcb;
+        park.closed_slot = job.closed_slot;
+        park.head = job.ref;
+        ++ _submit_parked_slots;
+        _submit_parks.fetch_add(1, std::memory_order_relaxed);
+    }
+    park.tail = job.ref;
+}
+
+static bool _submit_take(async_submit_t * job){
+    async_submit_t & entry = _submit_ring[_submit_tail & ASYNC_SUBMIT_MASK];
+    if(entry.seq.load(std::memory_order_acquire) != _submit_tail + 1){
+        return false;
+    }
+    job->client = entry.client;
+    job->pcb = entry.pcb;
+    job->closed_slot = entry.closed_slot;
+    job->ref = entry.ref;
+    job->len = entry.len;
+    entry.seq.store(_submit_tail + CONFIG_ASYNC_TCP_SUBMIT_RING_SIZE, std::memory_order_release);
+    ++ _submit_tail;
+    return true;
+}
+
+//runs in the TCP/IP thread
+static void _submit_drain(void * /*arg*/){
+    //taking the flag pairs with the exchange of the producers, entries queued from here on post a new call
+    _submit_scheduled.exchange(false, std::memory_order_acq_rel);
+    async_submit_t job;
+    tcp_pcb * written = NULL;//PCB of the current run of writes, sent when the run ends
+    uint32_t taken = 0;
+    while(_submit_take(&job)){
+        ++ taken;
+        if(written && written != job.pcb){
+            tcp_output(written);
+            written = NULL;
+        }
+        bool alive = _slot_alive(job.closed_slot);
+        if(!job.ref){
+            if(alive){
+                tcp_recved(job.pcb, job.len);
+            }
+            continue;
+        }
+        if(!alive){
+            //the client may be gone already, there is no one to report to
+            _submit_release(job.ref);
+            continue;
+        }
+        async_parked_t & park = _submit_parked[job.closed_slot & ASYNC_SLOT_INDEX_MASK];
+        if(park.head && park.closed_slot == job.closed_slot){
+            //behind the writes of the connection that wait for room
+            _submit_park(job, job.len);
+            continue;
+        }
+        uint32_t offset = job.len;
+        if(!_submit_write(job.client, job.pcb, job.ref, &offset)){
+            _submit_park(job, offset);
+        }
+        if(offset != job.len){
+            written = job.pcb;
+        }
+    }
+    if(written){
+        tcp_output(written);
+    }
+    _submit_batches.fetch_add(1, std::memory_order_relaxed);
+    if(taken > _submit_max_batch){
+        _submit_max_batch = taken;
+    }
+}
+
+//posts a drain unless one is posted already, never waits for room in the mailbox of the TCP/IP thread
+static void _submit_schedule(){
+    if(_submit_scheduled.exchange(true, std::memory_order_acq_rel)){
+        return;
+    }
+    if(tcpip_try_callback(_submit_drain, NULL) != ERR_OK){
+        //the TCP/IP thread may be waiting for room in the queue of the caller, the entries stay
+        //in the ring for the next push, the service task or a poll of the TCP/IP thread
+        _submit_stranded.store(true, std::memory_order_relaxed);
+        _submit_scheduled.store(false, std::memory_order_release);
+        return;
+    }
+    _submit_wakeups.fetch_add(1, std::memory_order_relaxed);
+}
+
+//service task, posts the drain a full mailbox refused once it had room for it
+static void _submit_retry(){
+    if(_submit_stranded.load(std::memory_order_relaxed) && _submit_stranded.exchange(false, std::memory_order_relaxed)){
+        _submit_schedule();
+    }
+}
+
+//TCP/IP thread, drains what no posted call will
+static void _submit_recover(){
+    if(_submit_stranded.load(std::memory_order_relaxed) && _submit_stranded.exchange(false, std::memory_order_relaxed)){
+        _submit_drain(NULL);
+    }
+}
+
+//false when the ring is full
+static bool _submit_push(AsyncClient * client, tcp_pcb * pcb, int32_t closed_slot, async_tx_ref * ref, uint32_t len){
+    uint32_t pos = _submit_head.load(std::memory_order_relaxed);
+    async_submit_t * entry;
+    for(;;){
+        entry = &_submit_ring[pos & ASYNC_SUBMIT_MASK];
+        int32_t lag = (int32_t)(entry->seq.load(std::memory_order_acquire) - pos);
+        if(!lag){
+            if(_submit_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)){
+                break;
+            }
+        } else if(lag < 0){
+            _submit_ring_full.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        } else {
+            pos = _submit_head.load(std::memory_order_relaxed);
+        }
+    }
+    entry->client = client;
+    entry->pcb = pcb;
+    entry->closed_slot = closed_slot;
+    entry->ref = ref;
+    entry->len = len;
+    entry->seq.store(pos + 1, std::memory_order_release);
+    if(ref){
+        _submit_writes.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        _submit_window_updates.fetch_add(1, std::memory_order_relaxed);
+    }
+    _submit_schedule();
+    return true;
+}
+
+/*
+  Receive view
+ */
+
+async_rx_segment_t AsyncRxView::iterator::operator*() const {
+    async_rx_segment_t seg = { (const char*)_pb->payload + _skip, _pb->len - _skip };
+    return seg;
+}
+
+AsyncRxView::iterator & AsyncRxView::iterator::operator++(){
+    _pb = _pb->next;
+    _skip = 0;
+    return *this;
+}
+
+AsyncRxView::iterator AsyncRxView::begin(){
+    return iterator(_client->_rx_chain, _client->_rx_chain_offset);
+}
+
+size_t AsyncRxView::available(){
+    return _client->_rx_chain_len;
+}
+
+int AsyncRxView::peek(size_t offset){
+    uint8_t c;
+    if(peek(&c, 1, offset) != 1) {
+        return -1;
+    }
+    return c;
+}
+
+size_t AsyncRxView::peek(void* dst, size_t len, size_t offset){
+    size_t copied = 0;
+    for(iterator it = begin(); it != end() && copied < len; ++it) {
+        async_rx_segment_t seg = *it;
+        if(offset >= seg.size) {
+            offset -= seg.size;
+            continue;
+        }
+        size_t n = seg.size - offset;
+        if(n > len - copied) {
+            n = len - copied;
+        }
+        memcpy((uint8_t*)dst + copied, seg.data + offset, n);
+        copied += n;
+        offset = 0;
+    }
+    return copied;
+}
+
+size_t AsyncRxView::read(void* dst, size_t len){
+    return consume(peek(dst, len));
+}
+
+size_t AsyncRxView::consume(size_t len){
+    return _client->_rx_consume(len);
+}
+
+/*
+  Receive window updates
+ */
+
+#ifndef ASYNC_MAX_UNACKED_RX
+#define ASYNC_MAX_UNACKED_RX (TCP_MSS * 2) //the ack policy never holds back more, the sender would stall
+#endif
+
+static std::atomic<uint32_t> _ack_requests(0);
+static std::atomic<uint32_t> _ack_calls(0);
+
+void async_tcp_get_ack_stats(async_ack_stats_t * stats){
+    if(!stats){
+        return;
+    }
+    stats->requests = _ack_requests.load(std::memory_order_relaxed);
+    stats->calls = _ack_calls.load(std::memory_order_relaxed);
+    stats->saved = stats->requests - stats->calls;
+}
+
+/*
+ * Client Callbacks
+ *
+ * The std::function callbacks set by onConnect() and the rest live in one
+ * block, allocated by the first of them, that is the handler of the client.
+ * Clients with their own AsyncClientHandler never allocate it.
+ * */
+
+void AsyncClientHandler::onPacket(AsyncClient* client, struct pbuf* pb){
+    client->ackPacket(pb);
+}
+
+class AsyncClientCallbacks: public AsyncClientHandler {
+  public:
+    AcConnectHandler connect_cb;
+    void* connect_cb_arg;
+    AcConnectHandler discard_cb;
+    void* discard_cb_arg;
+    AcAckHandler sent_cb;
+    void* sent_cb_arg;
+    AcErrorHandler error_cb;
+    void* error_cb_arg;
+    AcDataHandler recv_cb;
+    void* recv_cb_arg;
+    AcPacketHandler pb_cb;
+    void* pb_cb_arg;
+    AcTimeoutHandler timeout_cb;
+    void* timeout_cb_arg;
+    AcRecvHandler rx_view_cb;
+    void* rx_view_cb_arg;
+    AcConnectHandler poll_cb;
+    void* poll_cb_arg;
+    AcWatermarkHandler wm_cb;
+    void* wm_cb_arg;
+    AcSubmitHandler submit_cb;
+    void* submit_cb_arg;
+
+    AsyncClientCallbacks(){
+        clear();
+    }
+
+    void clear(){
+        connect_cb = 0;
+        connect_cb_arg = 0;
+        discard_cb = 0;
+        discard_cb_arg = 0;
+        sent_cb = 0;
+        sent_cb_arg = 0;
+        error_cb = 0;
+        error_cb_arg = 0;
+        recv_cb = 0;
+        recv_cb_arg = 0;
+        pb_cb = 0;
+        pb_cb_arg = 0;
+        timeout_cb = 0;
+        timeout_cb_arg = 0;
+        rx_view_cb = 0;
+        rx_view_cb_arg = 0;
+        poll_cb = 0;
+        poll_cb_arg = 0;
+        wm_cb = 0;
+        wm_cb_arg = 0;
+        submit_cb = 0;
+        submit_cb_arg = 0;
+        _rx_mode = RX_DATA;
+    }
+
+    //onRecv() takes precedence over onPacket(), both over onData()
+    void update_rx_mode(){
+        _rx_mode = rx_view_cb?RX_VIEW:(pb_cb?RX_PACKET:RX_DATA);
+    }
+
+    void onConnect(AsyncClient* client){
+        if(connect_cb) {
+            connect_cb(connect_cb_arg, client);
+        }
+    }
+    void onDisconnect(AsyncClient* client){
+        if(discard_cb) {
+            discard_cb(discard_cb_arg, client);
+        }
+    }
+    void onAck(AsyncClient* client, size_t len, uint32_t time){
+        if(sent_cb) {
+            sent_cb(sent_cb_arg, client, len, time);
+        }
+    }
+    void onError(AsyncClient* client, int8_t error){
+        if(error_cb) {
+            error_cb(error_cb_arg, client, error);
+        }
+    }
+    void onData(AsyncClient* client, void* data, size_t len){
+        if(recv_cb) {
+            recv_cb(recv_cb_arg, client, data, len);
+        }
+    }
+    void onPacket(AsyncClient* client, struct pbuf* pb){
+        pb_cb(pb_cb_arg, client, pb);
+    }
+    void onRecv(AsyncClient* client, AsyncRxView& view){
+        rx_view_cb(rx_view_cb_arg, client, view);
+    }
+    void onTimeout(AsyncClient* client, uint32_t time){
+        if(timeout_cb) {
+            timeout_cb(timeout_cb_arg, client, time);
+        }
+    }
+    void onPoll(AsyncClient* client){
+        if(poll_cb) {
+            poll_cb(poll_cb_arg, client);
+        }
+    }
+    void onWatermark(AsyncClient* client, bool high){
+        if(wm_cb) {
+            wm_cb(wm_cb_arg, client, high);
+        }
+    }
+    void onSubmitted(AsyncClient* client, size_t len, int8_t error){
+        if(submit_cb) {
+            submit_cb(submit_cb_arg, client, len, error);
+        }
+    }
+};
+
 /*
   Async TCP Client
  */
 
+/*
+ * Callback Timing
+ *
+ * Only the outermost handler call of a client is timed, the ones it makes
+ * through write() and close() are part of it. The handler may delete the
+ * client, its destructor then tells the timer to drop the sample.
+ * */
+
+class AsyncCallbackTimer {
+  public:
+    AsyncCallbackTimer(AsyncClient* client)
+    : _client(client->_cb_timer?NULL:client)
+    , _started(0)
+    {
+        if(_client) {
+            _client->_cb_timer = this;
+            _started = micros();
+        }
+    }
+    ~AsyncCallbackTimer(){
+        if(_client) {
+            _client->_cb_timer = NULL;
+            _client->_callback_done(_started);
+        }
+    }
+    AsyncClient* _client;
+    uint32_t _started;
+};
+
 AsyncClient::AsyncClient(tcp_pcb* pcb)
-: _connect_cb(0)
-, _connect_cb_arg(0)
-, _discard_cb(0)
-, _discard_cb_arg(0)
-, _sent_cb(0)
-, _sent_cb_arg(0)
-, _error_cb(0)
-, _error_cb_arg(0)
-, _recv_cb(0)
-, _recv_cb_arg(0)
-, _pb_cb(0)
-, _pb_cb_arg(0)
-, _timeout_cb(0)
-, _timeout_cb_arg(0)
+: _handler(NULL)
+, _callbacks(NULL)
 , _pcb_busy(false)
 , _pcb_sent_at(0)
 , _ack_pcb(true)
@@ -562,27 +2742,69 @@ AsyncClient::AsyncClient(tcp_pcb* pcb)
 , _rx_since_timeout(0)
 , _ack_timeout(ASYNC_MAX_ACK_TIME)
 , _connect_port(0)
+, _tx_queued(0)
+, _tx_acked(0)
+, _tx_refs(NULL)
+, _tx_refs_tail(NULL)
+, _submits_pending(0)
+, _submit_len(0)
+, _rx_chain(NULL)
+, _rx_chain_len(0)
+, _rx_chain_offset(0)
+, _ack_policy(ASYNC_ACK_IMMEDIATE)
+, _ack_policy_value(0)
+, _rx_unacked(0)
+, _rx_unacked_since(0)
+, _corked(false)
+, _cork_nodelay(false)
+, _cork_delay(ASYNC_CORK_TIME)
+, _corked_len(0)
+, _wm_low(0)
+, _wm_high(0)
+, _wm_above(false)
 , prev(NULL)
 , next(NULL)
+, _poll_queued(false)
+, _sent_deferred(0)
+, _polls_suppressed(0)
+, _rx_refused(0)
+, _pool_server(NULL)
+, _pool_release(false)
 {
-    _pcb = pcb;
+    _cb_timer = NULL;
+#if ASYNC_TCP_SSL_ENABLED
+    _tls = NULL;
+#endif
+    _reset_stats();
+    _timer.prev = _timer.next = NULL;
+    _timer.slot = -1;
+    _timer.cb = &_s_timeout;
+    _timer.arg = this;
+    _cork_timer.prev = _cork_timer.next = NULL;
+    _cork_timer.slot = -1;
+    _cork_timer.cb = &_s_cork_timeout;
+    _cork_timer.arg = this;
+    _pcb = NULL;
     _closed_slot = -1;
-    if(_pcb){
-        _allocate_closed_slot();
-        _rx_last_packet = millis();
-        tcp_arg(_pcb, this);
-        tcp_recv(_pcb, &_tcp_recv);
-        tcp_sent(_pcb, &_tcp_sent);
-        tcp_err(_pcb, &_tcp_error);
-        tcp_poll(_pcb, &_tcp_poll, 1);
-    }
+    _attach(pcb);
 }
 
 AsyncClient::~AsyncClient(){
+    if(_cb_timer) {
+        _cb_timer->_client = NULL;
+    }
     if(_pcb) {
         _close();
     }
+    _pool_release = false;
+    _cancel_timeout();
+    _release_tx_buffers(true);
+    _rx_free_chain();
     _free_closed_slot();
+    delete _callbacks;
+#if ASYNC_TCP_SSL_ENABLED
+    _tls_free();
+#endif
 }
 
 /*
@@ -596,6 +2818,7 @@ AsyncClient& AsyncClient::operator=(const AsyncClient& other){
 
     _pcb = other._pcb;
     _closed_slot = other._closed_slot;
+    _poll_queued = false;
     if (_pcb) {
         _rx_last_packet = millis();
         tcp_arg(_pcb, this);
@@ -630,44 +2853,111 @@ AsyncClient & AsyncClient::operator+=(const AsyncClient &other) {
  * Callback Setters
  * */
 
+//makes the callback block the handler, allocated on first use
+AsyncClientCallbacks* AsyncClient::_use_callbacks(){
+    if(!_callbacks){
+        _callbacks = new (std::nothrow) AsyncClientCallbacks();
+        if(!_callbacks){
+            log_e("failed to allocate the callbacks");
+            return NULL;
+        }
+    }
+    _handler = _callbacks;
+    return _callbacks;
+}
+
 void AsyncClient::onConnect(AcConnectHandler cb, void* arg){
-    _connect_cb = cb;
-    _connect_cb_arg = arg;
+    AsyncClientCallbacks* c = _use_callbacks();
+    if(c){
+        c->connect_cb = cb;
+        c->connect_cb_arg = arg;
+    }
 }
 
 void AsyncClient::onDisconnect(AcConnectHandler cb, void* arg){
-    _discard_cb = cb;
-    _discard_cb_arg = arg;
+    AsyncClientCallbacks* c = _use_callbacks();
+    if(c){
+        c->discard_cb = cb;
+        c->discard_cb_arg = arg;
+    }
 }
 
 void AsyncClient::onAck(AcAckHandler cb, void* arg){
-    _sent_cb = cb;
-    _sent_cb_arg = arg;
+    AsyncClientCallbacks* c = _use_callbacks();
+    if(c){
+        c->sent_cb = cb;
+        c->sent_cb_arg = arg;
+    }
 }
 
 void AsyncClient::onError(AcErrorHandler cb, void* arg){
-    _error_cb = cb;
-    _error_cb_arg = arg;
+    AsyncClientCallbacks* c = _use_callbacks();
+    if(c){
+        c->error_cb = cb;
+        c->error_cb_arg = arg;
+    }
 }
 
 void AsyncClient::onData(AcDataHandler cb, void* arg){
-    _recv_cb = cb;
-    _recv_cb_arg = arg;
+    AsyncClientCallbacks* c = _use_callbacks();
+    if(c){
+        c->recv_cb = cb;
+        c->recv_cb_arg = arg;
+    }
 }
 
 void AsyncClient::onPacket(AcPacketHandler cb, void* arg){
-  _pb_cb = cb;
-  _pb_cb_arg = arg;
+    AsyncClientCallbacks* c = _use_callbacks();
+    if(c){
+        c->pb_cb = cb;
+        c->pb_cb_arg = arg;
+        c->update_rx_mode();
+    }
+}
+
+void AsyncClient::onRecv(AcRecvHandler cb, void* arg){
+    AsyncClientCallbacks* c = _use_callbacks();
+    if(c){
+        c->rx_view_cb = cb;
+        c->rx_view_cb_arg = arg;
+        c->update_rx_mode();
+    }
 }
 
 void AsyncClient::onTimeout(AcTimeoutHandler cb, void* arg){
-    _timeout_cb = cb;
-    _timeout_cb_arg = arg;
+    AsyncClientCallbacks* c = _use_callbacks();
+    if(c){
+        c->timeout_cb = cb;
+        c->timeout_cb_arg = arg;
+    }
 }
 
 void AsyncClient::onPoll(AcConnectHandler cb, void* arg){
-    _poll_cb = cb;
-    _poll_cb_arg = arg;
+    AsyncClientCallbacks* c = _use_callbacks();
+    if(c){
+        c->poll_cb = cb;
+        c->poll_cb_arg = arg;
+    }
+}
+
+void AsyncClient::onWatermark(AcWatermarkHandler cb, void* arg){
+    AsyncClientCallbacks* c = _use_callbacks();
+    if(c){
+        c->wm_cb = cb;
+        c->wm_cb_arg = arg;
+    }
+}
+
+void AsyncClient::onSubmitted(AcSubmitHandler cb, void* arg){
+    AsyncClientCallbacks* c = _use_callbacks();
+    if(c){
+        c->submit_cb = cb;
+        c->submit_cb_arg = arg;
+    }
+}
+
+void AsyncClient::setHandler(AsyncClientHandler* handler){
+    _handler = handler;
 }
 
 /*
@@ -694,6 +2984,22 @@ bool AsyncClient::connect(IPAddress ip, uint16_t port){
         return false;
     }
 
+    //calls still pending for a previous connection must not reach the new PCB
+    _free_closed_slot();
+    _allocate_closed_slot();
+
+    //a POLL of a previous connection may have been discarded while still flagged as queued
+    _poll_queued = false;
+    _sent_deferred = 0;
+    _release_tx_buffers(true);
+    _tx_queued = 0;
+    _tx_acked = 0;
+    _submits_pending = 0;
+    _submit_len = 0;
+    _wm_above = false;
+    _rx_unacked = 0;
+    _reset_stats();
+
     tcp_arg(pcb, this);
     tcp_err(pcb, &_tcp_error);
     tcp_recv(pcb, &_tcp_recv);
@@ -712,18 +3018,46 @@ bool AsyncClient::connect(const char* host, uint16_t port){
       return false;
     }
     
+    uint32_t cached = 0;
+    bool prefetch = false;
+    async_dns_state_t state = _dns_cache_lookup(host, &cached, &prefetch);
+    if(state == ASYNC_DNS_FRESH) {
+        _dns_hits.fetch_add(1, std::memory_order_relaxed);
+        if(prefetch) {
+            _dns_prefetch(host);
+        }
+        return connect(IPAddress(cached), port);
+    }
+    if(state == ASYNC_DNS_NEGATIVE) {
+        _dns_negative_hits.fetch_add(1, std::memory_order_relaxed);
+        log_e("cached lookup failure for %s", host);
+        return false;
+    }
+
+    _dns_misses.fetch_add(1, std::memory_order_relaxed);
     err_t err = dns_gethostbyname(host, &addr, (dns_found_callback)&_tcp_dns_found, this);
     if(err == ERR_OK) {
+        _dns_cache_store(host, addr.u_addr.ip4.addr);
         return connect(IPAddress(addr.u_addr.ip4.addr), port);
     } else if(err == ERR_INPROGRESS) {
         _connect_port = port;
         return true;
     }
+    if(_dns_cache_stale(host, &cached)) {
+        _dns_stale_hits.fetch_add(1, std::memory_order_relaxed);
+        return connect(IPAddress(cached), port);
+    }
     log_e("error: %d", err);
     return false;
 }
 
 void AsyncClient::close(bool now){
+#if ASYNC_TCP_SSL_ENABLED
+    if(_pcb && _tls && _tls->established && !now) {
+        //queued ahead of the FIN
+        mbedtls_ssl_close_notify(&_tls->ssl);
+    }
+#endif
     if(_pcb){
         _tcp_recved(_pcb, _closed_slot, _rx_ack_len);
     }
@@ -739,6 +3073,11 @@ int8_t AsyncClient::abort(){
 }
 
 size_t AsyncClient::space(){
+#if ASYNC_TCP_SSL_ENABLED
+    if(_tls) {
+        return _tls_space();
+    }
+#endif
     if((_pcb != NULL) && (_pcb->state == 4)){
         return tcp_sndbuf(_pcb);
     }
@@ -749,6 +3088,11 @@ size_t AsyncClient::add(const char* data, size_t size, uint8_t apiflags) {
     if(!_pcb || size == 0 || data == NULL) {
         return 0;
     }
+#if ASYNC_TCP_SSL_ENABLED
+    if(_tls) {
+        return _tls_write(data, size);
+    }
+#endif
     size_t room = space();
     if(!room) {
         return 0;
@@ -759,15 +3103,36 @@ size_t AsyncClient::add(const char* data, size_t size, uint8_t apiflags) {
     if(err != ERR_OK) {
         return 0;
     }
+    _tx_added(will_send);
+    return will_send;
+}
+
+size_t AsyncClient::addv(const async_write_buf_t* bufs, size_t count, uint8_t apiflags) {
+    if(!_pcb || !bufs || !count) {
+        return 0;
+    }
+#if ASYNC_TCP_SSL_ENABLED
+    if(_tls) {
+        return _tls_writev(bufs, count);
+    }
+#endif
+    int8_t err = ERR_OK;
+    size_t will_send = _tcp_writev(_pcb, _closed_slot, bufs, count, apiflags, false, &err);
+    _tx_added(will_send);
     return will_send;
 }
 
 bool AsyncClient::send(){
+    return _send(false);
+}
+
+bool AsyncClient::_send(bool push){
     int8_t err = ERR_OK;
-    err = _tcp_output(_pcb, _closed_slot);
+    err = _tcp_output(_pcb, _closed_slot, push);
     if(err == ERR_OK){
         _pcb_busy = true;
         _pcb_sent_at = millis();
+        _schedule_timeout();
         return true;
     }
     return false;
@@ -777,7 +3142,7 @@ size_t AsyncClient::ack(size_t len){
     if(len > _rx_ack_len)
         len = _rx_ack_len;
     if(len){
-        _tcp_recved(_pcb, _closed_slot, len);
+        _ack_rx(len);
     }
     _rx_ack_len -= len;
     return len;
@@ -787,7 +3152,7 @@ void AsyncClient::ackPacket(struct pbuf * pb){
   if(!pb){
     return;
   }
-  _tcp_recved(_pcb, _closed_slot, pb->len);
+  _ack_rx(pb->len);
   pbuf_free(pb);
 }
 
@@ -806,38 +3171,211 @@ int8_t AsyncClient::_close(){
         tcp_err(_pcb, NULL);
         tcp_poll(_pcb, NULL, 0);
         _tcp_clear_events(this);
-        err = _tcp_close(_pcb, _closed_slot);
-        if(err != ERR_OK) {
+        if(_tx_refs || _submits_pending.load(std::memory_order_relaxed)) {
+            //LwIP would keep sending from the zero-copy buffers after the callbacks are gone
             err = abort();
+        } else {
+            err = _tcp_close(_pcb, _closed_slot);
+            if(err != ERR_OK) {
+                err = abort();
+            }
         }
         _pcb = NULL;
-        if(_discard_cb) {
-            _discard_cb(_discard_cb_arg, this);
-        }
+        _cancel_timeout();
+        _release_tx_buffers(true);
+        _rx_free_chain();
+        _discarded();
     }
     return err;
 }
 
-void AsyncClient::_allocate_closed_slot(){
-    xSemaphoreTake(_slots_lock, portMAX_DELAY);
-    uint32_t closed_slot_min_index = 0;
-    for (int i = 0; i < _number_of_closed_slots; ++ i) {
-        if ((_closed_slot == -1 || _closed_slots[i] <= closed_slot_min_index) && _closed_slots[i] != 0) {
-            closed_slot_min_index = _closed_slots[i];
-            _closed_slot = i;
+//drop the references of zero-copy writes the peer acknowledged (or all of them when the connection is gone)
+void AsyncClient::_release_tx_buffers(bool all){
+    async_tx_ref * done = NULL;
+    portENTER_CRITICAL(&_tx_refs_lock);
+    uint32_t acked = _tx_acked.load(std::memory_order_relaxed);
+    while(_tx_refs && (all || (int32_t)(_tx_refs->end - acked) <= 0)) {
+        async_tx_ref * r = _tx_refs;
+        _tx_refs = r->next;
+        r->next = done;
+        done = r;
+    }
+    if(!_tx_refs) {
+        _tx_refs_tail = NULL;
+    }
+    portEXIT_CRITICAL(&_tx_refs_lock);
+    //release handlers may free memory, keep them out of the critical section
+    while(done) {
+        async_tx_ref * r = done;
+        done = r->next;
+        r->buffer->unref();
+        delete r;
+    }
+}
+
+size_t AsyncClient::_rx_consume(size_t len){
+    if(len > _rx_chain_len) {
+        len = _rx_chain_len;
+    }
+    size_t left = len;
+    while(left) {
+        pbuf * b = _rx_chain;
+        size_t in_b = b->len - _rx_chain_offset;
+        if(left < in_b) {
+            _rx_chain_offset += left;
+            break;
+        }
+        left -= in_b;
+        //the chain holds the only reference to the next pbuf, unlink it before freeing
+        _rx_chain = b->next;
+        b->next = NULL;
+        pbuf_free(b);
+        _rx_chain_offset = 0;
+    }
+    _rx_chain_len -= len;
+    _ack_rx(len);
+    return len;
+}
+
+void AsyncClient::_ack_rx(size_t len){
+    if(!len || !_pcb) {
+        return;
+    }
+#if ASYNC_TCP_SSL_ENABLED
+    if(_tls) {
+        //the records were reported to LwIP when mbedTLS read them
+        return;
+    }
+#endif
+    _ack_requests.fetch_add(1, std::memory_order_relaxed);
+    if(!_rx_unacked) {
+        _rx_unacked_since = millis();
+    }
+    _rx_unacked += len;
+    bool flush = _rx_unacked >= ASYNC_MAX_UNACKED_RX;
+    switch(_ack_policy) {
+        case ASYNC_ACK_BYTES: flush = flush || _rx_unacked >= _ack_policy_value; break;
+        case ASYNC_ACK_TIMER: flush = flush || (millis() - _rx_unacked_since) >= _ack_policy_value; break;
+        case ASYNC_ACK_BATCH: break;
+        default: flush = true; break;
+    }
+    if(flush) {
+        _ack_flush();
+    }
+}
+
+void AsyncClient::_ack_flush(){
+    if(_rx_unacked && _pcb) {
+        //never waits for the TCP/IP thread, that may be waiting for this task to make room in the queue.
+        //With the ring full the bytes stay pending for the next update, at the latest on poll.
+        if(!_submit_push(this, _pcb, _closed_slot, NULL, _rx_unacked)) {
+            _check_rx_stall();
+            return;
         }
+        _ack_calls.fetch_add(1, std::memory_order_relaxed);
     }
-    if (_closed_slot != -1) {
-        _closed_slots[_closed_slot] = 0;
+    _rx_unacked = 0;
+    _check_rx_stall();
+}
+
+//the handlers are done with the received chain
+void AsyncClient::_ack_batch_done(){
+    if(!_rx_unacked) {
+        return;
+    }
+    if(_ack_policy == ASYNC_ACK_BATCH || (_ack_policy == ASYNC_ACK_TIMER && (millis() - _rx_unacked_since) >= _ack_policy_value)) {
+        _ack_flush();
     }
-    xSemaphoreGive(_slots_lock);
+}
+
+void AsyncClient::_rx_free_chain(){
+    if(_rx_chain) {
+        pbuf_free(_rx_chain);
+        _rx_chain = NULL;
+    }
+    _rx_chain_len = 0;
+    _rx_chain_offset = 0;
+}
+
+void AsyncClient::_allocate_closed_slot(){
+    _closed_slot = _alloc_slot();
 }
 
 void AsyncClient::_free_closed_slot(){
-    if (_closed_slot != -1) {
-        _closed_slots[_closed_slot] = _closed_index;
-        _closed_slot = -1;
-        ++ _closed_index;
+    int32_t slot = _closed_slot;
+    _closed_slot = -1;
+    _release_slot(slot);
+}
+
+//takes over an accepted PCB, in LwIP thread
+void AsyncClient::_attach(tcp_pcb* pcb){
+    _pcb = pcb;
+    if(_pcb){
+        _allocate_closed_slot();
+        _rx_last_packet = millis();
+        tcp_arg(_pcb, this);
+        tcp_recv(_pcb, &_tcp_recv);
+        tcp_sent(_pcb, &_tcp_sent);
+        tcp_err(_pcb, &_tcp_error);
+        tcp_poll(_pcb, &_tcp_poll, 1);
+    }
+}
+
+//back to the state of a new client, the connection is gone already
+void AsyncClient::_recycle(){
+    _free_closed_slot();
+    _cancel_timeout();
+    _handler = NULL;
+    if(_callbacks){
+        _callbacks->clear();
+    }
+    _pcb_busy = false;
+    _pcb_sent_at = 0;
+    _ack_pcb = true;
+    _rx_ack_len = 0;
+    _rx_since_timeout = 0;
+    _ack_timeout = ASYNC_MAX_ACK_TIME;
+    _connect_port = 0;
+    _tx_queued = 0;
+    _tx_acked = 0;
+    _submits_pending = 0;
+    _submit_len = 0;
+    _ack_policy = ASYNC_ACK_IMMEDIATE;
+    _ack_policy_value = 0;
+    _rx_unacked = 0;
+    _rx_unacked_since = 0;
+    _corked = false;
+    _cork_nodelay = false;
+    _cork_delay = ASYNC_CORK_TIME;
+    _corked_len = 0;
+    _wm_low = 0;
+    _wm_high = 0;
+    _wm_above = false;
+    _poll_queued = false;
+    _sent_deferred = 0;
+    _polls_suppressed = 0;
+    _reset_stats();
+#if ASYNC_TCP_SSL_ENABLED
+    _tls_free();
+#endif
+}
+
+//the connection is over, pooled clients are returned to their server after onDisconnect, by the
+//timer of the service task once the dispatch that closed them returned: until then the caller may
+//still use the client, and on the free list _accept() may hand it a new PCB
+void AsyncClient::_discarded(){
+    //read first, a client that is not pooled may be deleted by onDisconnect
+    AsyncServer* server = _pool_server;
+#if ASYNC_TCP_SSL_ENABLED
+    //before the handler, it may connect again
+    _tls_free();
+#endif
+    if(_handler) {
+        _handler->onDisconnect(this);
+    }
+    if(server) {
+        _pool_release = true;
+        _timer_fire(_shard_of(this), &_timer);
     }
 }
 
@@ -850,12 +3388,21 @@ int8_t AsyncClient::_connected(void* pcb, int8_t err){
     if(_pcb){
         _rx_last_packet = millis();
         _pcb_busy = false;
+        _schedule_timeout();
 //        tcp_recv(_pcb, &_tcp_recv);
 //        tcp_sent(_pcb, &_tcp_sent);
 //        tcp_poll(_pcb, &_tcp_poll, 1);
     }
-    if(_connect_cb) {
-        _connect_cb(_connect_cb_arg, this);
+#if ASYNC_TCP_SSL_ENABLED
+    if(_tls && _pcb) {
+        //onConnect follows the handshake
+        _tls_handshake();
+        return ERR_OK;
+    }
+#endif
+    if(_handler) {
+        AsyncCallbackTimer timer(this);
+        _handler->onConnect(this);
     }
     return ERR_OK;
 }
@@ -871,12 +3418,13 @@ void AsyncClient::_error(int8_t err) {
         }
         _pcb = NULL;
     }
-    if(_error_cb) {
-        _error_cb(_error_cb_arg, this, err);
-    }
-    if(_discard_cb) {
-        _discard_cb(_discard_cb_arg, this);
+    _cancel_timeout();
+    _release_tx_buffers(true);
+    _rx_free_chain();
+    if(_handler) {
+        _handler->onError(this, err);
     }
+    _discarded();
 }
 
 //In LwIP Thread
@@ -892,20 +3440,30 @@ int8_t AsyncClient::_lwip_fin(tcp_pcb* pcb, int8_t err) {
         tcp_err(_pcb, NULL);
         tcp_poll(_pcb, NULL, 0);
     }
-    if(tcp_close(_pcb) != ERR_OK) {
+    //zero-copy data still in flight can not be tracked once the arg is gone, reset instead
+    err = ERR_OK;
+    if(_tx_refs || _submits_pending.load(std::memory_order_relaxed) || tcp_close(_pcb) != ERR_OK) {
         tcp_abort(_pcb);
+        err = ERR_ABRT;
     }
+    _submit_purge(_closed_slot);
     _free_closed_slot();
     _pcb = NULL;
-    return ERR_OK;
+    return err;
 }
 
 //In Async Thread
 int8_t AsyncClient::_fin(tcp_pcb* pcb, int8_t err) {
-    _tcp_clear_events(this);
-    if(_discard_cb) {
-        _discard_cb(_discard_cb_arg, this);
+    if(_pcb && _pcb == pcb) {
+        //the FIN came before _connected set the PCB, so _lwip_fin could not close it
+        _close();
+        return ERR_OK;
     }
+    _tcp_clear_events(this);
+    _cancel_timeout();
+    _release_tx_buffers(true);
+    _rx_free_chain();
+    _discarded();
     return ERR_OK;
 }
 
@@ -913,13 +3471,80 @@ int8_t AsyncClient::_sent(tcp_pcb* pcb, uint16_t len) {
     _rx_last_packet = millis();
     //log_i("%u", len);
     _pcb_busy = false;
-    if(_sent_cb) {
-        _sent_cb(_sent_cb_arg, this, len, (millis() - _pcb_sent_at));
+    _tx_acked.fetch_add(len, std::memory_order_relaxed);
+    if(_tx_refs) {
+        _release_tx_buffers(false);
+    }
+#if ASYNC_TCP_SSL_ENABLED
+    if(_tls) {
+        _tls_flush();
+    }
+#endif
+    if(_wm_above.load(std::memory_order_relaxed) && getUnackedBytes() <= _wm_low && _wm_above.exchange(false)) {
+        if(_handler) {
+            AsyncCallbackTimer timer(this);
+            _handler->onWatermark(this, false);
+        }
+    }
+    _check_high_watermark();
+    uint32_t rtt = millis() - _pcb_sent_at;
+    if(!_ack_rtt8) {
+        _ack_rtt8 = rtt << 3;
+    } else {
+        _ack_rtt8 += rtt - (_ack_rtt8 >> 3);
+    }
+    if(rtt > _stats.ack_rtt_max_ms) {
+        _stats.ack_rtt_max_ms = rtt;
+    }
+    if(_handler) {
+        AsyncCallbackTimer timer(this);
+        _handler->onAck(this, len, rtt);
     }
     return ERR_OK;
 }
 
+//SENT events folded by the LwIP thread while the queue was full
+void AsyncClient::_deliver_deferred_sent(tcp_pcb* pcb) {
+    uint32_t len = _sent_deferred.exchange(0, std::memory_order_relaxed);
+    while(len){
+        uint16_t chunk = (len > 0xFFFF)?0xFFFF:len;
+        _sent(pcb, chunk);
+        len -= chunk;
+    }
+}
+
 int8_t AsyncClient::_recv(tcp_pcb* pcb, pbuf* pb, int8_t err) {
+#if ASYNC_TCP_SSL_ENABLED
+    if(_tls && pb) {
+        return _tls_recv(pb);
+    }
+#endif
+    return _deliver(pb);
+}
+
+//hands received data to the handler
+int8_t AsyncClient::_deliver(pbuf* pb) {
+    AsyncClientHandler::rx_mode_t rx_mode = _handler?_handler->rxMode():AsyncClientHandler::RX_DATA;
+    if(rx_mode == AsyncClientHandler::RX_VIEW && pb) {
+        _rx_last_packet = millis();
+        _stats.bytes_in += pb->tot_len;
+        _stats.segments_in += pbuf_clen(pb);
+        //queue behind what the handler left over, the window stays closed for it until consumed
+        _rx_chain_len += pb->tot_len;
+        if(_rx_chain) {
+            pbuf_cat(_rx_chain, pb);
+        } else {
+            _rx_chain = pb;
+        }
+        AsyncRxView view(this);
+        {
+            AsyncCallbackTimer timer(this);
+            _handler->onRecv(this, view);
+        }
+        _ack_batch_done();
+        _check_rx_stall();
+        return ERR_OK;
+    }
     while(pb != NULL) {
         _rx_last_packet = millis();
         //we should not ack before we assimilate the data
@@ -927,20 +3552,26 @@ int8_t AsyncClient::_recv(tcp_pcb* pcb, pbuf* pb, int8_t err) {
         pbuf *b = pb;
         pb = b->next;
         b->next = NULL;
-        if(_pb_cb){
-            _pb_cb(_pb_cb_arg, this, b);
+        _stats.bytes_in += b->len;
+        _stats.segments_in++;
+        if(rx_mode == AsyncClientHandler::RX_PACKET){
+            AsyncCallbackTimer timer(this);
+            _handler->onPacket(this, b);
         } else {
-            if(_recv_cb) {
-                _recv_cb(_recv_cb_arg, this, b->payload, b->len);
+            if(_handler) {
+                AsyncCallbackTimer timer(this);
+                _handler->onData(this, b->payload, b->len);
             }
             if(!_ack_pcb) {
                 _rx_ack_len += b->len;
-            } else if(_pcb) {
-                _tcp_recved(_pcb, _closed_slot, b->len);
+            } else {
+                _ack_rx(b->len);
             }
             pbuf_free(b);
         }
     }
+    _ack_batch_done();
+    _check_rx_stall();
     return ERR_OK;
 }
 
@@ -954,89 +3585,356 @@ int8_t AsyncClient::_poll(tcp_pcb* pcb){
         return ERR_OK;
     }
 
+    // Window updates held back by the ack policy
+    if(_rx_unacked){
+        _ack_flush();
+    }
+#if ASYNC_TCP_SSL_ENABLED
+    if(_tls && _tls->rx_held) {
+        _tls_read();
+    }
+    if(_tls) {
+        _tls_ack_read();
+        _tls_flush();
+    }
+#endif
+
+    // ACK and RX timeouts are handled by the timer of the service task
+    if(_handler) {
+        AsyncCallbackTimer timer(this);
+        _handler->onPoll(this);
+    }
+    return ERR_OK;
+}
+
+//timer of the service task, the deadlines only move later on the data path,
+//so the timer is not moved then but armed again here when it fires early
+void AsyncClient::_timeout(){
+    if(_pool_release){
+        _pool_release = false;
+        if(_pool_server){
+            _pool_server->_release_client(this);
+        }
+        return;
+    }
+    if(!_pcb){
+        return;
+    }
     uint32_t now = millis();
 
     // ACK Timeout
     if(_pcb_busy && _ack_timeout && (now - _pcb_sent_at) >= _ack_timeout){
         _pcb_busy = false;
-        log_w("ack timeout %d", pcb->state);
-        if(_timeout_cb)
-            _timeout_cb(_timeout_cb_arg, this, (now - _pcb_sent_at));
-        return ERR_OK;
+        log_w("ack timeout %d", _pcb->state);
+        _stats.ack_timeouts++;
+        if(_handler) {
+            AsyncCallbackTimer timer(this);
+            _handler->onTimeout(this, (now - _pcb_sent_at));
+        }
+        _schedule_timeout();
+        return;
+    }
+    // RX Timeout
+    if(_rx_since_timeout && (now - _rx_last_packet) >= (_rx_since_timeout * 1000)){
+        log_w("rx timeout %d", _pcb->state);
+        _close();
+        return;
+    }
+    _schedule_timeout();
+}
+
+//arms the timer for the earliest deadline, unless it is armed earlier already
+void AsyncClient::_schedule_timeout(){
+    if(!_pcb){
+        return;
+    }
+    bool armed = false;
+    uint32_t deadline = 0;
+    if(_pcb_busy && _ack_timeout){
+        deadline = _pcb_sent_at + _ack_timeout;
+        armed = true;
+    }
+    if(_rx_since_timeout){
+        uint32_t rx_deadline = _rx_last_packet + _rx_since_timeout * 1000;
+        if(!armed || (int32_t)(rx_deadline - deadline) < 0){
+            deadline = rx_deadline;
+        }
+        armed = true;
+    }
+    if(!armed || (_timer.slot >= 0 && (int32_t)(_timer.expires - deadline) <= 0)){
+        return;
+    }
+    _timer_arm(_shard_of(this), &_timer, deadline);
+}
+
+void AsyncClient::_cancel_timeout(){
+    if(!_pool_release){
+        //a pending return to the pool is not a timeout
+        _timer_cancel(_shard_of(this), &_timer);
+    }
+    _timer_cancel(_shard_of(this), &_cork_timer);
+    _corked_len = 0;
+}
+
+void AsyncClient::_cork_add(size_t len){
+    uint32_t before = _corked_len.fetch_add(len, std::memory_order_relaxed);
+    if(before + len >= getMss()){
+        _cork_flush();
+    } else if(!before){
+        _timer_arm(_shard_of(this), &_cork_timer, millis() + _cork_delay);
+    }
+}
+
+//push at the deadline, Nagle would hold a partial segment until the peer ACKs
+void AsyncClient::_cork_flush(bool push){
+    _timer_cancel(_shard_of(this), &_cork_timer);
+    if(_corked_len.exchange(0, std::memory_order_relaxed)){
+        _send(push);
+    }
+}
+
+void AsyncClient::_dns_found(struct ip_addr *ipaddr){
+    if(ipaddr && ipaddr->u_addr.ip4.addr){
+        connect(IPAddress(ipaddr->u_addr.ip4.addr), _connect_port);
+    } else {
+#if ASYNC_TCP_SSL_ENABLED
+        _tls_free();
+#endif
+        if(_handler) {
+            _handler->onError(this, -55);
+            _handler->onDisconnect(this);
+        }
+    }
+}
+
+/*
+ * Public Helper Methods
+ * */
+
+void AsyncClient::stop() {
+    close(false);
+}
+
+bool AsyncClient::free(){
+    if(!_pcb) {
+        return true;
+    }
+    if(_pcb->state == 0 || _pcb->state > 4) {
+        return true;
+    }
+    return false;
+}
+
+size_t AsyncClient::write(const char* data) {
+    if(data == NULL) {
+        return 0;
+    }
+    return write(data, strlen(data));
+}
+
+size_t AsyncClient::write(const char* data, size_t size, uint8_t apiflags) {
+    if(data == NULL || size == 0) {
+        return 0;
+    }
+    async_write_buf_t buf = { data, size };
+    return writev(&buf, 1, apiflags);
+}
+
+size_t AsyncClient::writev(const async_write_buf_t* bufs, size_t count, uint8_t apiflags) {
+    if(!_pcb || !bufs || !count) {
+        return 0;
+    }
+#if ASYNC_TCP_SSL_ENABLED
+    if(_tls) {
+        size_t will_send = _tls_writev(bufs, count);
+        if(will_send && _corked) {
+            _cork_add(will_send);
+        } else if(will_send) {
+            send();
+        }
+        return will_send;
+    }
+#endif
+    int8_t err = ERR_OK;
+    bool corked = _corked;
+    size_t will_send = _tcp_writev(_pcb, _closed_slot, bufs, count, corked?(apiflags | ASYNC_WRITE_FLAG_MORE):apiflags, !corked, &err);
+    _tx_added(will_send);
+    if(!will_send) {
+        return 0;
+    }
+    //queued bytes are sent by the stack once it can, only the immediate output failed
+    if(err != ERR_OK) {
+        log_w("output error: %d", err);
+    }
+    if(corked) {
+        _cork_add(will_send);
+        return will_send;
+    }
+    _pcb_busy = true;
+    _pcb_sent_at = millis();
+    _schedule_timeout();
+    return will_send;
+}
+
+size_t AsyncClient::write(AsyncBuffer& buffer, size_t offset, bool flush) {
+    if(!_pcb || offset >= buffer.size()) {
+        return 0;
+    }
+#if ASYNC_TCP_SSL_ENABLED
+    if(_tls) {
+        //the records are encrypted copies, the buffer is not referenced
+        size_t will_send = _tls_write(buffer.data() + offset, buffer.size() - offset);
+        if(will_send && flush && _corked) {
+            _cork_add(will_send);
+        } else if(will_send && flush) {
+            send();
+        }
+        return will_send;
+    }
+#endif
+    async_tx_ref * ref = new (std::nothrow) async_tx_ref;
+    if(!ref) {
+        return 0;
     }
-    // RX Timeout
-    if(_rx_since_timeout && (now - _rx_last_packet) >= (_rx_since_timeout * 1000)){
-        log_w("rx timeout %d", pcb->state);
-        _close();
-        return ERR_OK;
+    async_write_buf_t buf = { buffer.data() + offset, buffer.size() - offset };
+    int8_t err = ERR_OK;
+    bool corked = flush && _corked;
+    size_t will_send = _tcp_writev(_pcb, _closed_slot, &buf, 1, corked?ASYNC_WRITE_FLAG_MORE:0, flush && !corked, &err);
+    if(!will_send) {
+        delete ref;
+        return 0;
     }
-    // Everything is fine
-    if(_poll_cb) {
-        _poll_cb(_poll_cb_arg, this);
+    buffer.ref();
+    ref->buffer = &buffer;
+    _tx_added(will_send);
+    _tx_ref_track(ref);
+    if(corked) {
+        _cork_add(will_send);
+    } else if(flush) {
+        _pcb_busy = true;
+        _pcb_sent_at = millis();
+        _schedule_timeout();
     }
-    return ERR_OK;
+    return will_send;
 }
 
-void AsyncClient::_dns_found(struct ip_addr *ipaddr){
-    if(ipaddr && ipaddr->u_addr.ip4.addr){
-        connect(IPAddress(ipaddr->u_addr.ip4.addr), _connect_port);
+//after _tx_added() of its bytes, the reference of a zero-copy write is released once they are acknowledged
+void AsyncClient::_tx_ref_track(async_tx_ref* ref){
+    ref->end = _tx_queued.load(std::memory_order_relaxed);
+    ref->next = NULL;
+    portENTER_CRITICAL(&_tx_refs_lock);
+    if(_tx_refs_tail) {
+        _tx_refs_tail->next = ref;
     } else {
-        if(_error_cb) {
-            _error_cb(_error_cb_arg, this, -55);
-        }
-        if(_discard_cb) {
-            _discard_cb(_discard_cb_arg, this);
-        }
+        _tx_refs = ref;
     }
+    _tx_refs_tail = ref;
+    portEXIT_CRITICAL(&_tx_refs_lock);
+    //the ACK may have been handled before the reference was recorded
+    _release_tx_buffers(false);
 }
 
-/*
- * Public Helper Methods
- * */
-
-void AsyncClient::stop() {
-    close(false);
+bool AsyncClient::submit(AsyncBuffer& buffer, size_t offset){
+    if(!_pcb || _closed_slot < 0 || offset >= buffer.size()) {
+        return false;
+    }
+#if ASYNC_TCP_SSL_ENABLED
+    if(_tls) {
+        return false;
+    }
+#endif
+    async_tx_ref * ref = new (std::nothrow) async_tx_ref;
+    if(!ref) {
+        return false;
+    }
+    buffer.ref();
+    ref->buffer = &buffer;
+    //counted first, the report may come before the push returns
+    _submits_pending.fetch_add(1, std::memory_order_relaxed);
+    if(!_submit_push(this, _pcb, _closed_slot, ref, offset)) {
+        _submits_pending.fetch_sub(1, std::memory_order_relaxed);
+        _submit_release(ref);
+        return false;
+    }
+    return true;
 }
 
-bool AsyncClient::free(){
-    if(!_pcb) {
-        return true;
+bool AsyncClient::submit(const char* data, size_t size){
+    if(!_pcb || !data || !size) {
+        return false;
     }
-    if(_pcb->state == 0 || _pcb->state > 4) {
-        return true;
+    AsyncBuffer * buffer = AsyncBuffer::allocate(size);
+    if(!buffer) {
+        return false;
     }
-    return false;
+    memcpy(buffer->data(), data, size);
+    bool queued = submit(*buffer, 0);
+    buffer->unref();
+    return queued;
 }
 
-size_t AsyncClient::write(const char* data) {
-    if(data == NULL) {
-        return 0;
+//in the service task, LwIP took len more bytes of the oldest submitted write, done once it took all or failed
+void AsyncClient::_submitted(async_tx_ref* ref, size_t len, bool done, int8_t err){
+    if(len) {
+        _tx_added(len);
+        _submit_len += len;
+        _pcb_busy = true;
+        _pcb_sent_at = millis();
+        _schedule_timeout();
+    }
+    if(!done) {
+        return;
+    }
+    size_t total = _submit_len;
+    _submit_len = 0;
+    _submits_pending.fetch_sub(1, std::memory_order_relaxed);
+    if(total) {
+        _tx_ref_track(ref);
+    } else {
+        _submit_release(ref);
+    }
+    if(_handler) {
+        AsyncCallbackTimer timer(this);
+        _handler->onSubmitted(this, total, err);
     }
-    return write(data, strlen(data));
 }
 
-size_t AsyncClient::write(const char* data, size_t size, uint8_t apiflags) {
-    size_t will_send = add(data, size, apiflags);
-    if(!will_send || !send()) {
-        return 0;
+size_t AsyncClient::getBuffersInFlight(){
+    size_t count = 0;
+    portENTER_CRITICAL(&_tx_refs_lock);
+    for(async_tx_ref * r = _tx_refs; r; r = r->next) {
+        ++count;
     }
-    return will_send;
+    portEXIT_CRITICAL(&_tx_refs_lock);
+    return count;
 }
 
 void AsyncClient::setRxTimeout(uint32_t timeout){
     _rx_since_timeout = timeout;
+    _schedule_timeout();
 }
 
 uint32_t AsyncClient::getRxTimeout(){
     return _rx_since_timeout;
 }
 
+void AsyncClient::setAckPolicy(async_ack_policy_t policy, uint32_t value){
+    _ack_flush();
+    _ack_policy = policy;
+    _ack_policy_value = value;
+}
+
+async_ack_policy_t AsyncClient::getAckPolicy(){
+    return _ack_policy;
+}
+
 uint32_t AsyncClient::getAckTimeout(){
     return _ack_timeout;
 }
 
 void AsyncClient::setAckTimeout(uint32_t timeout){
     _ack_timeout = timeout;
+    _schedule_timeout();
 }
 
 void AsyncClient::setNoDelay(bool nodelay){
@@ -1057,6 +3955,94 @@ bool AsyncClient::getNoDelay(){
     return tcp_nagle_disabled(_pcb);
 }
 
+void AsyncClient::_tx_added(size_t len){
+    _tx_queued.fetch_add(len, std::memory_order_relaxed);
+    if(len) {
+        _stats.bytes_out += len;
+        _stats.segments_out++;
+    }
+    _check_high_watermark();
+}
+
+//raised on the service task only, a write from another task is checked again by the next SENT
+void AsyncClient::_check_high_watermark(){
+    if(_current_shard() != (int)_shard_of(this)) {
+        return;
+    }
+    if(_wm_high && !_wm_above.load(std::memory_order_relaxed) && getUnackedBytes() > _wm_high && !_wm_above.exchange(true)) {
+        if(_handler) {
+            AsyncCallbackTimer timer(this);
+            _handler->onWatermark(this, true);
+        }
+    }
+}
+
+void AsyncClient::setWriteWatermarks(size_t low, size_t high){
+    _wm_low = (low < high)?low:high;
+    _wm_high = high;
+}
+
+size_t AsyncClient::getUnackedBytes(){
+    return _tx_queued.load(std::memory_order_relaxed) - _tx_acked.load(std::memory_order_relaxed);
+}
+
+void AsyncClient::cork(uint32_t max_delay){
+    _cork_delay = max_delay;
+    if(_corked) {
+        return;
+    }
+    //with Nagle on, LwIP holds a partial segment back when ACKs trigger output
+    _cork_nodelay = getNoDelay();
+    setNoDelay(false);
+    _corked = true;
+}
+
+void AsyncClient::uncork(){
+    if(!_corked) {
+        return;
+    }
+    _corked = false;
+    setNoDelay(_cork_nodelay);
+    _cork_flush();
+}
+
+uint32_t AsyncClient::getSuppressedPolls(){
+    return _polls_suppressed.load(std::memory_order_relaxed);
+}
+
+void AsyncClient::getStats(async_client_stats_t * stats){
+    *stats = _stats;
+    stats->ack_rtt_ms = _ack_rtt8 >> 3;
+    stats->rx_refused = _rx_refused.load(std::memory_order_relaxed);
+}
+
+void AsyncClient::_reset_stats(){
+    memset(&_stats, 0, sizeof(_stats));
+    _ack_rtt8 = 0;
+    _rx_stalled = false;
+    _rx_refused = 0;
+}
+
+void AsyncClient::_callback_done(uint32_t started){
+    uint32_t took = micros() - started;
+    _stats.callbacks++;
+    _stats.callback_us += took;
+    if(took > _stats.callback_max_us) {
+        _stats.callback_max_us = took;
+    }
+}
+
+//the peer stops sending once the data the handler holds back reaches the window
+void AsyncClient::_check_rx_stall(){
+    size_t held = _rx_ack_len + _rx_chain_len + _rx_unacked;
+    if(held < TCP_WND) {
+        _rx_stalled = false;
+    } else if(!_rx_stalled) {
+        _rx_stalled = true;
+        _stats.rx_window_stalls++;
+    }
+}
+
 uint16_t AsyncClient::getMss(){
     if(!_pcb) {
         return 0;
@@ -1173,6 +4159,7 @@ const char * AsyncClient::errorToString(int8_t error){
         case ERR_CLSD: return "Connection closed";
         case ERR_ARG: return "Illegal argument";
         case -55: return "DNS failed";
+        case -56: return "TLS failed";
         default: return "UNKNOWN";
     }
 }
@@ -1194,6 +4181,350 @@ const char * AsyncClient::stateToString(){
     }
 }
 
+/*
+ * TLS
+ *
+ * Records are read and written in the service task. Received pbufs queue
+ * until mbedTLS reads them and their length is reported to LwIP then, the
+ * decrypted data goes to the handler in new pbufs as plain data would. A
+ * write encrypts one record per call of at most space() bytes, so it always
+ * fits the send buffer and mbedTLS never has to retry one; only handshake
+ * messages and alerts may wait for room in the client.
+ * */
+
+#if ASYNC_TCP_SSL_ENABLED
+
+bool AsyncClient::connect(IPAddress ip, uint16_t port, bool secure){
+    if(!_tls_arm(secure, NULL, ip, port)){
+        return false;
+    }
+    if(!connect(ip, port)){
+        _tls_free();
+        return false;
+    }
+    return true;
+}
+
+bool AsyncClient::connect(const char* host, uint16_t port, bool secure){
+    if(!_tls_arm(secure, host, 0, port)){
+        return false;
+    }
+    if(!connect(host, port)){
+        _tls_free();
+        return false;
+    }
+    return true;
+}
+
+SSL * AsyncClient::getSSL(){
+    return _tls;
+}
+
+//sets the connection about to be made up for TLS, or for plain TCP
+bool AsyncClient::_tls_arm(bool secure, const char* host, uint32_t ip, uint16_t port){
+    if(_pcb){
+        log_w("already connected, state %d", _pcb->state);
+        return false;
+    }
+    _tls_free();
+    if(!secure){
+        return true;
+    }
+    if(host && strlen(host) >= ASYNC_DNS_NAME_LENGTH){
+        log_e("host name too long");
+        return false;
+    }
+    async_tls_config_t * config = _tls_config();
+    if(!config){
+        return false;
+    }
+    async_tls * tls = new (std::nothrow) async_tls;
+    if(!tls){
+        return false;
+    }
+    mbedtls_ssl_init(&tls->ssl);
+    if(host){
+        strcpy(tls->host, host);
+    } else {
+        snprintf(tls->host, sizeof(tls->host), "%u.%u.%u.%u", ip & 0xFF, (ip >> 8) & 0xFF, (ip >> 16) & 0xFF, ip >> 24);
+    }
+    tls->port = port;
+    tls->rx = NULL;
+    tls->rx_offset = 0;
+    tls->rx_read = 0;
+    tls->tx = NULL;
+    tls->tx_len = 0;
+    tls->tx_written = false;
+    tls->rx_held = false;
+    tls->established = false;
+    tls->offered = false;
+    int ret = mbedtls_ssl_setup(&tls->ssl, &config->conf);
+    if(!ret && host){
+        //SNI and the name the certificate is verified against
+        ret = mbedtls_ssl_set_hostname(&tls->ssl, host);
+    }
+    if(ret){
+        log_e("tls setup failed: -0x%04x", -ret);
+        mbedtls_ssl_free(&tls->ssl);
+        delete tls;
+        return false;
+    }
+    mbedtls_ssl_set_bio(&tls->ssl, this, &_s_tls_send, &_s_tls_recv, NULL);
+    _tls_session_offer(tls);
+    _tls = tls;
+    return true;
+}
+
+void AsyncClient::_tls_free(){
+    if(!_tls){
+        return;
+    }
+    mbedtls_ssl_free(&_tls->ssl);
+    if(_tls->rx){
+        pbuf_free(_tls->rx);
+    }
+    ::free(_tls->tx);
+    delete _tls;
+    _tls = NULL;
+}
+
+void AsyncClient::_tls_handshake(){
+    int ret = mbedtls_ssl_handshake(&_tls->ssl);
+    _tls_ack_read();
+    if(ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE){
+        _tls_flush();
+        return;
+    }
+    if(ret){
+        _tls_fail(ret);
+        return;
+    }
+    _tls->established = true;
+    _tls_handshakes.fetch_add(1, std::memory_order_relaxed);
+    if(_tls_session_store(_tls)){
+        _tls_resumed.fetch_add(1, std::memory_order_relaxed);
+    }
+    //the last flight goes out with what onConnect writes, a resumed handshake ends with
+    //the client and the first request would otherwise wait for the delayed ACK of it
+    if(_handler) {
+        AsyncCallbackTimer timer(this);
+        _handler->onConnect(this);
+    }
+    if(_tls && _pcb) {
+        _tls->tx_written = true;
+        _tls_flush();
+    }
+}
+
+int8_t AsyncClient::_tls_recv(pbuf* pb){
+    _rx_last_packet = millis();
+    if(_tls->rx){
+        pbuf_cat(_tls->rx, pb);
+    } else {
+        _tls->rx = pb;
+    }
+    if(!_tls->established){
+        _tls_handshake();
+        if(!_tls || !_tls->established){
+            return ERR_OK;
+        }
+    }
+    _tls_read();
+    return ERR_OK;
+}
+
+//hands the decrypted records to the handler
+void AsyncClient::_tls_read(){
+    _tls->rx_held = false;
+    while(_tls){
+        //process the next record, then read what it holds into a pbuf of its size
+        unsigned char none;
+        int ret = mbedtls_ssl_read(&_tls->ssl, &none, 0);
+        size_t avail = mbedtls_ssl_get_bytes_avail(&_tls->ssl);
+        if(!avail){
+            if(ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE){
+                break;
+            }
+            if(ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY){
+                //answered with our own before the FIN
+                close();
+                return;
+            }
+            if(ret < 0){
+                _tls_fail(ret);
+                return;
+            }
+            if(!_tls->rx){
+                break;
+            }
+            continue;
+        }
+        size_t len = (avail > TCP_MSS)?TCP_MSS:avail;
+        pbuf * p = pbuf_alloc(PBUF_RAW, len, PBUF_RAM);
+        if(!p){
+            log_e("no memory for %u bytes", len);
+            _tls->rx_held = true;
+            break;
+        }
+        mbedtls_ssl_read(&_tls->ssl, (unsigned char *)p->payload, len);
+        _deliver(p);
+    }
+    if(_tls){
+        _tls_ack_read();
+        _tls_flush();
+    }
+}
+
+//the window opens for the records mbedTLS has read
+void AsyncClient::_tls_ack_read(){
+    //through the ring as in _ack_flush(), with the ring full the bytes stay pending for the next record or poll
+    if(_tls->rx_read && _pcb && !_submit_push(this, _pcb, _closed_slot, NULL, _tls->rx_read)){
+        return;
+    }
+    _tls->rx_read = 0;
+}
+
+size_t AsyncClient::_tls_space(){
+    if(!_tls->established || _tls->tx_len || !_pcb || _pcb->state != 4){
+        return 0;
+    }
+    size_t room = tcp_sndbuf(_pcb);
+    int expansion = mbedtls_ssl_get_record_expansion(&_tls->ssl);
+    if(expansion < 0 || room <= (size_t)expansion){
+        return 0;
+    }
+    room -= expansion;
+    int payload = mbedtls_ssl_get_max_out_record_payload(&_tls->ssl);
+    if(payload > 0 && room > (size_t)payload){
+        room = payload;
+    }
+    return room;
+}
+
+size_t AsyncClient::_tls_write(const char* data, size_t size){
+    size_t written = 0;
+    while(_tls && written < size){
+        size_t room = _tls_space();
+        if(!room){
+            break;
+        }
+        size_t len = size - written;
+        int ret = mbedtls_ssl_write(&_tls->ssl, (const unsigned char *)data + written, (room < len)?room:len);
+        if(ret <= 0){
+            log_e("tls write failed: -0x%04x", -ret);
+            break;
+        }
+        written += ret;
+    }
+    if(_tls){
+        //sent by the caller
+        _tls->tx_written = false;
+    }
+    _check_high_watermark();
+    return written;
+}
+
+size_t AsyncClient::_tls_writev(const async_write_buf_t* bufs, size_t count){
+    size_t written = 0;
+    for(size_t i = 0; i < count; ++ i){
+        size_t len = _tls_write(bufs[i].data, bufs[i].size);
+        written += len;
+        if(len < bufs[i].size){
+            break;
+        }
+    }
+    return written;
+}
+
+//hands the records that waited for room to LwIP and sends what the handshake wrote
+void AsyncClient::_tls_flush(){
+    if(_tls->tx_len && _pcb){
+        size_t room = tcp_sndbuf(_pcb);
+        size_t len = (room < _tls->tx_len)?room:_tls->tx_len;
+        if(len && _tcp_write(_pcb, _closed_slot, _tls->tx, len, ASYNC_WRITE_FLAG_COPY) == ERR_OK){
+            _tls->tx_len -= len;
+            memmove(_tls->tx, _tls->tx + len, _tls->tx_len);
+            _tx_added(len);
+            _tls->tx_written = true;
+        }
+    }
+    if(_tls && _tls->tx_written && _pcb){
+        _tls->tx_written = false;
+        send();
+    }
+}
+
+void AsyncClient::_tls_fail(int ret){
+    log_e("tls error: -0x%04x", -ret);
+    if(!_tls->established){
+        _tls_failures.fetch_add(1, std::memory_order_relaxed);
+        if(_tls->offered){
+            _tls_session_drop(_tls);
+        }
+    }
+    if(_handler) {
+        _handler->onError(this, ASYNC_TLS_ERROR);
+    }
+    _close();
+}
+
+//mbedTLS output, what does not fit the send buffer waits in the client
+int AsyncClient::_s_tls_send(void * ctx, const unsigned char * buf, size_t len){
+    AsyncClient * c = reinterpret_cast<AsyncClient*>(ctx);
+    async_tls * tls = c->_tls;
+    if(!c->_pcb){
+        return MBEDTLS_ERR_SSL_CONN_EOF;
+    }
+    size_t sent = 0;
+    if(!tls->tx_len){
+        size_t room = tcp_sndbuf(c->_pcb);
+        sent = (room < len)?room:len;
+        if(sent && _tcp_write(c->_pcb, c->_closed_slot, (const char *)buf, sent, ASYNC_WRITE_FLAG_COPY) != ERR_OK){
+            sent = 0;
+        }
+        //the watermark is checked once the record is written, its handler may write again
+        c->_tx_queued.fetch_add(sent, std::memory_order_relaxed);
+        c->_stats.bytes_out += sent;
+        c->_stats.segments_out += sent?1:0;
+        tls->tx_written = tls->tx_written || sent;
+    }
+    if(sent < len){
+        char * tx = (char *)realloc(tls->tx, tls->tx_len + len - sent);
+        if(!tx){
+            return MBEDTLS_ERR_SSL_ALLOC_FAILED;
+        }
+        memcpy(tx + tls->tx_len, buf + sent, len - sent);
+        tls->tx = tx;
+        tls->tx_len += len - sent;
+    }
+    return len;
+}
+
+//mbedTLS input from the received pbufs
+int AsyncClient::_s_tls_recv(void * ctx, unsigned char * buf, size_t len){
+    async_tls * tls = reinterpret_cast<AsyncClient*>(ctx)->_tls;
+    size_t read = 0;
+    while(tls->rx && read < len){
+        pbuf * b = tls->rx;
+        size_t in_b = b->len - tls->rx_offset;
+        size_t n = (len - read < in_b)?(len - read):in_b;
+        memcpy(buf + read, (const uint8_t *)b->payload + tls->rx_offset, n);
+        read += n;
+        tls->rx_offset += n;
+        if(tls->rx_offset == b->len){
+            //the chain holds the only reference to the next pbuf, unlink it before freeing
+            tls->rx = b->next;
+            b->next = NULL;
+            pbuf_free(b);
+            tls->rx_offset = 0;
+        }
+    }
+    tls->rx_read += read;
+    return read?(int)read:MBEDTLS_ERR_SSL_WANT_READ;
+}
+
+#endif
+
 /*
  * Static Callbacks (LwIP C2C++ interconnect)
  * */
@@ -1203,23 +4534,59 @@ void AsyncClient::_s_dns_found(const char * name, struct ip_addr * ipaddr, void
 }
 
 int8_t AsyncClient::_s_poll(void * arg, struct tcp_pcb * pcb) {
-    return reinterpret_cast<AsyncClient*>(arg)->_poll(pcb);
+    AsyncClient * c = reinterpret_cast<AsyncClient*>(arg);
+    c->_poll_queued.store(false, std::memory_order_relaxed);
+    c->_deliver_deferred_sent(pcb);
+    return c->_poll(pcb);
 }
 
 int8_t AsyncClient::_s_recv(void * arg, struct tcp_pcb * pcb, struct pbuf *pb, int8_t err) {
-    return reinterpret_cast<AsyncClient*>(arg)->_recv(pcb, pb, err);
+    AsyncClient * c = reinterpret_cast<AsyncClient*>(arg);
+    c->_deliver_deferred_sent(pcb);
+    return c->_recv(pcb, pb, err);
 }
 
 int8_t AsyncClient::_s_fin(void * arg, struct tcp_pcb * pcb, int8_t err) {
     return reinterpret_cast<AsyncClient*>(arg)->_fin(pcb, err);
 }
 
+void AsyncClient::_s_timeout(void * arg) {
+    reinterpret_cast<AsyncClient*>(arg)->_timeout();
+}
+
+void AsyncClient::_s_cork_timeout(void * arg) {
+    reinterpret_cast<AsyncClient*>(arg)->_cork_flush(true);
+}
+
+void AsyncClient::_s_submitted(void * arg, async_tx_ref * ref, size_t len, bool done, int8_t err) {
+    reinterpret_cast<AsyncClient*>(arg)->_submitted(ref, len, done, err);
+}
+
+//In LwIP Thread
+void AsyncClient::_s_lwip_error(void * arg) {
+    if(arg) {
+        int32_t slot = reinterpret_cast<AsyncClient*>(arg)->_closed_slot;
+        _submit_purge(slot);
+        _release_slot(slot);
+    }
+}
+
+//In LwIP Thread
+void AsyncClient::_s_lwip_writable(void * arg) {
+    _submit_recover();
+    if(arg) {
+        _submit_resume(reinterpret_cast<AsyncClient*>(arg)->_closed_slot);
+    }
+}
+
 int8_t AsyncClient::_s_lwip_fin(void * arg, struct tcp_pcb * pcb, int8_t err) {
     return reinterpret_cast<AsyncClient*>(arg)->_lwip_fin(pcb, err);
 }
 
 int8_t AsyncClient::_s_sent(void * arg, struct tcp_pcb * pcb, uint16_t len) {
-    return reinterpret_cast<AsyncClient*>(arg)->_sent(pcb, len);
+    AsyncClient * c = reinterpret_cast<AsyncClient*>(arg);
+    c->_deliver_deferred_sent(pcb);
+    return c->_sent(pcb, len);
 }
 
 void AsyncClient::_s_error(void * arg, int8_t err) {
@@ -1234,26 +4601,103 @@ int8_t AsyncClient::_s_connected(void * arg, void * pcb, int8_t err){
   Async TCP Server
  */
 
+static portMUX_TYPE _client_pool_lock = portMUX_INITIALIZER_UNLOCKED;
+
 AsyncServer::AsyncServer(IPAddress addr, uint16_t port)
 : _port(port)
 , _addr(addr)
 , _noDelay(false)
+, _backlog(5)
 , _pcb(0)
 , _connect_cb(0)
 , _connect_cb_arg(0)
+, _pool(NULL)
+, _pool_free(NULL)
+, _pool_size(0)
+, _pool_free_count(0)
+, _rejected(0)
 {}
 
 AsyncServer::AsyncServer(uint16_t port)
 : _port(port)
 , _addr((uint32_t) IPADDR_ANY)
 , _noDelay(false)
+, _backlog(5)
 , _pcb(0)
 , _connect_cb(0)
 , _connect_cb_arg(0)
+, _pool(NULL)
+, _pool_free(NULL)
+, _pool_size(0)
+, _pool_free_count(0)
+, _rejected(0)
 {}
 
 AsyncServer::~AsyncServer(){
     end();
+    if(_pool){
+        //clients still connected are closed without going back to the pool
+        for(size_t i = 0; i < _pool_size; i++){
+            _pool[i]._pool_server = NULL;
+        }
+        delete[] _pool;
+        free(_pool_free);
+    }
+}
+
+bool AsyncServer::setClientPool(size_t size){
+    if(_pcb || _pool){
+        log_e("pool must be set once, before begin()");
+        return false;
+    }
+    if(!size){
+        return true;
+    }
+    _pool_free = (AsyncClient**)malloc(size * sizeof(AsyncClient*));
+    if(!_pool_free){
+        return false;
+    }
+    _pool = new (std::nothrow) AsyncClient[size];
+    if(!_pool){
+        free(_pool_free);
+        _pool_free = NULL;
+        return false;
+    }
+    for(size_t i = 0; i < size; i++){
+        _pool[i]._pool_server = this;
+        _pool_free[i] = &_pool[i];
+    }
+    _pool_size = size;
+    _pool_free_count = size;
+    return true;
+}
+
+size_t AsyncServer::getClientPoolFree(){
+    portENTER_CRITICAL(&_client_pool_lock);
+    size_t count = _pool_free_count;
+    portEXIT_CRITICAL(&_client_pool_lock);
+    return count;
+}
+
+uint32_t AsyncServer::getRejected(){
+    return _rejected.load(std::memory_order_relaxed);
+}
+
+AsyncClient* AsyncServer::_take_client(){
+    AsyncClient* c = NULL;
+    portENTER_CRITICAL(&_client_pool_lock);
+    if(_pool_free_count){
+        c = _pool_free[-- _pool_free_count];
+    }
+    portEXIT_CRITICAL(&_client_pool_lock);
+    return c;
+}
+
+void AsyncServer::_release_client(AsyncClient* client){
+    client->_recycle();
+    portENTER_CRITICAL(&_client_pool_lock);
+    _pool_free[_pool_free_count++] = client;
+    portEXIT_CRITICAL(&_client_pool_lock);
 }
 
 void AsyncServer::onClient(AcConnectHandler cb, void* arg){
@@ -1288,8 +4732,7 @@ void AsyncServer::begin(){
         return;
     }
 
-    static uint8_t backlog = 5;
-    _pcb = _tcp_listen_with_backlog(_pcb, backlog);
+    _pcb = _tcp_listen_with_backlog(_pcb, _backlog);
     if (!_pcb) {
         log_e("listen_pcb == NULL");
         return;
@@ -1313,10 +4756,36 @@ void AsyncServer::end(){
 int8_t AsyncServer::_accept(tcp_pcb* pcb, int8_t err){
     //ets_printf("+A: 0x%08x\n", pcb);
     if(_connect_cb){
-        AsyncClient *c = new AsyncClient(pcb);
+        AsyncClient *c;
+        if(_pool){
+            //no heap in the TCP/IP thread, refuse what does not fit in the pool
+            c = _take_client();
+            if(!c){
+                _rejected++;
+                tcp_abort(pcb);
+                return ERR_ABRT;
+            }
+            c->_attach(pcb);
+        } else {
+            c = new AsyncClient(pcb);
+        }
         if(c){
             c->setNoDelay(_noDelay);
-            return _tcp_accept(this, c);
+            if(_tcp_accept(this, c) == ERR_OK){
+                return ERR_OK;
+            }
+            //could not hand the client over, drop it without going through the TCP/IP API
+            tcp_arg(pcb, NULL);
+            tcp_sent(pcb, NULL);
+            tcp_recv(pcb, NULL);
+            tcp_err(pcb, NULL);
+            tcp_poll(pcb, NULL, 0);
+            c->_pcb = NULL;
+            if(c->_pool_server){
+                _release_client(c);
+            } else {
+                delete c;
+            }
         }
     }
     if(tcp_close(pcb) != ERR_OK){
@@ -1341,6 +4810,14 @@ bool AsyncServer::getNoDelay(){
     return _noDelay;
 }
 
+void AsyncServer::setBacklog(uint8_t backlog){
+    _backlog = backlog;
+}
+
+uint8_t AsyncServer::getBacklog(){
+    return _backlog;
+}
+
 uint8_t AsyncServer::status(){
     if (!_pcb) {
         return 0;
@@ -25,6 +25,7 @@
 #include "IPAddress.h"
 #include "sdkconfig.h"
 #include <functional>
+#include <atomic>
 extern "C" {
     #include "freertos/semphr.h"
     #include "lwip/pbuf.h"
@@ -33,24 +34,339 @@ extern "C" {
 //If core is not defined, then we are running in Arduino or PIO
 #ifndef CONFIG_ASYNC_TCP_RUNNING_CORE
 #define CONFIG_ASYNC_TCP_RUNNING_CORE -1 //any available core
-#define CONFIG_ASYNC_TCP_USE_WDT 1 //if enabled, adds between 33us and 200us per event
+#define CONFIG_ASYNC_TCP_USE_WDT 1 //if enabled, adds between 33us and 200us per burst of events
+#endif
+
+//While events keep coming the service task stays registered with the WDT and only feeds it
+//after this many events or microseconds of work, whichever comes first
+#ifndef CONFIG_ASYNC_TCP_WDT_BATCH_EVENTS
+#define CONFIG_ASYNC_TCP_WDT_BATCH_EVENTS 16
+#endif
+#ifndef CONFIG_ASYNC_TCP_WDT_BATCH_US
+#define CONFIG_ASYNC_TCP_WDT_BATCH_US 100000
+#endif
+
+#ifndef CONFIG_ASYNC_TCP_EVENT_QUEUE_SIZE
+#define CONFIG_ASYNC_TCP_EVENT_QUEUE_SIZE 32 //data events each worker may have queued, the event packet pool is sized from it
+#endif
+
+#ifndef CONFIG_ASYNC_TCP_FLOW_QUEUE_SIZE
+#define CONFIG_ASYNC_TCP_FLOW_QUEUE_SIZE (CONFIG_ASYNC_TCP_EVENT_QUEUE_SIZE / 4) //of those a single connection may have queued
+#endif
+
+#ifndef CONFIG_ASYNC_TCP_SCHED_QUANTUM
+#define CONFIG_ASYNC_TCP_SCHED_QUANTUM 1460 //bytes of received data a connection is handed per turn when the worker is busy
+#endif
+
+//Number of async_tcp service tasks. Every client is pinned to one of them, so callbacks of
+//different clients may run in parallel when more than one is configured (spread over the cores,
+//CONFIG_ASYNC_TCP_RUNNING_CORE then only applies to a single worker)
+#ifndef CONFIG_ASYNC_TCP_WORKERS
+#define CONFIG_ASYNC_TCP_WORKERS 1
+#endif
+
+#ifndef CONFIG_ASYNC_TCP_STACK_SIZE
+#define CONFIG_ASYNC_TCP_STACK_SIZE 8192 * 2 //stack of each service task
+#endif
+
+#ifndef CONFIG_ASYNC_TCP_PRIORITY
+#define CONFIG_ASYNC_TCP_PRIORITY 3
+#endif
+
+#ifndef CONFIG_ASYNC_TCP_SUBMIT_RING_SIZE
+#define CONFIG_ASYNC_TCP_SUBMIT_RING_SIZE 32 //writes and window updates submitted to the TCP/IP thread without waiting, a power of two
+#endif
+
+#ifndef CONFIG_ASYNC_TCP_DNS_CACHE_SIZE
+#define CONFIG_ASYNC_TCP_DNS_CACHE_SIZE 4 //host names remembered by connect(host, port), 0 disables the cache
+#endif
+
+//Secure connections over mbedTLS through connect(host, port, true)
+#ifndef ASYNC_TCP_SSL_ENABLED
+#define ASYNC_TCP_SSL_ENABLED 0
+#endif
+
+#ifndef CONFIG_ASYNC_TCP_TLS_SESSION_CACHE
+#define CONFIG_ASYNC_TCP_TLS_SESSION_CACHE 4 //TLS sessions remembered per host and port to resume the next connection, 0 disables resumption
 #endif
 
 class AsyncClient;
+class AsyncServer;
 
 #define ASYNC_MAX_ACK_TIME 5000
+#define ASYNC_CORK_TIME 10 //default milliseconds corked data may wait for a full segment
 #define ASYNC_WRITE_FLAG_COPY 0x01 //will allocate new buffer to hold the data while sending (else will hold reference to the data given)
 #define ASYNC_WRITE_FLAG_MORE 0x02 //will not send PSH flag, meaning that there should be more data to be sent before the application should react.
 
+typedef struct {
+    const char* data;
+    size_t size;
+} async_write_buf_t;
+
 typedef std::function<void(void*, AsyncClient*)> AcConnectHandler;
 typedef std::function<void(void*, AsyncClient*, size_t len, uint32_t time)> AcAckHandler;
 typedef std::function<void(void*, AsyncClient*, int8_t error)> AcErrorHandler;
 typedef std::function<void(void*, AsyncClient*, void *data, size_t len)> AcDataHandler;
 typedef std::function<void(void*, AsyncClient*, struct pbuf *pb)> AcPacketHandler;
 typedef std::function<void(void*, AsyncClient*, uint32_t time)> AcTimeoutHandler;
+typedef std::function<void(void*, AsyncClient*, bool high)> AcWatermarkHandler;
+typedef std::function<void(void*, AsyncClient*, size_t len, int8_t error)> AcSubmitHandler;
+class AsyncRxView;
+typedef std::function<void(void*, AsyncClient*, AsyncRxView& view)> AcRecvHandler;
+typedef std::function<void(void*, const char* data, size_t size)> AcBufferReleaseHandler;
 
 struct tcp_pcb;
 struct ip_addr;
+struct async_tx_ref;
+class AsyncClientCallbacks;
+class AsyncCallbackTimer;
+struct async_tls;
+
+typedef struct {
+    uint32_t size;       //packets preallocated in the pool
+    uint32_t used;       //packets currently queued or being handled
+    uint32_t high_water; //highest value of used since boot
+    uint32_t exhausted;  //allocations that found the pool empty and fell back to the heap
+    uint32_t failed;     //allocations that failed on the heap as well, the event was lost
+} async_event_pool_stats_t;
+
+void async_tcp_get_event_pool_stats(async_event_pool_stats_t * stats);
+
+typedef enum {
+    ASYNC_QUEUE_BLOCK,   //the LwIP thread waits for room in the queue, a slow handler stalls every connection
+    ASYNC_QUEUE_NONBLOCK //drop POLL first, refuse RECV (TCP backpressure), fold SENT into the next event
+} async_queue_mode_t;
+
+typedef struct {
+    uint32_t polls_coalesced; //POLL skipped because the client already had one queued (in both modes)
+    uint32_t polls_dropped;   //POLL dropped to keep room for data events
+    uint32_t recv_deferred;   //RECV refused, LwIP holds the data and offers it again later
+    uint32_t sent_folded;     //SENT merged into the next event of the client
+    uint32_t waited;          //events the LwIP thread had to wait for room in the queue
+} async_queue_overflow_stats_t;
+
+void async_tcp_set_queue_mode(async_queue_mode_t mode);
+async_queue_mode_t async_tcp_get_queue_mode();
+void async_tcp_get_overflow_stats(async_queue_overflow_stats_t * stats);
+
+//window updates are queued in the submission ring without waiting for the TCP/IP thread, a task
+//blocked on it could deadlock with the LwIP thread waiting for room in the event queue. When the
+//ring is full the bytes stay pending and go with the next update, at the latest on poll.
+typedef enum {
+    ASYNC_ACK_IMMEDIATE, //queue a receive window update for every pbuf or ack() call
+    ASYNC_ACK_BYTES,     //once the given number of bytes is pending
+    ASYNC_ACK_BATCH,     //once per received chain, after the handlers ran
+    ASYNC_ACK_TIMER      //once the first pending byte is the given milliseconds old (checked on data and poll)
+} async_ack_policy_t;
+
+typedef struct {
+    uint32_t requests; //bytes handed back by the handlers, one per pbuf/ack()/consume()
+    uint32_t calls;    //window updates queued in the ring, the TCP/IP thread drains them in batches (see async_submit_stats_t)
+    uint32_t saved;    //requests merged into another update by the ack policy or a full ring
+} async_ack_stats_t;
+
+void async_tcp_get_ack_stats(async_ack_stats_t * stats);
+
+typedef struct {
+    uint32_t writes;         //submit() calls queued in the ring
+    uint32_t window_updates; //receive window updates queued in the ring
+    uint32_t ring_full;      //submissions that found the ring full, a window update then waits for the next one
+    uint32_t parked;         //times a write had to wait for room in the send buffer of its connection
+    uint32_t wakeups;        //calls posted to the TCP/IP thread to drain the ring
+    uint32_t batches;        //times the TCP/IP thread drained it
+    uint32_t max_batch;      //most entries taken by a single drain
+} async_submit_stats_t;
+
+void async_tcp_get_submit_stats(async_submit_stats_t * stats);
+
+#define ASYNC_TCP_EVENT_TYPES 11
+#define ASYNC_TCP_LATENCY_BUCKETS 12 //bucket 0 is below 32us, bucket i below 2^(i+5)us, the last one takes the rest
+
+typedef struct {
+    uint32_t queued;     //handed to a queue by the LwIP callbacks
+    uint32_t dispatched; //taken from the queue by a service task
+    uint32_t cancelled;  //dispatched after their client was closed and skipped
+    uint32_t lost;       //no packet or no queue for them, see the pool stats for the allocation failures
+    uint32_t latency_max_us;
+    uint32_t latency[ASYNC_TCP_LATENCY_BUCKETS]; //time from the LwIP callback to the dispatch
+} async_event_stats_t;
+
+typedef struct {
+    async_event_stats_t events[ASYNC_TCP_EVENT_TYPES];
+    uint32_t queue_depth[CONFIG_ASYNC_TCP_WORKERS];
+    uint32_t queue_high_water[CONFIG_ASYNC_TCP_WORKERS];
+    async_event_pool_stats_t pool;
+    async_queue_overflow_stats_t overflow;
+    async_ack_stats_t ack;
+    async_submit_stats_t submit;
+} async_tcp_stats_t;
+
+void async_tcp_get_stats(async_tcp_stats_t * stats);//all counters are always on, reading them takes no lock
+const char * async_tcp_event_name(uint8_t type);//index of async_tcp_stats_t::events
+
+typedef struct {
+    uint64_t bytes_in;          //received and handed to the handler
+    uint64_t bytes_out;         //handed to LwIP
+    uint32_t segments_in;       //pbufs received
+    uint32_t segments_out;      //writes handed to LwIP
+    uint32_t ack_rtt_ms;        //smoothed time from a send to its ACK, 1/8 gain like the TCP SRTT
+    uint32_t ack_rtt_max_ms;
+    uint32_t ack_timeouts;      //reported to onTimeout
+    uint32_t rx_refused;        //RECV the event queue had no room for, LwIP kept the data and the window closed
+    uint32_t rx_window_stalls;  //times the data held back by the handler filled the receive window
+    uint32_t callbacks;         //handler calls, onError and onDisconnect are not timed
+    uint64_t callback_us;       //time spent in them
+    uint32_t callback_max_us;
+} async_client_stats_t;
+
+typedef struct {
+    uint32_t hits;          //connect(host) served from the cache
+    uint32_t negative_hits; //failed lookups served from the cache
+    uint32_t misses;        //lookups sent to the DNS server
+    uint32_t stale_hits;    //lookups that failed and fell back to an expired address
+    uint32_t prefetches;    //entries refreshed in the background shortly before they expired
+} async_dns_cache_stats_t;
+
+//LwIP does not pass the record TTL to its callback, so cached addresses live for ttl seconds and failed
+//lookups for negative_ttl. An expired address is still used for up to stale seconds when a new lookup fails.
+void async_tcp_set_dns_cache_ttl(uint32_t ttl, uint32_t negative_ttl, uint32_t stale);
+void async_tcp_flush_dns_cache();
+void async_tcp_get_dns_cache_stats(async_dns_cache_stats_t * stats);
+
+#if ASYNC_TCP_SSL_ENABLED
+typedef struct {
+    uint32_t handshakes;    //completed, full or resumed
+    uint32_t resumed;       //completed with a cached session, without certificates and key exchange
+    uint32_t offered;       //cached sessions offered to the server
+    uint32_t failures;      //handshakes that failed
+} async_tls_stats_t;
+
+//Without a CA the server certificate is not verified, check it with ssl_match_fingerprint() in onConnect.
+//Set it before the first secure connection.
+bool async_tcp_set_tls_ca(const char * pem);
+void async_tcp_flush_tls_sessions();
+void async_tcp_get_tls_stats(async_tls_stats_t * stats);
+
+//the names of the ESP8266 axTLS port, AsyncMqttClient checks the server fingerprints with them
+#ifndef SSL_OK
+#define SSL_OK 0
+#endif
+#ifndef SHA1_SIZE
+#define SHA1_SIZE 20
+#endif
+typedef struct async_tls SSL;
+int ssl_match_fingerprint(SSL * ssl, const uint8_t * fingerprint);//SHA1 of the server certificate, SSL_OK when it matches
+#endif
+
+//Reference counted memory for zero-copy writes. LwIP sends straight from it and every
+//connection holds a reference until the peer acknowledged the bytes, so the owner may
+//unref() it right after the write. Create with new, the last unref() deletes it.
+class AsyncBuffer {
+  public:
+    AsyncBuffer(const char* data, size_t size, AcBufferReleaseHandler cb = 0, void* arg = 0);
+    static AsyncBuffer* allocate(size_t size);//owns size bytes of heap memory, NULL when out of memory
+
+    void ref();
+    void unref();//the last reference calls the release handler and deletes the buffer
+
+    char * data(){ return _data; }//only write to buffers from allocate() and before the first write
+    size_t size(){ return _size; }
+    uint32_t refs(){ return _refs.load(std::memory_order_relaxed); }
+
+  private:
+    ~AsyncBuffer(){}
+    AsyncBuffer(const AsyncBuffer &);
+    AsyncBuffer & operator=(const AsyncBuffer &);
+
+    char * _data;
+    size_t _size;
+    std::atomic<uint32_t> _refs;
+    AcBufferReleaseHandler _release_cb;
+    void* _release_cb_arg;
+};
+
+typedef struct {
+    const char* data;
+    size_t size;
+} async_rx_segment_t;
+
+//Zero-copy view of the received bytes that were not consumed yet, across all pbufs of the chain.
+//Only valid inside the onRecv handler. Consumed bytes are acknowledged to the peer, the rest
+//stays queued in the client and is offered again together with the next data.
+class AsyncRxView {
+  public:
+    class iterator {//walks the contiguous segments of the view
+      public:
+        iterator(pbuf* pb, size_t skip):_pb(pb), _skip(skip){}
+        async_rx_segment_t operator*() const;
+        iterator & operator++();
+        bool operator!=(const iterator &other) const { return _pb != other._pb; }
+      private:
+        pbuf* _pb;
+        size_t _skip;
+    };
+
+    iterator begin();
+    iterator end(){ return iterator(NULL, 0); }
+
+    size_t available();//bytes in the view
+    int peek(size_t offset = 0);//byte at offset or -1 past the end
+    size_t peek(void* dst, size_t len, size_t offset = 0);//copy out without consuming
+    size_t read(void* dst, size_t len);//peek() and consume()
+    size_t consume(size_t len);//drop and acknowledge len bytes from the front, returns the bytes dropped
+
+  private:
+    AsyncRxView(AsyncClient* client):_client(client){}
+    AsyncClient* _client;
+
+    friend class AsyncClient;
+};
+
+//entry of the timer wheel of a service task, do not use
+typedef struct async_timer {
+    struct async_timer * prev;
+    struct async_timer * next;
+    uint32_t expires;//millis()
+    int16_t slot;//level * slots + index in the wheel, past them when due to fire, -1 when not armed
+    void (*cb)(void * arg);//called on the service task
+    void * arg;
+} async_timer_t;
+
+/*
+ * All events of a connection in one object, called directly instead of
+ * through the std::function callbacks of onConnect() and the rest. Override
+ * what you need and pass it to AsyncClient::setHandler(). The receive mode
+ * picks which of onData(), onPacket() and onRecv() gets the data, like
+ * setting onData(), onPacket() or onRecv() does.
+ * */
+class AsyncClientHandler {
+  public:
+    typedef enum {
+        RX_DATA,   //onData() for every pbuf, acked after it returns unless ackLater()
+        RX_PACKET, //onPacket(), the handler owns the pbuf and calls ackPacket()
+        RX_VIEW    //onRecv() with the whole chain
+    } rx_mode_t;
+
+    AsyncClientHandler(rx_mode_t rx_mode = RX_DATA): _rx_mode(rx_mode) {}
+    virtual ~AsyncClientHandler() {}
+
+    rx_mode_t rxMode() const { return _rx_mode; }
+
+    virtual void onConnect(AsyncClient* /*client*/) {}
+    virtual void onDisconnect(AsyncClient* /*client*/) {}
+    virtual void onAck(AsyncClient* /*client*/, size_t /*len*/, uint32_t /*time*/) {}
+    virtual void onError(AsyncClient* /*client*/, int8_t /*error*/) {}
+    virtual void onData(AsyncClient* /*client*/, void* /*data*/, size_t /*len*/) {}
+    virtual void onPacket(AsyncClient* client, struct pbuf* pb);//acks and frees the pbuf
+    virtual void onRecv(AsyncClient* /*client*/, AsyncRxView& /*view*/) {}
+    virtual void onTimeout(AsyncClient* /*client*/, uint32_t /*time*/) {}
+    virtual void onPoll(AsyncClient* /*client*/) {}
+    virtual void onWatermark(AsyncClient* /*client*/, bool /*high*/) {}
+    virtual void onSubmitted(AsyncClient* /*client*/, size_t /*len*/, int8_t /*error*/) {}
+
+  protected:
+    rx_mode_t _rx_mode;
+};
 
 class AsyncClient {
   public:
@@ -67,6 +383,13 @@ class AsyncClient {
     }
     bool connect(IPAddress ip, uint16_t port);
     bool connect(const char* host, uint16_t port);
+#if ASYNC_TCP_SSL_ENABLED
+    //onConnect follows the handshake, onAck and the write watermarks count the encrypted bytes
+    //and the receive window follows the decryption, ackLater() and the ack policy have no effect
+    bool connect(IPAddress ip, uint16_t port, bool secure);
+    bool connect(const char* host, uint16_t port, bool secure);
+    SSL * getSSL();//NULL unless the connection is secure
+#endif
     void close(bool now = false);
     void stop();
     int8_t abort();
@@ -77,9 +400,39 @@ class AsyncClient {
     size_t add(const char* data, size_t size, uint8_t apiflags=ASYNC_WRITE_FLAG_COPY);//add for sending
     bool send();//send all data added with the method above
 
-    //write equals add()+send()
+    //add several buffers with a single call into the TCP/IP thread, returns the bytes added
+    size_t addv(const async_write_buf_t* bufs, size_t count, uint8_t apiflags=ASYNC_WRITE_FLAG_COPY);
+
+    //write equals add()+send(), done with a single call into the TCP/IP thread
     size_t write(const char* data);
     size_t write(const char* data, size_t size, uint8_t apiflags=ASYNC_WRITE_FLAG_COPY); //only when canSend() == true
+    size_t writev(const async_write_buf_t* bufs, size_t count, uint8_t apiflags=ASYNC_WRITE_FLAG_COPY); //addv()+send()
+
+    //zero-copy write of the buffer from offset, returns the bytes queued (call again with the new offset for the rest).
+    //The client keeps a reference until they are acknowledged. A connection that still has such bytes in flight
+    //is reset instead of closed gracefully, because the buffers can not outlive the connection callbacks.
+    size_t write(AsyncBuffer& buffer, size_t offset = 0, bool flush = true);
+    size_t getBuffersInFlight();//zero-copy writes not yet acknowledged
+
+    //zero-copy write of the buffer from offset that does not wait for the TCP/IP thread. The writes of all
+    //tasks go through one ring that the TCP/IP thread drains in batches, what does not fit in the send buffer
+    //waits there for the ACKs. onSubmitted() reports each write in order once LwIP took all of it. Do not mix
+    //with the other writes while some are pending, and writes still waiting when the connection closes are
+    //dropped without a report. Returns false when the ring is full, and for secure connections, whose
+    //records are written by the service task.
+    bool submit(AsyncBuffer& buffer, size_t offset = 0);
+    bool submit(const char* data, size_t size);//submits a copy of the data
+
+    //while corked write() and writev() only queue the data (without PSH) and it is sent once
+    //getMss() bytes are queued or the oldest of them waited max_delay milliseconds
+    void cork(uint32_t max_delay = ASYNC_CORK_TIME);
+    void uncork();//sends what is queued and writes go out right away again
+    bool corked(){ return _corked; }
+
+    //write backpressure on the bytes written but not yet acknowledged, see onWatermark(). It is called
+    //on the service task, when another task writes past high it is raised with the next ACK
+    void setWriteWatermarks(size_t low, size_t high);//high 0 disables, keep it below the TCP send buffer
+    size_t getUnackedBytes();
 
     uint8_t state();
     bool connecting();
@@ -90,12 +443,20 @@ class AsyncClient {
 
     uint16_t getMss();
 
+    uint32_t getSuppressedPolls();//poll ticks skipped because a POLL was still queued
+    void getStats(async_client_stats_t * stats);//since connect, exact when called from the handler
+
     uint32_t getRxTimeout();
     void setRxTimeout(uint32_t timeout);//no RX data timeout for the connection in seconds
 
     uint32_t getAckTimeout();
     void setAckTimeout(uint32_t timeout);//no ACK timeout for the last sent packet in milliseconds
 
+    //group receive window updates, pending bytes are always flushed on poll and before they
+    //hold back more than two segments of the window
+    void setAckPolicy(async_ack_policy_t policy, uint32_t value = 0);
+    async_ack_policy_t getAckPolicy();
+
     void setNoDelay(bool nodelay);
     bool getNoDelay();
 
@@ -116,8 +477,15 @@ class AsyncClient {
     void onError(AcErrorHandler cb, void* arg = 0);         //unsuccessful connect or error
     void onData(AcDataHandler cb, void* arg = 0);           //data received (called if onPacket is not used)
     void onPacket(AcPacketHandler cb, void* arg = 0);       //data received
+    void onRecv(AcRecvHandler cb, void* arg = 0);           //data received, whole chain as one view (takes precedence)
     void onTimeout(AcTimeoutHandler cb, void* arg = 0);     //ack timeout
     void onPoll(AcConnectHandler cb, void* arg = 0);        //every 125ms when connected
+    void onWatermark(AcWatermarkHandler cb, void* arg = 0); //unacked bytes went above the high (true) or back to the low (false) watermark
+    void onSubmitted(AcSubmitHandler cb, void* arg = 0);    //a write from submit() was handed to LwIP, error tells when not all of it was
+
+    //replaces the callbacks above until one of them is set again, the handler is not owned
+    void setHandler(AsyncClientHandler* handler);
+    AsyncClientHandler* getHandler(){ return _handler; }
 
     void ackPacket(struct pbuf * pb);//ack pbuf from onPacket
     size_t ack(size_t len); //ack data that you have not acked using the method below
@@ -131,34 +499,30 @@ class AsyncClient {
     static int8_t _s_recv(void *arg, struct tcp_pcb *tpcb, struct pbuf *pb, int8_t err);
     static int8_t _s_fin(void *arg, struct tcp_pcb *tpcb, int8_t err);
     static int8_t _s_lwip_fin(void *arg, struct tcp_pcb *tpcb, int8_t err);
+    static void _s_lwip_error(void *arg);
+    static void _s_lwip_writable(void *arg);
     static void _s_error(void *arg, int8_t err);
     static int8_t _s_sent(void *arg, struct tcp_pcb *tpcb, uint16_t len);
     static int8_t _s_connected(void* arg, void* tpcb, int8_t err);
     static void _s_dns_found(const char *name, struct ip_addr *ipaddr, void *arg);
+    static void _s_timeout(void *arg);
+    static void _s_cork_timeout(void *arg);
+    static void _s_submitted(void *arg, async_tx_ref *ref, size_t len, bool done, int8_t err);
+#if ASYNC_TCP_SSL_ENABLED
+    static int _s_tls_send(void *ctx, const unsigned char *buf, size_t len);
+    static int _s_tls_recv(void *ctx, unsigned char *buf, size_t len);
+#endif
 
     int8_t _recv(tcp_pcb* pcb, pbuf* pb, int8_t err);
     tcp_pcb * pcb(){ return _pcb; }
+    void _deliver_deferred_sent(tcp_pcb* pcb);
 
   protected:
     tcp_pcb* _pcb;
-    int8_t  _closed_slot;
+    int32_t _closed_slot;//handle of the slot (index and generation), -1 when none
 
-    AcConnectHandler _connect_cb;
-    void* _connect_cb_arg;
-    AcConnectHandler _discard_cb;
-    void* _discard_cb_arg;
-    AcAckHandler _sent_cb;
-    void* _sent_cb_arg;
-    AcErrorHandler _error_cb;
-    void* _error_cb_arg;
-    AcDataHandler _recv_cb;
-    void* _recv_cb_arg;
-    AcPacketHandler _pb_cb;
-    void* _pb_cb_arg;
-    AcTimeoutHandler _timeout_cb;
-    void* _timeout_cb_arg;
-    AcConnectHandler _poll_cb;
-    void* _poll_cb_arg;
+    AsyncClientHandler* _handler;//receives the events, NULL when nothing is set
+    AsyncClientCallbacks* _callbacks;//the on*() callbacks, allocated by the first of them
 
     bool _pcb_busy;
     uint32_t _pcb_sent_at;
@@ -169,9 +533,78 @@ class AsyncClient {
     uint32_t _ack_timeout;
     uint16_t _connect_port;
 
+    std::atomic<uint32_t> _tx_queued;//bytes handed to LwIP since connect
+    std::atomic<uint32_t> _tx_acked;//bytes acknowledged since connect
+    async_tx_ref* _tx_refs;
+    async_tx_ref* _tx_refs_tail;
+    std::atomic<uint32_t> _submits_pending;//in the ring or not yet reported, LwIP may hold their buffers
+    uint32_t _submit_len;//bytes of the oldest pending submit() LwIP took so far
+
+    pbuf* _rx_chain;//received data not consumed through AsyncRxView
+    size_t _rx_chain_len;
+    size_t _rx_chain_offset;//consumed bytes of the first pbuf
+
+    async_ack_policy_t _ack_policy;
+    uint32_t _ack_policy_value;
+    uint32_t _rx_unacked;//bytes handed back but not yet reported to LwIP
+    uint32_t _rx_unacked_since;
+
+    bool _corked;
+    bool _cork_nodelay;//setting to restore on uncork()
+    uint32_t _cork_delay;
+    std::atomic<uint32_t> _corked_len;//bytes queued since the last flush
+
+    size_t _wm_low;
+    size_t _wm_high;
+    std::atomic<bool> _wm_above;//high was raised and low not yet
+
+    async_client_stats_t _stats;//ack_rtt_ms and rx_refused are kept below
+    uint32_t _ack_rtt8;//smoothed ACK latency times 8
+    bool _rx_stalled;//held back data fills the window, counted once until it drains
+    AsyncCallbackTimer* _cb_timer;//outermost handler call in progress, NULL when none
+
+#if ASYNC_TCP_SSL_ENABLED
+    async_tls* _tls;//state of a secure connection, NULL for plain ones
+    bool _tls_arm(bool secure, const char* host, uint32_t ip, uint16_t port);
+    void _tls_free();
+    void _tls_handshake();
+    int8_t _tls_recv(pbuf* pb);
+    void _tls_read();
+    void _tls_ack_read();
+    size_t _tls_space();
+    size_t _tls_write(const char* data, size_t size);
+    size_t _tls_writev(const async_write_buf_t* bufs, size_t count);
+    void _tls_flush();
+    void _tls_fail(int ret);
+#endif
+
     int8_t _close();
+    void _release_tx_buffers(bool all);
+    size_t _rx_consume(size_t len);
+    void _rx_free_chain();
+    void _ack_rx(size_t len);
+    void _ack_flush();
+    void _ack_batch_done();
+    void _timeout();
+    void _schedule_timeout();
+    void _cancel_timeout();
+    bool _send(bool push);
+    void _cork_add(size_t len);
+    void _cork_flush(bool push = false);
+    void _tx_added(size_t len);
+    void _tx_ref_track(async_tx_ref* ref);
+    void _submitted(async_tx_ref* ref, size_t len, bool done, int8_t err);
+    void _check_high_watermark();
+    void _reset_stats();
+    void _callback_done(uint32_t started);
+    void _check_rx_stall();
+    int8_t _deliver(pbuf* pb);
     void _free_closed_slot();
     void _allocate_closed_slot();
+    void _attach(tcp_pcb* pcb);
+    void _recycle();
+    void _discarded();
+    AsyncClientCallbacks* _use_callbacks();
     int8_t _connected(void* pcb, int8_t err);
     void _error(int8_t err);
     int8_t _poll(tcp_pcb* pcb);
@@ -183,6 +616,20 @@ class AsyncClient {
   public:
     AsyncClient* prev;
     AsyncClient* next;
+
+    //event queue bookkeeping shared with the LwIP thread, do not use
+    std::atomic<bool> _poll_queued;
+    std::atomic<uint32_t> _sent_deferred;
+    std::atomic<uint32_t> _polls_suppressed;
+    std::atomic<uint32_t> _rx_refused;
+    async_timer_t _timer;//next ACK or RX deadline, or the return of a discarded pooled client
+    async_timer_t _cork_timer;
+    AsyncServer* _pool_server;//server to give the client back to after discard, NULL when not pooled
+    bool _pool_release;//discarded, goes back to the pool once the dispatch that closed it returned
+
+    friend class AsyncServer;
+    friend class AsyncCallbackTimer;
+    friend class AsyncRxView;
 };
 
 class AsyncServer {
@@ -195,20 +642,40 @@ class AsyncServer {
     void end();
     void setNoDelay(bool nodelay);
     bool getNoDelay();
+    void setBacklog(uint8_t backlog);//connections LwIP holds until accepted, applied on begin(), 0 for no limit (255)
+    uint8_t getBacklog();
     uint8_t status();
 
+    //accept into size clients constructed up front instead of allocating one per connection.
+    //Connections beyond that are refused and counted. Pooled clients go back to the pool
+    //after onDisconnect and must not be deleted. Call before begin()
+    bool setClientPool(size_t size);
+    size_t getClientPoolSize(){ return _pool_size; }
+    size_t getClientPoolFree();
+    uint32_t getRejected();//connections refused because the pool was empty
+
     //Do not use any of the functions below!
     static int8_t _s_accept(void *arg, tcp_pcb* newpcb, int8_t err);
     static int8_t _s_accepted(void *arg, AsyncClient* client);
+    void _release_client(AsyncClient* client);
 
   protected:
     uint16_t _port;
     IPAddress _addr;
     bool _noDelay;
+    uint8_t _backlog;
     tcp_pcb* _pcb;
     AcConnectHandler _connect_cb;
     void* _connect_cb_arg;
 
+    AsyncClient* _pool;
+    AsyncClient** _pool_free;//stack of the idle clients
+    size_t _pool_size;
+    size_t _pool_free_count;
+    std::atomic<uint32_t> _rejected;
+
+    AsyncClient* _take_client();
+
     int8_t _accept(tcp_pcb* newpcb, int8_t err);
     int8_t _accepted(AsyncClient* client);
 };
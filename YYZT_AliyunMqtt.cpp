@@ -12,7 +12,7 @@
 void AliyunMqtt::setDeviceCertificate(String _productKey, String _deviceName, String _deviceSecret, String _region) {
   String timestamp = String(millis());                                                                                                                      // 获取设备上电的时间戳
   char signContent[512] = {0};                                                                                                                              // 定义签名字符串变量
-  sprintf(clientId, "%s|securemode=3,signmethod=hmacsha256,timestamp=%s|", _deviceName.c_str(), timestamp.c_str());                                         // 拼接客户端id
+  sprintf(clientId, "%s|securemode=%d,signmethod=hmacsha256,timestamp=%s|", _deviceName.c_str(), secureState ? 2 : 3, timestamp.c_str());                 // 拼接客户端id，2为TLS直连，3为TCP直连
   sprintf(signContent, "clientId%sdeviceName%sproductKey%stimestamp%s", _deviceName.c_str(), _deviceName.c_str(), _productKey.c_str(), timestamp.c_str());  // 拼接签名内容
 
   hmac256(signContent, _deviceSecret).toCharArray(mqttPassword, sizeof(mqttPassword));  // MQTT密码进行SHA256加密
@@ -23,7 +23,7 @@ void AliyunMqtt::setDeviceCertificate(String _productKey, String _deviceName, St
   sprintf(OMCT_DeviceEventReportingFormat, "/sys/%s/%s/thing/event", _productKey.c_str(), _deviceName.c_str());
   sprintf(domain, "%s.iot-as-mqtt.%s.aliyuncs.com", _productKey.c_str(), _region.c_str());
 
-  mqttClient.setServer(domain, mqttPort);                                                                                                         // 设置服务器ip和端口
+  mqttClient.setServer(domain, serverPort);                                                                                                       // 设置服务器ip和端口
   mqttClient.setClientId(clientId);                                                                                                               // 设置clientId
   mqttClient.setCredentials(mqttUsername, mqttPassword);                                                                                          // 设置MQTT用户名和密码
   mqttClient.onMessage([this](char* topic, char* payload, AsyncMqttClientMessageProperties properties, size_t len, size_t index, size_t total) {  // 设置接收MQTT数据的回调函数
@@ -219,6 +219,21 @@ void AliyunMqtt::setDebug(Stream& _serial) {
   debugState = true;
 }
 
+#if ASYNC_TCP_SSL_ENABLED
+/**
+ * 函数功能：设置是否使用TLS加密连接，即securemode=2的TLS直连模式，不设置则为securemode=3的TCP直连模式
+ * 参数1：[_secure] [bool] true--TLS直连，false--TCP直连
+ * 参数2：[_port] [uint16_t] 服务器端口，默认为1883，阿里云的TLS直连与TCP直连使用同一端口
+ * 返回值：无
+ * 注意事项：需在setDeviceCertificate之前调用；重连时复用上次的TLS会话，跳过完整握手；未调用async_tcp_set_tls_ca设置根证书时不校验服务器证书
+ */
+void AliyunMqtt::setSecure(bool _secure, uint16_t _port) {
+  secureState = _secure;
+  serverPort = _port;
+  mqttClient.setSecure(_secure);
+}
+#endif
+
 /**
  * 函数功能：订阅设备属性设置主题
  * 参数1：[_qos] [uint8_t] qos等级，默认为0
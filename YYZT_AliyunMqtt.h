@@ -158,6 +158,17 @@ class AliyunMqtt {
    */
   void setDebug(Stream& _serial);
 
+#if ASYNC_TCP_SSL_ENABLED
+  /**
+   * 函数功能：设置是否使用TLS加密连接，即securemode=2的TLS直连模式，不设置则为securemode=3的TCP直连模式
+   * 参数1：[_secure] [bool] true--TLS直连，false--TCP直连
+   * 参数2：[_port] [uint16_t] 服务器端口，默认为1883，阿里云的TLS直连与TCP直连使用同一端口
+   * 返回值：无
+   * 注意事项：需在setDeviceCertificate之前调用；重连时复用上次的TLS会话，跳过完整握手；未调用async_tcp_set_tls_ca设置根证书时不校验服务器证书
+   */
+  void setSecure(bool _secure, uint16_t _port = mqttPort);
+#endif
+
   /**
    * 函数功能：订阅设备属性设置主题
    * 参数1：[_qos] [uint8_t] qos等级，默认为0
@@ -177,6 +188,8 @@ class AliyunMqtt {
   poniterJsonDeserialization* poniterJsonDeserializationArray = new poniterJsonDeserialization[callbackCountMax];  // 默认最多绑定50个回调
   Stream* debugSerial = NULL;                                                                                      // 调试串口
   bool debugState = false;                                                                                         // 调试串口状态，默认为false即关闭调试串口打印
+  bool secureState = false;                                                                                        // 是否使用TLS直连，默认为false即TCP直连
+  uint16_t serverPort = mqttPort;                                                                                  // MQTT服务器的端口
 
   char clientId[256] = {0};      // 客户端id
   char mqttUsername[100] = {0};  // MQTT用户名
@@ -0,0 +1,322 @@
+/*
+  Benchmark of the AsyncTCP event path on the Linux port
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * Clients and servers of this process talk over loopback through the epoll
+ * port in posix/, so every byte goes through the LwIP callbacks, the event
+ * queues and the service tasks like on the ESP32:
+ *
+ *   g++ -std=gnu++11 -O2 -I. -Iposix AsyncTCP.cpp posix/AsyncTCP_posix.cpp bench/AsyncTCP_bench.cpp -o async_bench -lpthread
+ *   ./async_bench [max connections] [ms per run]
+ *
+ * Add -DCONFIG_ASYNC_TCP_WORKERS=4 to measure the sharded service tasks.
+ *
+ *   footprint  heap taken per client with on*() callbacks and with a handler
+ *   stream     bulk writes of every connection, throughput and events per second
+ *   add+send   64 byte messages written as header and body with add(), add(), send()
+ *   writev     the same messages with a single writev()
+ *   churn      connections opened and closed by the server right away, per second
+ *
+ * The runs go from 1 connection to the maximum in steps of 4x. The latency
+ * columns are percentiles of the time from the LwIP callback to the dispatch
+ * in the service task, the upper bound of the async_tcp_stats_t bucket they
+ * fall in. The queue runs in ASYNC_QUEUE_NONBLOCK mode: handlers writing
+ * from the service task must not wait for the TCP/IP thread while it waits
+ * for room in their queue.
+ * */
+
+#include "Arduino.h"
+#include "AsyncTCP.h"
+#include <atomic>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BENCH_SINK_PORT 9931
+#define BENCH_CHURN_PORT 9932
+#define BENCH_CHUNK 1460
+#define BENCH_HEADER 4
+#define BENCH_MESSAGE 64
+#define BENCH_FOOTPRINT_CLIENTS 1000
+
+typedef enum {
+    BENCH_STREAM, BENCH_ADD_SEND, BENCH_WRITEV
+} bench_write_t;
+
+static std::atomic<bool> _running(false);
+static std::atomic<uint64_t> _sink_bytes(0);
+static std::atomic<uint32_t> _connected(0);
+static std::atomic<uint32_t> _cycles(0);
+static std::atomic<uint32_t> _errors(0);
+static char _payload[BENCH_CHUNK];
+
+//counts what the clients send, the data is acked as it arrives
+class SinkHandler : public AsyncClientHandler {
+  public:
+    void onData(AsyncClient* client, void* data, size_t len) override {
+        _sink_bytes.fetch_add(len, std::memory_order_relaxed);
+    }
+};
+
+//keeps the send buffer of its connection full while the run lasts
+class PumpHandler : public AsyncClientHandler {
+  public:
+    bench_write_t mode;
+
+    void onConnect(AsyncClient* client) override {
+        _connected++;
+        pump(client);
+    }
+    void onAck(AsyncClient* client, size_t len, uint32_t time) override { pump(client); }
+    void onPoll(AsyncClient* client) override { pump(client); }
+    void onError(AsyncClient* client, int8_t error) override { _errors++; }
+
+    //writes at most the space there was on entry, the other connections of the service task get their turn
+    void pump(AsyncClient* client){
+        size_t budget = client->space();
+        while(_running.load(std::memory_order_relaxed)){
+            size_t space = client->space();
+            if(space > budget){
+                space = budget;
+            }
+            if(mode == BENCH_STREAM){
+                size_t len = (space < BENCH_CHUNK)?space:BENCH_CHUNK;
+                if(!len || !client->write(_payload, len)){
+                    return;
+                }
+                budget -= len;
+                continue;
+            }
+            if(space < BENCH_MESSAGE){
+                return;
+            }
+            if(mode == BENCH_ADD_SEND){
+                client->add(_payload, BENCH_HEADER);
+                client->add(_payload + BENCH_HEADER, BENCH_MESSAGE - BENCH_HEADER);
+                client->send();
+            } else {
+                async_write_buf_t bufs[2] = {
+                    { _payload, BENCH_HEADER },
+                    { _payload + BENCH_HEADER, BENCH_MESSAGE - BENCH_HEADER }
+                };
+                client->writev(bufs, 2);
+            }
+            budget -= BENCH_MESSAGE;
+        }
+    }
+};
+
+//connects again as soon as the server closed the connection
+class ChurnHandler : public AsyncClientHandler {
+  public:
+    void onError(AsyncClient* client, int8_t error) override { _errors++; }
+    void onDisconnect(AsyncClient* client) override {
+        _cycles++;
+        if(_running.load(std::memory_order_relaxed)){
+            client->connect(IPAddress(127, 0, 0, 1), BENCH_CHURN_PORT);
+        }
+    }
+};
+
+static SinkHandler _sink;
+
+static size_t heap_used(){
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks;
+}
+
+static void snapshot(async_tcp_stats_t* stats){
+    async_tcp_get_stats(stats);
+}
+
+//events dispatched between the snapshots and the percentiles of their latency
+static void print_events(const async_tcp_stats_t* before, const async_tcp_stats_t* after, uint32_t ms){
+    uint64_t dispatched = 0;
+    uint64_t buckets[ASYNC_TCP_LATENCY_BUCKETS] = {0};
+    for(int t = 0; t < ASYNC_TCP_EVENT_TYPES; ++ t){
+        dispatched += after->events[t].dispatched - before->events[t].dispatched;
+        for(int b = 0; b < ASYNC_TCP_LATENCY_BUCKETS; ++ b){
+            buckets[b] += after->events[t].latency[b] - before->events[t].latency[b];
+        }
+    }
+    uint64_t total = 0;
+    for(int b = 0; b < ASYNC_TCP_LATENCY_BUCKETS; ++ b){
+        total += buckets[b];
+    }
+    printf(" %10.0f", dispatched * 1000.0 / ms);
+    const double percentiles[] = { 0.5, 0.99, 0.999 };
+    for(double p : percentiles){
+        uint64_t seen = 0;
+        int b = 0;
+        while(b < ASYNC_TCP_LATENCY_BUCKETS - 1 && (!total || seen + buckets[b] < p * total)){
+            seen += buckets[b++];
+        }
+        if(b == ASYNC_TCP_LATENCY_BUCKETS - 1){
+            printf("   >%6uus", 1u << (b + 4));
+        } else {
+            printf("   <%6uus", 1u << (b + 5));
+        }
+    }
+    printf("\n");
+}
+
+static void print_header(const char* title, const char* rate){
+    printf("\n%-9s %6s %12s %10s %11s %11s %11s\n", title, "conns", rate, "events/s", "p50", "p99", "p99.9");
+}
+
+static void bench_footprint(){
+    AsyncClient** clients = new AsyncClient*[BENCH_FOOTPRINT_CLIENTS];
+    size_t before = heap_used();
+    for(int i = 0; i < BENCH_FOOTPRINT_CLIENTS; ++ i){
+        clients[i] = new AsyncClient();
+        clients[i]->onConnect([](void* arg, AsyncClient* c){}, NULL);
+        clients[i]->onDisconnect([](void* arg, AsyncClient* c){}, NULL);
+        clients[i]->onData([](void* arg, AsyncClient* c, void* data, size_t len){}, NULL);
+        clients[i]->onAck([](void* arg, AsyncClient* c, size_t len, uint32_t time){}, NULL);
+        clients[i]->onError([](void* arg, AsyncClient* c, int8_t error){}, NULL);
+    }
+    size_t callbacks = (heap_used() - before) / BENCH_FOOTPRINT_CLIENTS;
+    for(int i = 0; i < BENCH_FOOTPRINT_CLIENTS; ++ i){
+        delete clients[i];
+    }
+    PumpHandler handler;
+    before = heap_used();
+    for(int i = 0; i < BENCH_FOOTPRINT_CLIENTS; ++ i){
+        clients[i] = new AsyncClient();
+        clients[i]->setHandler(&handler);
+    }
+    size_t handlers = (heap_used() - before) / BENCH_FOOTPRINT_CLIENTS;
+    for(int i = 0; i < BENCH_FOOTPRINT_CLIENTS; ++ i){
+        delete clients[i];
+    }
+    delete[] clients;
+    printf("footprint  sizeof(AsyncClient) %u, heap per client: %u with five on*() callbacks, %u with a handler\n",
+        (unsigned)sizeof(AsyncClient), (unsigned)callbacks, (unsigned)handlers);
+}
+
+static void bench_write(bench_write_t mode, int conns, uint32_t ms){
+    AsyncClient* clients = new AsyncClient[conns];
+    PumpHandler* pumps = new PumpHandler[conns];
+    _connected = 0;
+    _running = true;
+    for(int i = 0; i < conns; ++ i){
+        pumps[i].mode = mode;
+        clients[i].setHandler(&pumps[i]);
+        clients[i].connect(IPAddress(127, 0, 0, 1), BENCH_SINK_PORT);
+    }
+    uint32_t started = millis();
+    while(_connected < (uint32_t)conns && millis() - started < 5000){
+        delay(1);
+    }
+    async_tcp_stats_t before, after;
+    uint64_t bytes = _sink_bytes;
+    snapshot(&before);
+    delay(ms);
+    snapshot(&after);
+    bytes = _sink_bytes - bytes;
+    _running = false;
+    delay(100);
+    for(int i = 0; i < conns; ++ i){
+        clients[i].close(true);
+    }
+    if(mode == BENCH_STREAM){
+        printf("%-9s %6d %9.1fMB/s", "stream", conns, bytes * 1000.0 / ms / (1024 * 1024));
+    } else {
+        printf("%-9s %6d %10.0f/s", (mode == BENCH_ADD_SEND)?"add+send":"writev", conns, bytes * 1000.0 / ms / BENCH_MESSAGE);
+    }
+    print_events(&before, &after, ms);
+    delete[] clients;
+    delete[] pumps;
+}
+
+static void bench_churn(int conns, uint32_t ms){
+    AsyncClient* clients = new AsyncClient[conns];
+    ChurnHandler handler;
+    _running = true;
+    uint32_t cycles = _cycles;
+    async_tcp_stats_t before, after;
+    snapshot(&before);
+    for(int i = 0; i < conns; ++ i){
+        clients[i].setHandler(&handler);
+        clients[i].connect(IPAddress(127, 0, 0, 1), BENCH_CHURN_PORT);
+    }
+    delay(ms);
+    snapshot(&after);
+    cycles = _cycles - cycles;
+    _running = false;
+    delay(100);
+    for(int i = 0; i < conns; ++ i){
+        clients[i].close(true);
+    }
+    printf("%-9s %6d %10.0f/s", "churn", conns, cycles * 1000.0 / ms);
+    print_events(&before, &after, ms);
+    delete[] clients;
+}
+
+int main(int argc, char** argv){
+    int max_conns = (argc > 1)?atoi(argv[1]):64;
+    uint32_t ms = (argc > 2)?atoi(argv[2]):1000;
+    if(max_conns < 1 || !ms){
+        printf("usage: %s [max connections] [ms per run]\n", argv[0]);
+        return 1;
+    }
+    //the runs take a while, show each line when it is done
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    memset(_payload, 'a', sizeof(_payload));
+    async_tcp_set_queue_mode(ASYNC_QUEUE_NONBLOCK);
+
+    AsyncServer sink(IPAddress(127, 0, 0, 1), BENCH_SINK_PORT);
+    sink.setClientPool(max_conns);
+    sink.onClient([](void* arg, AsyncClient* client){
+        client->setHandler(&_sink);
+    }, NULL);
+    sink.begin();
+
+    //TIME_WAIT stays on the server side, the client ports can be used again
+    AsyncServer closer(IPAddress(127, 0, 0, 1), BENCH_CHURN_PORT);
+    closer.setClientPool(max_conns * 2);
+    closer.setBacklog(255);
+    closer.onClient([](void* arg, AsyncClient* client){
+        client->close();
+    }, NULL);
+    closer.begin();
+
+    printf("AsyncTCP benchmark, %d worker(s), %u ms per run\n", CONFIG_ASYNC_TCP_WORKERS, ms);
+    bench_footprint();
+
+    const bench_write_t modes[] = { BENCH_STREAM, BENCH_ADD_SEND, BENCH_WRITEV };
+    for(bench_write_t mode : modes){
+        print_header((mode == BENCH_STREAM)?"stream":(mode == BENCH_ADD_SEND)?"add+send":"writev", (mode == BENCH_STREAM)?"throughput":"messages");
+        for(int conns = 1; ; conns *= 4){
+            bench_write(mode, (conns < max_conns)?conns:max_conns, ms);
+            if(conns >= max_conns){
+                break;
+            }
+        }
+    }
+    print_header("churn", "cycles");
+    for(int conns = 1; ; conns *= 4){
+        bench_churn((conns < max_conns)?conns:max_conns, ms);
+        if(conns >= max_conns){
+            break;
+        }
+    }
+    printf("\nerrors %u, connections refused by the server pools %u\n", (unsigned)_errors, (unsigned)(sink.getRejected() + closer.getRejected()));
+    return 0;
+}
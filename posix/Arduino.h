@@ -0,0 +1,42 @@
+/*
+  Minimal Arduino environment for building AsyncTCP on Linux, see AsyncTCP_posix.cpp
+*/
+
+#ifndef POSIX_ARDUINO_H_
+#define POSIX_ARDUINO_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+
+#ifdef __cplusplus
+#include "IPAddress.h"
+extern "C" {
+#endif
+
+//32 bit like on the ESP32, so the wrap around arithmetic of the library stays the same
+uint32_t millis();
+uint32_t micros();
+void delay(uint32_t ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+//the library logs pointers as 32 bit values, which does not build on 64 bit hosts
+#define log_e(...) do {} while(0)
+#define log_w(...) do {} while(0)
+#define log_i(...) do {} while(0)
+#define log_d(...) do {} while(0)
+#define log_v(...) do {} while(0)
+#define ets_printf(...) printf(__VA_ARGS__)
+
+#endif /* POSIX_ARDUINO_H_ */
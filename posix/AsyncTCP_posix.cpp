@@ -0,0 +1,1419 @@
+/*
+  Linux port of the LwIP raw TCP API and the FreeRTOS calls used by AsyncTCP
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+/*
+ * The headers next to this file stand in for the Arduino core, FreeRTOS and
+ * LwIP, so AsyncTCP.cpp builds unchanged on Linux:
+ *
+ *   g++ -std=gnu++11 -O2 -I. -Iposix AsyncTCP.cpp posix/AsyncTCP_posix.cpp app.cpp -lpthread
+ *
+ * The TCP/IP thread of LwIP becomes an epoll loop over non-blocking sockets
+ * that calls the raw API callbacks, which queue the events for the async_tcp
+ * service tasks (plain threads) like on the ESP32. The kernel does not tell
+ * when the peer acknowledged data, so connections with bytes in flight are
+ * checked with SIOCOUTQ after every pass of the loop.
+ * */
+
+#if defined(__linux__) && !defined(ESP_PLATFORM)
+
+#include "Arduino.h"
+#include "esp_task_wdt.h"
+#include "lwip/opt.h"
+#include "lwip/tcp.h"
+#include "lwip/dns.h"
+#include "lwip/priv/tcpip_priv.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <linux/sockios.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef TCP_READ_SIZE
+#define TCP_READ_SIZE 16384 //bytes per pbuf handed to the recv callback
+#endif
+
+#ifndef TCP_READS_PER_EVENT
+#define TCP_READS_PER_EVENT 4 //before the loop moves on to the other sockets
+#endif
+
+#define TCP_EPOLL_EVENTS 64
+#define TCP_IOV_MAX 64
+#define TCP_BUSY_WAIT_MAX 16 //milliseconds between SIOCOUTQ checks while nothing gets acknowledged
+
+/*
+ * Clock
+ * */
+
+static uint64_t _monotonic_us(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static uint64_t _boot_us(){
+    static uint64_t boot = _monotonic_us();
+    return boot;
+}
+
+uint32_t micros(){
+    uint64_t boot = _boot_us();//first, the first call sets it
+    return (uint32_t)(_monotonic_us() - boot);
+}
+
+uint32_t millis(){
+    uint64_t boot = _boot_us();
+    return (uint32_t)((_monotonic_us() - boot) / 1000);
+}
+
+void delay(uint32_t ms){
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+/*
+ * Tasks
+ * */
+
+typedef struct {
+    TaskFunction_t fn;
+    void * arg;
+} posix_task_t;
+
+static thread_local posix_task_t * _current_task = NULL;
+
+static void * _task_main(void * arg){
+    _current_task = (posix_task_t *)arg;
+    _current_task->fn(_current_task->arg);
+    return NULL;
+}
+
+BaseType_t xTaskCreateUniversal(TaskFunction_t task, const char * name, uint32_t stack_size, void * arg, UBaseType_t priority, TaskHandle_t * handle, BaseType_t core){
+    posix_task_t * t = new (std::nothrow) posix_task_t;
+    if(!t){
+        return pdFAIL;
+    }
+    t->fn = task;
+    t->arg = arg;
+    //the handle is valid before the task runs, like in FreeRTOS
+    if(handle){
+        *handle = t;
+    }
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, _task_main, t) != 0){
+        if(handle){
+            *handle = NULL;
+        }
+        delete t;
+        return pdFAIL;
+    }
+    char thread_name[16];
+    snprintf(thread_name, sizeof(thread_name), "%s", name);
+    pthread_setname_np(thread, thread_name);
+    pthread_detach(thread);
+    return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task){
+    if(task && task != _current_task){
+        fprintf(stderr, "vTaskDelete: only the calling task can be deleted\n");
+        return;
+    }
+    delete _current_task;
+    _current_task = NULL;
+    pthread_exit(NULL);
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(){
+    return _current_task;
+}
+
+TickType_t xTaskGetTickCount(){
+    return millis() / portTICK_PERIOD_MS;
+}
+
+void vTaskDelay(TickType_t ticks){
+    delay(ticks * portTICK_PERIOD_MS);
+}
+
+/*
+ * Critical Sections
+ * */
+
+static uint32_t _thread_id(){
+    static std::atomic<uint32_t> next_id(1);
+    static thread_local uint32_t id = next_id++;
+    return id;
+}
+
+void vPortCPUInitializeMutex(portMUX_TYPE * mux){
+    mux->owner = 0;
+    mux->count = 0;
+}
+
+void vPortEnterCritical(portMUX_TYPE * mux){
+    uint32_t me = _thread_id();
+    if(__atomic_load_n(&mux->owner, __ATOMIC_RELAXED) == me){
+        mux->count++;
+        return;
+    }
+    for(;;){
+        uint32_t expected = 0;
+        if(__atomic_compare_exchange_n(&mux->owner, &expected, me, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+            break;
+        }
+        sched_yield();
+    }
+    mux->count = 1;
+}
+
+void vPortExitCritical(portMUX_TYPE * mux){
+    if(--mux->count == 0){
+        __atomic_store_n(&mux->owner, 0, __ATOMIC_RELEASE);
+    }
+}
+
+/*
+ * Queues and Semaphores
+ * */
+
+typedef struct {
+    std::mutex lock;
+    std::condition_variable can_receive;
+    std::condition_variable can_send;
+    uint8_t * items;
+    UBaseType_t length;
+    UBaseType_t item_size;
+    UBaseType_t head;
+    UBaseType_t count;
+} posix_queue_t;
+
+template<typename Ready>
+static bool _wait_for(std::condition_variable & cv, std::unique_lock<std::mutex> & lock, TickType_t ticks, Ready ready){
+    if(ticks == portMAX_DELAY){
+        cv.wait(lock, ready);
+        return true;
+    }
+    return cv.wait_for(lock, std::chrono::milliseconds((uint64_t)ticks * portTICK_PERIOD_MS), ready);
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size){
+    if(!length){
+        return NULL;
+    }
+    posix_queue_t * q = new (std::nothrow) posix_queue_t;
+    if(!q){
+        return NULL;
+    }
+    q->items = (uint8_t *)malloc(length * item_size + 1);
+    if(!q->items){
+        delete q;
+        return NULL;
+    }
+    q->length = length;
+    q->item_size = item_size;
+    q->head = 0;
+    q->count = 0;
+    return q;
+}
+
+void vQueueDelete(QueueHandle_t queue){
+    posix_queue_t * q = (posix_queue_t *)queue;
+    if(q){
+        free(q->items);
+        delete q;
+    }
+}
+
+static BaseType_t _queue_send(QueueHandle_t queue, const void * item, TickType_t ticks, bool front){
+    posix_queue_t * q = (posix_queue_t *)queue;
+    std::unique_lock<std::mutex> lock(q->lock);
+    if(!_wait_for(q->can_send, lock, ticks, [q]{ return q->count < q->length; })){
+        return pdFAIL;
+    }
+    UBaseType_t index;
+    if(front){
+        q->head = (q->head + q->length - 1) % q->length;
+        index = q->head;
+    } else {
+        index = (q->head + q->count) % q->length;
+    }
+    if(q->item_size){
+        memcpy(q->items + index * q->item_size, item, q->item_size);
+    }
+    q->count++;
+    q->can_receive.notify_one();
+    return pdPASS;
+}
+
+static BaseType_t _queue_receive(QueueHandle_t queue, void * item, TickType_t ticks, bool peek){
+    posix_queue_t * q = (posix_queue_t *)queue;
+    std::unique_lock<std::mutex> lock(q->lock);
+    if(!_wait_for(q->can_receive, lock, ticks, [q]{ return q->count > 0; })){
+        return pdFAIL;
+    }
+    if(q->item_size && item){
+        memcpy(item, q->items + q->head * q->item_size, q->item_size);
+    }
+    if(!peek){
+        q->head = (q->head + 1) % q->length;
+        q->count--;
+        q->can_send.notify_one();
+    }
+    return pdPASS;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void * item, TickType_t ticks){
+    return _queue_send(queue, item, ticks, false);
+}
+
+BaseType_t xQueueSendToBack(QueueHandle_t queue, const void * item, TickType_t ticks){
+    return _queue_send(queue, item, ticks, false);
+}
+
+BaseType_t xQueueSendToFront(QueueHandle_t queue, const void * item, TickType_t ticks){
+    return _queue_send(queue, item, ticks, true);
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void * item, TickType_t ticks){
+    return _queue_receive(queue, item, ticks, false);
+}
+
+BaseType_t xQueuePeek(QueueHandle_t queue, void * item, TickType_t ticks){
+    return _queue_receive(queue, item, ticks, true);
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue){
+    posix_queue_t * q = (posix_queue_t *)queue;
+    std::lock_guard<std::mutex> lock(q->lock);
+    return q->count;
+}
+
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t queue){
+    posix_queue_t * q = (posix_queue_t *)queue;
+    std::lock_guard<std::mutex> lock(q->lock);
+    return q->length - q->count;
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max, UBaseType_t initial){
+    SemaphoreHandle_t sem = xQueueCreate(max, 0);
+    for(UBaseType_t i = 0; sem && i < initial; ++i){
+        xSemaphoreGive(sem);
+    }
+    return sem;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(){
+    return xSemaphoreCreateCounting(1, 0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(){
+    return xSemaphoreCreateCounting(1, 1);
+}
+
+/*
+ * Packet Buffers
+ * */
+
+struct pbuf * pbuf_alloc(pbuf_layer layer, uint16_t length, pbuf_type type){
+    struct pbuf * p = (struct pbuf *)malloc(sizeof(struct pbuf) + length);
+    if(!p){
+        return NULL;
+    }
+    p->next = NULL;
+    p->payload = (uint8_t *)p + sizeof(struct pbuf);
+    p->tot_len = length;
+    p->len = length;
+    p->type_internal = type;
+    p->flags = 0;
+    p->ref = 1;
+    return p;
+}
+
+uint8_t pbuf_free(struct pbuf * p){
+    uint8_t count = 0;
+    while(p){
+        if(--p->ref){
+            break;
+        }
+        struct pbuf * next = p->next;
+        free(p);
+        count++;
+        p = next;
+    }
+    return count;
+}
+
+void pbuf_ref(struct pbuf * p){
+    if(p){
+        p->ref++;
+    }
+}
+
+void pbuf_cat(struct pbuf * head, struct pbuf * tail){
+    struct pbuf * p = head;
+    for(; p->next; p = p->next){
+        p->tot_len += tail->tot_len;
+    }
+    p->tot_len += tail->tot_len;
+    p->next = tail;
+}
+
+void pbuf_chain(struct pbuf * head, struct pbuf * tail){
+    pbuf_cat(head, tail);
+    pbuf_ref(tail);
+}
+
+uint16_t pbuf_clen(const struct pbuf * p){
+    uint16_t count = 0;
+    for(; p; p = p->next){
+        count++;
+    }
+    return count;
+}
+
+uint16_t pbuf_copy_partial(const struct pbuf * p, void * dataptr, uint16_t len, uint16_t offset){
+    uint16_t copied = 0;
+    for(; p && copied < len; p = p->next){
+        if(offset >= p->len){
+            offset -= p->len;
+            continue;
+        }
+        uint16_t n = p->len - offset;
+        if(n > len - copied){
+            n = len - copied;
+        }
+        memcpy((uint8_t *)dataptr + copied, (const uint8_t *)p->payload + offset, n);
+        copied += n;
+        offset = 0;
+    }
+    return copied;
+}
+
+int pbuf_try_get_at(const struct pbuf * p, uint16_t offset){
+    for(; p; p = p->next){
+        if(offset < p->len){
+            return ((const uint8_t *)p->payload)[offset];
+        }
+        offset -= p->len;
+    }
+    return -1;
+}
+
+uint8_t pbuf_get_at(const struct pbuf * p, uint16_t offset){
+    int c = pbuf_try_get_at(p, offset);
+    return (c < 0)?0:(uint8_t)c;
+}
+
+char * ipaddr_ntoa(const ip_addr_t * addr){
+    static char buf[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &addr->u_addr.ip4.addr, buf, sizeof(buf));
+    return buf;
+}
+
+/*
+ * TCP/IP Thread
+ *
+ * Runs everything LwIP would run: the calls passed in through the mailbox,
+ * the socket events and the poll timer. Closed PCBs are kept until the end
+ * of the pass, so later events of the same epoll_wait() find them with no
+ * socket and are skipped, and then pooled like the memp pools of LwIP: a
+ * stale pointer held by another thread still points to a PCB.
+ * */
+
+struct tcp_seg {
+    struct tcp_seg * next;
+    const char * data;
+    uint32_t len;
+    uint32_t off;//bytes of it written already
+};
+
+typedef struct {
+    tcpip_callback_fn fn;
+    void * ctx;
+} tcpip_msg_t;
+
+typedef struct {
+    int epoll_fd;
+    int wake_fd;
+    std::mutex mbox_lock;
+    std::deque<tcpip_msg_t> mbox;
+    std::mutex pool_lock;
+    struct tcp_pcb * free_pcbs;
+    //only touched by the TCP/IP thread
+    struct tcp_pcb * active_pcbs;
+    std::vector<struct tcp_pcb *> busy_pcbs;
+    std::vector<struct tcp_pcb *> retired_pcbs;
+    int busy_wait;
+} tcpip_state_t;
+
+//never freed, the thread keeps running while the process exits
+static tcpip_state_t * _tcpip = NULL;
+static pthread_once_t _tcpip_once = PTHREAD_ONCE_INIT;
+static thread_local bool _in_tcpip_thread = false;
+static uint8_t _rx_scratch[TCP_READ_SIZE];
+
+static void * _tcpip_thread(void * arg);
+
+static void _tcpip_init(){
+    _tcpip = new tcpip_state_t;
+    _tcpip->free_pcbs = NULL;
+    _tcpip->active_pcbs = NULL;
+    _tcpip->busy_wait = 1;
+    _tcpip->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    _tcpip->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(_tcpip->epoll_fd < 0 || _tcpip->wake_fd < 0){
+        perror("tcpip");
+        abort();
+    }
+    struct epoll_event e;
+    e.events = EPOLLIN;
+    e.data.ptr = NULL;
+    epoll_ctl(_tcpip->epoll_fd, EPOLL_CTL_ADD, _tcpip->wake_fd, &e);
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, _tcpip_thread, NULL) != 0){
+        perror("tcpip");
+        abort();
+    }
+    pthread_setname_np(thread, "tcpip");
+    pthread_detach(thread);
+}
+
+static inline void _tcpip_start(){
+    pthread_once(&_tcpip_once, _tcpip_init);
+}
+
+static err_t _tcpip_post(tcpip_callback_fn fn, void * ctx, bool may_fail){
+    _tcpip_start();
+    {
+        std::lock_guard<std::mutex> lock(_tcpip->mbox_lock);
+        if(may_fail && _tcpip->mbox.size() >= TCPIP_MBOX_SIZE){
+            return ERR_MEM;
+        }
+        tcpip_msg_t msg = { fn, ctx };
+        _tcpip->mbox.push_back(msg);
+    }
+    uint64_t one = 1;
+    if(write(_tcpip->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN){
+        perror("tcpip wake");
+    }
+    return ERR_OK;
+}
+
+static void _tcpip_run_mbox(){
+    uint64_t count;
+    if(read(_tcpip->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN){
+        perror("tcpip wake");
+    }
+    std::deque<tcpip_msg_t> mbox;
+    {
+        std::lock_guard<std::mutex> lock(_tcpip->mbox_lock);
+        mbox.swap(_tcpip->mbox);
+    }
+    for(size_t i = 0; i < mbox.size(); ++i){
+        mbox[i].fn(mbox[i].ctx);
+    }
+}
+
+err_t tcpip_callback(tcpip_callback_fn fn, void * ctx){
+    return _tcpip_post(fn, ctx, false);
+}
+
+err_t tcpip_try_callback(tcpip_callback_fn fn, void * ctx){
+    return _tcpip_post(fn, ctx, true);
+}
+
+typedef struct {
+    tcpip_api_call_fn fn;
+    struct tcpip_api_call_data * call;
+    std::mutex lock;
+    std::condition_variable cv;
+    bool done;
+} tcpip_api_wait_t;
+
+static void _tcpip_api_run(void * ctx){
+    tcpip_api_wait_t * w = (tcpip_api_wait_t *)ctx;
+    w->call->err = w->fn(w->call);
+    //notify while locked, the caller owns the waiter and returns as soon as it sees done
+    std::lock_guard<std::mutex> lock(w->lock);
+    w->done = true;
+    w->cv.notify_one();
+}
+
+err_t tcpip_api_call(tcpip_api_call_fn fn, struct tcpip_api_call_data * call){
+    if(_in_tcpip_thread){
+        call->err = fn(call);
+        return call->err;
+    }
+    tcpip_api_wait_t w;
+    w.fn = fn;
+    w.call = call;
+    w.done = false;
+    _tcpip_post(_tcpip_api_run, &w, false);
+    std::unique_lock<std::mutex> lock(w.lock);
+    w.cv.wait(lock, [&w]{ return w.done; });
+    return call->err;
+}
+
+/*
+ * PCB Bookkeeping
+ * */
+
+static struct tcp_pcb * _pcb_alloc(){
+    _tcpip_start();
+    struct tcp_pcb * pcb;
+    {
+        std::lock_guard<std::mutex> lock(_tcpip->pool_lock);
+        pcb = _tcpip->free_pcbs;
+        if(pcb){
+            _tcpip->free_pcbs = pcb->next;
+        }
+    }
+    if(!pcb){
+        pcb = (struct tcp_pcb *)malloc(sizeof(struct tcp_pcb));
+        if(!pcb){
+            return NULL;
+        }
+    }
+    memset(pcb, 0, sizeof(struct tcp_pcb));
+    pcb->local_ip.type = IPADDR_TYPE_V4;
+    pcb->remote_ip.type = IPADDR_TYPE_V4;
+    pcb->state = CLOSED;
+    pcb->snd_buf = TCP_SND_BUF;
+    pcb->rcv_wnd = TCP_WND;
+    pcb->mss = TCP_MSS;
+    pcb->fd = -1;
+    return pcb;
+}
+
+static void _pcb_link(struct tcp_pcb * pcb){
+    if(pcb->prev || _tcpip->active_pcbs == pcb){
+        return;
+    }
+    pcb->next = _tcpip->active_pcbs;
+    if(pcb->next){
+        pcb->next->prev = pcb;
+    }
+    _tcpip->active_pcbs = pcb;
+}
+
+static void _pcb_unlink(struct tcp_pcb * pcb){
+    if(!pcb->prev && _tcpip->active_pcbs != pcb){
+        return;
+    }
+    if(pcb->prev){
+        pcb->prev->next = pcb->next;
+    } else {
+        _tcpip->active_pcbs = pcb->next;
+    }
+    if(pcb->next){
+        pcb->next->prev = pcb->prev;
+    }
+    pcb->next = NULL;
+    pcb->prev = NULL;
+}
+
+static void _pcb_busy(struct tcp_pcb * pcb){
+    if(!pcb->busy){
+        pcb->busy = 1;
+        _tcpip->busy_pcbs.push_back(pcb);
+    }
+    _tcpip->busy_wait = 1;
+}
+
+static void _pcb_update_sndbuf(struct tcp_pcb * pcb){
+    uint32_t used = pcb->unsent_len + (pcb->written - pcb->acked);
+    pcb->snd_buf = (used >= TCP_SND_BUF)?0:(TCP_SND_BUF - used);
+}
+
+//what epoll has to report for the current state of the PCB
+static void _pcb_update_events(struct tcp_pcb * pcb){
+    if(pcb->fd < 0){
+        return;
+    }
+    uint32_t events = 0;
+    if(pcb->state == LISTEN){
+        events = EPOLLIN;
+    } else if(pcb->state == SYN_SENT){
+        events = pcb->pending_err?0:(uint32_t)EPOLLOUT;
+    } else {
+        if(pcb->unsent && !pcb->pending_err){
+            events |= EPOLLOUT;
+        }
+        if(pcb->state == ESTABLISHED && !pcb->closing && pcb->rcv_wnd && !pcb->refused_data){
+            events |= EPOLLIN;
+        }
+    }
+    if(events == pcb->events){
+        return;
+    }
+    struct epoll_event e;
+    e.events = events;
+    e.data.ptr = pcb;
+    if(!events){
+        epoll_ctl(_tcpip->epoll_fd, EPOLL_CTL_DEL, pcb->fd, &e);
+    } else {
+        epoll_ctl(_tcpip->epoll_fd, pcb->events?EPOLL_CTL_MOD:EPOLL_CTL_ADD, pcb->fd, &e);
+    }
+    pcb->events = events;
+}
+
+//closes the socket, the PCB is pooled again after the current pass
+static void _pcb_retire(struct tcp_pcb * pcb, bool reset){
+    if(pcb->fd >= 0){
+        if(pcb->events){
+            epoll_ctl(_tcpip->epoll_fd, EPOLL_CTL_DEL, pcb->fd, NULL);
+        }
+        if(reset){
+            struct linger l = { 1, 0 };
+            setsockopt(pcb->fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+        }
+        ::close(pcb->fd);
+        pcb->fd = -1;
+    }
+    pcb->events = 0;
+    pcb->state = CLOSED;
+    _pcb_unlink(pcb);
+    while(pcb->unsent){
+        struct tcp_seg * seg = pcb->unsent;
+        pcb->unsent = seg->next;
+        free(seg);
+    }
+    pcb->unsent_tail = NULL;
+    pcb->unsent_len = 0;
+    if(pcb->refused_data){
+        pbuf_free(pcb->refused_data);
+        pcb->refused_data = NULL;
+    }
+    _tcpip->retired_pcbs.push_back(pcb);
+}
+
+static void _pcb_release_retired(){
+    if(_tcpip->retired_pcbs.empty()){
+        return;
+    }
+    std::lock_guard<std::mutex> lock(_tcpip->pool_lock);
+    for(size_t i = 0; i < _tcpip->retired_pcbs.size(); ++i){
+        struct tcp_pcb * pcb = _tcpip->retired_pcbs[i];
+        pcb->next = _tcpip->free_pcbs;
+        _tcpip->free_pcbs = pcb;
+    }
+    _tcpip->retired_pcbs.clear();
+}
+
+static err_t _err_from_errno(int e){
+    switch(e){
+        case ECONNREFUSED:
+        case ECONNRESET: return ERR_RST;
+        case ETIMEDOUT: return ERR_TIMEOUT;
+        case ENETUNREACH:
+        case EHOSTUNREACH: return ERR_RTE;
+        case EPIPE: return ERR_CLSD;
+        case ENOMEM:
+        case ENOBUFS: return ERR_MEM;
+        default: return ERR_ABRT;
+    }
+}
+
+//like LwIP the PCB is freed before the error callback runs
+static void _pcb_report_error(struct tcp_pcb * pcb, err_t err){
+    tcp_err_fn errf = pcb->errf;
+    void * arg = pcb->callback_arg;
+    _pcb_retire(pcb, false);
+    if(errf){
+        errf(arg, err);
+    }
+}
+
+static void _pcb_established(struct tcp_pcb * pcb){
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    if(getsockname(pcb->fd, (struct sockaddr *)&addr, &len) == 0){
+        pcb->local_ip.u_addr.ip4.addr = addr.sin_addr.s_addr;
+        pcb->local_port = ntohs(addr.sin_port);
+    }
+    len = sizeof(addr);
+    if(getpeername(pcb->fd, (struct sockaddr *)&addr, &len) == 0){
+        pcb->remote_ip.u_addr.ip4.addr = addr.sin_addr.s_addr;
+        pcb->remote_port = ntohs(addr.sin_port);
+    }
+    int mss = 0;
+    len = sizeof(mss);
+    if(getsockopt(pcb->fd, IPPROTO_TCP, TCP_MAXSEG, &mss, &len) == 0 && mss > 0){
+        pcb->mss = (mss > 0xFFFF)?0xFFFF:mss;
+    }
+    pcb->state = ESTABLISHED;
+    _pcb_link(pcb);
+}
+
+/*
+ * Socket Events
+ * */
+
+//hands the data to the application, false when it was refused or the PCB is gone
+static bool _pcb_deliver(struct tcp_pcb * pcb, struct pbuf * p){
+    err_t err = ERR_OK;
+    if(pcb->recv){
+        err = pcb->recv(pcb->callback_arg, pcb, p, ERR_OK);
+    } else {
+        tcp_recved(pcb, p->tot_len);
+        pbuf_free(p);
+    }
+    if(err == ERR_ABRT){
+        return false;
+    }
+    if(err != ERR_OK){
+        //kept and offered again, reading stops meanwhile
+        pcb->refused_data = p;
+        _pcb_busy(pcb);
+        _pcb_update_events(pcb);
+        return false;
+    }
+    return pcb->fd >= 0;
+}
+
+static void _pcb_flush(struct tcp_pcb * pcb){
+    if(pcb->fd < 0 || pcb->pending_err){
+        return;
+    }
+    if((pcb->flags & TF_NODELAY) != pcb->nodelay_set){
+        int on = (pcb->flags & TF_NODELAY)?1:0;
+        setsockopt(pcb->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        pcb->nodelay_set = pcb->flags & TF_NODELAY;
+    }
+    while(pcb->unsent){
+        struct iovec iov[TCP_IOV_MAX];
+        int count = 0;
+        for(struct tcp_seg * seg = pcb->unsent; seg && count < TCP_IOV_MAX; seg = seg->next){
+            iov[count].iov_base = (void *)(seg->data + seg->off);
+            iov[count].iov_len = seg->len - seg->off;
+            count++;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        ssize_t n = sendmsg(pcb->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if(n < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            if(errno != EAGAIN && errno != EWOULDBLOCK){
+                //reported by the next pass, the caller may be in the middle of an API call
+                pcb->pending_err = _err_from_errno(errno);
+                _pcb_busy(pcb);
+            }
+            break;
+        }
+        pcb->written += n;
+        pcb->unsent_len -= n;
+        while(n){
+            struct tcp_seg * seg = pcb->unsent;
+            size_t left = seg->len - seg->off;
+            if((size_t)n < left){
+                seg->off += n;
+                break;
+            }
+            n -= left;
+            pcb->unsent = seg->next;
+            free(seg);
+        }
+        if(!pcb->unsent){
+            pcb->unsent_tail = NULL;
+        }
+        _pcb_busy(pcb);
+    }
+    _pcb_update_sndbuf(pcb);
+    if(pcb->closing && !pcb->unsent && !pcb->pending_err){
+        _pcb_retire(pcb, false);
+        return;
+    }
+    _pcb_update_events(pcb);
+}
+
+static void _pcb_input(struct tcp_pcb * pcb){
+    for(int i = 0; i < TCP_READS_PER_EVENT; ++i){
+        if(pcb->refused_data || !pcb->rcv_wnd){
+            break;
+        }
+        size_t size = (pcb->rcv_wnd < TCP_READ_SIZE)?pcb->rcv_wnd:TCP_READ_SIZE;
+        ssize_t n = recv(pcb->fd, _rx_scratch, size, 0);
+        if(n > 0){
+            struct pbuf * p = pbuf_alloc(PBUF_RAW, n, PBUF_RAM);
+            if(!p){
+                _pcb_report_error(pcb, ERR_MEM);
+                return;
+            }
+            memcpy(p->payload, _rx_scratch, n);
+            pcb->rcv_wnd -= n;
+            if(!_pcb_deliver(pcb, p) || pcb->closing){
+                return;
+            }
+            if((size_t)n < size){
+                break;
+            }
+            continue;
+        }
+        if(n == 0){
+            //FIN, a NULL pbuf tells the application
+            pcb->state = CLOSE_WAIT;
+            _pcb_update_events(pcb);
+            if(pcb->recv){
+                pcb->recv(pcb->callback_arg, pcb, NULL, ERR_OK);
+            } else {
+                tcp_close(pcb);
+            }
+            return;
+        }
+        if(errno == EINTR){
+            continue;
+        }
+        if(errno != EAGAIN && errno != EWOULDBLOCK){
+            _pcb_report_error(pcb, _err_from_errno(errno));
+            return;
+        }
+        break;
+    }
+    _pcb_update_events(pcb);
+}
+
+static int _socket_error(int fd){
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0){
+        return errno;
+    }
+    return err;
+}
+
+static void _pcb_connect_done(struct tcp_pcb * pcb){
+    int err = _socket_error(pcb->fd);
+    if(!err){
+        struct sockaddr_in addr;
+        socklen_t len = sizeof(addr);
+        if(getpeername(pcb->fd, (struct sockaddr *)&addr, &len) < 0){
+            err = ECONNREFUSED;
+        }
+    }
+    if(err){
+        _pcb_report_error(pcb, _err_from_errno(err));
+        return;
+    }
+    _pcb_established(pcb);
+    _pcb_update_events(pcb);
+    if(pcb->connected && pcb->connected(pcb->callback_arg, pcb, ERR_OK) == ERR_ABRT){
+        return;
+    }
+    if(pcb->fd >= 0 && pcb->unsent){
+        _pcb_flush(pcb);
+    }
+}
+
+static void _pcb_accept(struct tcp_pcb * lpcb){
+    for(int i = 0; i < TCP_EPOLL_EVENTS && lpcb->fd >= 0; ++i){
+        int fd = accept4(lpcb->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(fd < 0){
+            if(errno == EINTR || errno == ECONNABORTED){
+                continue;
+            }
+            return;
+        }
+        struct tcp_pcb * npcb = _pcb_alloc();
+        if(!npcb){
+            ::close(fd);
+            continue;
+        }
+        npcb->fd = fd;
+        npcb->callback_arg = lpcb->callback_arg;
+        _pcb_established(npcb);
+        if(!lpcb->accept){
+            tcp_abort(npcb);
+            continue;
+        }
+        err_t err = lpcb->accept(lpcb->callback_arg, npcb, ERR_OK);
+        if(err == ERR_ABRT){
+            continue;
+        }
+        if(err != ERR_OK){
+            tcp_abort(npcb);
+            continue;
+        }
+        _pcb_update_events(npcb);
+    }
+}
+
+static void _pcb_event(struct tcp_pcb * pcb, uint32_t events){
+    if(pcb->fd < 0){
+        return;
+    }
+    if(pcb->state == LISTEN){
+        _pcb_accept(pcb);
+        return;
+    }
+    if(pcb->state == SYN_SENT){
+        _pcb_connect_done(pcb);
+        return;
+    }
+    if(pcb->closing){
+        if(events & (EPOLLERR | EPOLLHUP)){
+            _pcb_retire(pcb, false);
+        } else {
+            _pcb_flush(pcb);
+        }
+        return;
+    }
+    if(events & EPOLLERR){
+        _pcb_report_error(pcb, _err_from_errno(_socket_error(pcb->fd)));
+        return;
+    }
+    if(events & EPOLLOUT){
+        _pcb_flush(pcb);
+        if(pcb->fd < 0){
+            return;
+        }
+    }
+    if(events & (EPOLLIN | EPOLLHUP)){
+        _pcb_input(pcb);
+    }
+}
+
+/*
+ * Timers
+ * */
+
+//delivers refused data and the bytes the peer acknowledged, true while there is more to wait for
+static bool _pcb_service(struct tcp_pcb * pcb, bool * progress){
+    if(pcb->fd < 0){
+        return false;
+    }
+    if(pcb->pending_err){
+        _pcb_report_error(pcb, pcb->pending_err);
+        return false;
+    }
+    if(pcb->refused_data){
+        struct pbuf * p = pcb->refused_data;
+        pcb->refused_data = NULL;
+        if(_pcb_deliver(pcb, p)){
+            *progress = true;
+            _pcb_update_events(pcb);
+        }
+        if(pcb->fd < 0){
+            return false;
+        }
+    }
+    if(pcb->written != pcb->acked){
+        int outq = 0;
+        if(ioctl(pcb->fd, SIOCOUTQ, &outq) == 0 && (uint32_t)outq <= pcb->written - pcb->acked){
+            uint32_t len = (pcb->written - outq) - pcb->acked;
+            if(len){
+                *progress = true;
+                pcb->acked += len;
+                _pcb_update_sndbuf(pcb);
+                while(len && pcb->sent && pcb->fd >= 0){
+                    uint16_t chunk = (len > 0xFFFF)?0xFFFF:len;
+                    len -= chunk;
+                    if(pcb->sent(pcb->callback_arg, pcb, chunk) == ERR_ABRT){
+                        break;
+                    }
+                }
+            }
+        }
+    }
+    return pcb->fd >= 0 && (pcb->refused_data || pcb->written != pcb->acked);
+}
+
+static void _check_busy_pcbs(){
+    std::vector<struct tcp_pcb *> busy;
+    busy.swap(_tcpip->busy_pcbs);
+    bool progress = false;
+    for(size_t i = 0; i < busy.size(); ++i){
+        struct tcp_pcb * pcb = busy[i];
+        pcb->busy = 0;
+        if(_pcb_service(pcb, &progress)){
+            _pcb_busy(pcb);
+        }
+    }
+    //a callback may have closed a PCB that was added back already
+    std::vector<struct tcp_pcb *> & list = _tcpip->busy_pcbs;
+    for(size_t i = 0; i < list.size();){
+        if(list[i]->fd < 0){
+            list[i]->busy = 0;
+            list[i] = list.back();
+            list.pop_back();
+        } else {
+            ++i;
+        }
+    }
+    if(progress){
+        _tcpip->busy_wait = 1;
+    } else if(_tcpip->busy_wait < TCP_BUSY_WAIT_MAX){
+        _tcpip->busy_wait *= 2;
+    }
+}
+
+//the slow timer of LwIP: poll callbacks and output of data that was written without tcp_output()
+static void _slow_timer(){
+    std::vector<struct tcp_pcb *> pcbs;
+    for(struct tcp_pcb * pcb = _tcpip->active_pcbs; pcb; pcb = pcb->next){
+        pcbs.push_back(pcb);
+    }
+    for(size_t i = 0; i < pcbs.size(); ++i){
+        struct tcp_pcb * pcb = pcbs[i];
+        if(pcb->fd < 0 || pcb->closing){
+            continue;
+        }
+        if(pcb->unsent){
+            _pcb_flush(pcb);
+            if(pcb->fd < 0){
+                continue;
+            }
+        }
+        if(pcb->poll && ++pcb->polltmr >= pcb->pollinterval){
+            pcb->polltmr = 0;
+            pcb->poll(pcb->callback_arg, pcb);
+        }
+    }
+}
+
+static void * _tcpip_thread(void * arg){
+    _in_tcpip_thread = true;
+    struct epoll_event events[TCP_EPOLL_EVENTS];
+    uint32_t next_slow = millis() + TCP_SLOW_INTERVAL;
+    for(;;){
+        int32_t timeout = next_slow - millis();
+        if(timeout < 0){
+            timeout = 0;
+        }
+        if(!_tcpip->busy_pcbs.empty() && timeout > _tcpip->busy_wait){
+            timeout = _tcpip->busy_wait;
+        }
+        int n = epoll_wait(_tcpip->epoll_fd, events, TCP_EPOLL_EVENTS, timeout);
+        for(int i = 0; i < n; ++i){
+            if(!events[i].data.ptr){
+                _tcpip_run_mbox();
+            } else {
+                _pcb_event((struct tcp_pcb *)events[i].data.ptr, events[i].events);
+            }
+        }
+        if((int32_t)(millis() - next_slow) >= 0){
+            next_slow += TCP_SLOW_INTERVAL;
+            if((int32_t)(millis() - next_slow) >= 0){
+                next_slow = millis() + TCP_SLOW_INTERVAL;
+            }
+            _slow_timer();
+        }
+        if(!_tcpip->busy_pcbs.empty()){
+            _check_busy_pcbs();
+        }
+        _pcb_release_retired();
+    }
+    return NULL;
+}
+
+/*
+ * Raw TCP API
+ * */
+
+struct tcp_pcb * tcp_new(){
+    return _pcb_alloc();
+}
+
+struct tcp_pcb * tcp_new_ip_type(uint8_t type){
+    if(type != IPADDR_TYPE_V4){
+        return NULL;
+    }
+    return _pcb_alloc();
+}
+
+void tcp_arg(struct tcp_pcb * pcb, void * arg){
+    pcb->callback_arg = arg;
+}
+
+void tcp_recv(struct tcp_pcb * pcb, tcp_recv_fn recv){
+    pcb->recv = recv;
+}
+
+void tcp_sent(struct tcp_pcb * pcb, tcp_sent_fn sent){
+    pcb->sent = sent;
+}
+
+void tcp_err(struct tcp_pcb * pcb, tcp_err_fn err){
+    pcb->errf = err;
+}
+
+void tcp_poll(struct tcp_pcb * pcb, tcp_poll_fn poll, uint8_t interval){
+    pcb->poll = poll;
+    pcb->pollinterval = interval;
+}
+
+void tcp_accept(struct tcp_pcb * pcb, tcp_accept_fn accept){
+    pcb->accept = accept;
+}
+
+static int _pcb_socket(struct tcp_pcb * pcb){
+    if(pcb->fd < 0){
+        pcb->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    }
+    return pcb->fd;
+}
+
+err_t tcp_bind(struct tcp_pcb * pcb, const ip_addr_t * ipaddr, uint16_t port){
+    if(_pcb_socket(pcb) < 0){
+        return ERR_MEM;
+    }
+    int on = 1;
+    setsockopt(pcb->fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = ipaddr?ipaddr->u_addr.ip4.addr:INADDR_ANY;
+    addr.sin_port = htons(port);
+    if(bind(pcb->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+        return (errno == EADDRINUSE)?ERR_USE:ERR_VAL;
+    }
+    socklen_t len = sizeof(addr);
+    if(getsockname(pcb->fd, (struct sockaddr *)&addr, &len) == 0){
+        pcb->local_ip.u_addr.ip4.addr = addr.sin_addr.s_addr;
+        pcb->local_port = ntohs(addr.sin_port);
+    }
+    return ERR_OK;
+}
+
+struct tcp_pcb * tcp_listen_with_backlog(struct tcp_pcb * pcb, uint8_t backlog){
+    if(_pcb_socket(pcb) < 0 || listen(pcb->fd, backlog) < 0){
+        return NULL;
+    }
+    pcb->state = LISTEN;
+    _pcb_update_events(pcb);
+    return pcb;
+}
+
+err_t tcp_connect(struct tcp_pcb * pcb, const ip_addr_t * ipaddr, uint16_t port, tcp_connected_fn connected){
+    if(pcb->state != CLOSED){
+        return ERR_ISCONN;
+    }
+    if(_pcb_socket(pcb) < 0){
+        return ERR_MEM;
+    }
+    pcb->connected = connected;
+    pcb->remote_ip.u_addr.ip4.addr = ipaddr->u_addr.ip4.addr;
+    pcb->remote_port = port;
+    pcb->state = SYN_SENT;
+    _pcb_link(pcb);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = ipaddr->u_addr.ip4.addr;
+    addr.sin_port = htons(port);
+    if(::connect(pcb->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS){
+        //LwIP reports a failed connect through the error callback
+        pcb->pending_err = _err_from_errno(errno);
+        _pcb_busy(pcb);
+        return ERR_OK;
+    }
+    _pcb_update_events(pcb);
+    return ERR_OK;
+}
+
+err_t tcp_write(struct tcp_pcb * pcb, const void * dataptr, uint32_t len, uint8_t apiflags){
+    if(pcb->state != ESTABLISHED && pcb->state != CLOSE_WAIT && pcb->state != SYN_SENT){
+        return ERR_CONN;
+    }
+    if(!len){
+        return ERR_OK;
+    }
+    if(len > pcb->snd_buf){
+        return ERR_MEM;
+    }
+    bool copy = (apiflags & TCP_WRITE_FLAG_COPY) != 0;
+    struct tcp_seg * seg = (struct tcp_seg *)malloc(sizeof(struct tcp_seg) + (copy?len:0));
+    if(!seg){
+        return ERR_MEM;
+    }
+    seg->next = NULL;
+    seg->len = len;
+    seg->off = 0;
+    if(copy){
+        memcpy(seg + 1, dataptr, len);
+        seg->data = (const char *)(seg + 1);
+    } else {
+        seg->data = (const char *)dataptr;
+    }
+    if(pcb->unsent_tail){
+        pcb->unsent_tail->next = seg;
+    } else {
+        pcb->unsent = seg;
+    }
+    pcb->unsent_tail = seg;
+    pcb->unsent_len += len;
+    _pcb_update_sndbuf(pcb);
+    return ERR_OK;
+}
+
+err_t tcp_output(struct tcp_pcb * pcb){
+    if(pcb->state == SYN_SENT){
+        return ERR_OK;//sent once connected
+    }
+    if(pcb->fd < 0 || (pcb->state != ESTABLISHED && pcb->state != CLOSE_WAIT)){
+        return ERR_CONN;
+    }
+    _pcb_flush(pcb);
+    return ERR_OK;
+}
+
+void tcp_recved(struct tcp_pcb * pcb, uint32_t len){
+    pcb->rcv_wnd += len;
+    if(pcb->rcv_wnd > TCP_WND){
+        pcb->rcv_wnd = TCP_WND;
+    }
+    _pcb_update_events(pcb);
+}
+
+typedef struct {
+    struct tcpip_api_call_data call;
+    struct tcp_pcb * pcb;
+} tcp_pcb_call_t;
+
+static err_t _tcp_close_call(struct tcpip_api_call_data * call){
+    return tcp_close(((tcp_pcb_call_t *)call)->pcb);
+}
+
+static err_t _tcp_abort_call(struct tcpip_api_call_data * call){
+    tcp_abort(((tcp_pcb_call_t *)call)->pcb);
+    return ERR_OK;
+}
+
+err_t tcp_close(struct tcp_pcb * pcb){
+    if(!_in_tcpip_thread){
+        tcp_pcb_call_t msg;
+        msg.pcb = pcb;
+        return tcpip_api_call(_tcp_close_call, &msg.call);
+    }
+    if(pcb->state == ESTABLISHED || pcb->state == CLOSE_WAIT){
+        //the data written so far still goes out before the FIN
+        pcb->state = (pcb->state == CLOSE_WAIT)?LAST_ACK:FIN_WAIT_1;
+        if(pcb->unsent && !pcb->pending_err){
+            pcb->closing = 1;
+            _pcb_update_events(pcb);
+            return ERR_OK;
+        }
+    }
+    _pcb_retire(pcb, false);
+    return ERR_OK;
+}
+
+void tcp_abort(struct tcp_pcb * pcb){
+    if(!_in_tcpip_thread){
+        tcp_pcb_call_t msg;
+        msg.pcb = pcb;
+        tcpip_api_call(_tcp_abort_call, &msg.call);
+        return;
+    }
+    tcp_err_fn errf = pcb->errf;
+    void * arg = pcb->callback_arg;
+    bool connected = pcb->state != LISTEN;
+    _pcb_retire(pcb, true);
+    if(connected && errf){
+        errf(arg, ERR_ABRT);
+    }
+}
+
+/*
+ * DNS
+ * */
+
+typedef struct {
+    std::string name;
+    dns_found_callback found;
+    void * arg;
+    ip_addr_t addr;
+    bool resolved;
+} dns_query_t;
+
+static void _dns_done(void * ctx){
+    dns_query_t * q = (dns_query_t *)ctx;
+    q->found(q->name.c_str(), q->resolved?&q->addr:NULL, q->arg);
+    delete q;
+}
+
+//getaddrinfo() blocks, so every lookup gets a thread that posts the result to the TCP/IP thread
+static void _dns_resolve(dns_query_t * q){
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo * res = NULL;
+    if(getaddrinfo(q->name.c_str(), NULL, &hints, &res) == 0 && res){
+        q->addr.u_addr.ip4.addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr.s_addr;
+        q->resolved = true;
+    }
+    if(res){
+        freeaddrinfo(res);
+    }
+    tcpip_callback(_dns_done, q);
+}
+
+err_t dns_gethostbyname(const char * hostname, ip_addr_t * addr, dns_found_callback found, void * arg){
+    if(!hostname || !*hostname || !addr){
+        return ERR_ARG;
+    }
+    struct in_addr literal;
+    if(inet_pton(AF_INET, hostname, &literal) == 1){
+        addr->type = IPADDR_TYPE_V4;
+        addr->u_addr.ip4.addr = literal.s_addr;
+        return ERR_OK;
+    }
+    dns_query_t * q = new (std::nothrow) dns_query_t;
+    if(!q){
+        return ERR_MEM;
+    }
+    q->name = hostname;
+    q->found = found;
+    q->arg = arg;
+    memset(&q->addr, 0, sizeof(q->addr));
+    q->addr.type = IPADDR_TYPE_V4;
+    q->resolved = false;
+    try {
+        std::thread(_dns_resolve, q).detach();
+    } catch(...) {
+        delete q;
+        return ERR_MEM;
+    }
+    return ERR_INPROGRESS;
+}
+
+#endif /* __linux__ && !ESP_PLATFORM */
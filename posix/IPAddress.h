@@ -0,0 +1,42 @@
+/*
+  IPv4 address compatible with the one of the Arduino core
+*/
+
+#ifndef POSIX_IPADDRESS_H_
+#define POSIX_IPADDRESS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+class IPAddress {
+  public:
+    IPAddress(){ _address.dword = 0; }
+    IPAddress(uint8_t first, uint8_t second, uint8_t third, uint8_t fourth){
+        _address.bytes[0] = first;
+        _address.bytes[1] = second;
+        _address.bytes[2] = third;
+        _address.bytes[3] = fourth;
+    }
+    IPAddress(uint32_t address){ _address.dword = address; }//network byte order, as in LwIP
+
+    operator uint32_t() const { return _address.dword; }
+    bool operator==(const IPAddress& other) const { return _address.dword == other._address.dword; }
+    bool operator!=(const IPAddress& other) const { return _address.dword != other._address.dword; }
+    uint8_t operator[](int index) const { return _address.bytes[index]; }
+    uint8_t& operator[](int index){ return _address.bytes[index]; }
+
+    std::string toString() const {
+        char buf[16];
+        snprintf(buf, sizeof(buf), "%u.%u.%u.%u", _address.bytes[0], _address.bytes[1], _address.bytes[2], _address.bytes[3]);
+        return buf;
+    }
+
+  private:
+    union {
+        uint8_t bytes[4];
+        uint32_t dword;
+    } _address;
+};
+
+#endif /* POSIX_IPADDRESS_H_ */
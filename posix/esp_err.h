@@ -0,0 +1,9 @@
+#ifndef POSIX_ESP_ERR_H_
+#define POSIX_ESP_ERR_H_
+
+typedef int esp_err_t;
+
+#define ESP_OK 0
+#define ESP_FAIL -1
+
+#endif /* POSIX_ESP_ERR_H_ */
@@ -0,0 +1,14 @@
+/*
+  There is no task watchdog on Linux, the calls succeed and do nothing
+*/
+
+#ifndef POSIX_ESP_TASK_WDT_H_
+#define POSIX_ESP_TASK_WDT_H_
+
+#include "esp_err.h"
+
+static inline esp_err_t esp_task_wdt_add(void *){ return ESP_OK; }
+static inline esp_err_t esp_task_wdt_delete(void *){ return ESP_OK; }
+static inline esp_err_t esp_task_wdt_reset(){ return ESP_OK; }
+
+#endif /* POSIX_ESP_TASK_WDT_H_ */
@@ -0,0 +1,51 @@
+/*
+  The FreeRTOS types and critical sections used by AsyncTCP, backed by pthreads
+*/
+
+#ifndef POSIX_FREERTOS_H_
+#define POSIX_FREERTOS_H_
+
+#include <stdint.h>
+#include "sdkconfig.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdFALSE 0
+#define pdTRUE 1
+#define pdPASS pdTRUE
+#define pdFAIL pdFALSE
+
+#define portMAX_DELAY ((TickType_t)0xFFFFFFFFUL)
+#define portTICK_PERIOD_MS (1000 / CONFIG_FREERTOS_HZ)
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms) / portTICK_PERIOD_MS)
+#define portNUM_PROCESSORS 2
+#define tskNO_AFFINITY 0x7FFFFFFF
+
+//recursive spin lock, owned by a thread instead of a core
+typedef struct {
+    uint32_t owner;
+    uint32_t count;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED {0, 0}
+
+void vPortCPUInitializeMutex(portMUX_TYPE * mux);
+void vPortEnterCritical(portMUX_TYPE * mux);
+void vPortExitCritical(portMUX_TYPE * mux);
+
+#define portENTER_CRITICAL(mux) vPortEnterCritical(mux)
+#define portEXIT_CRITICAL(mux) vPortExitCritical(mux)
+#define portENTER_CRITICAL_ISR(mux) vPortEnterCritical(mux)
+#define portEXIT_CRITICAL_ISR(mux) vPortExitCritical(mux)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* POSIX_FREERTOS_H_ */
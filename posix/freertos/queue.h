@@ -0,0 +1,27 @@
+#ifndef POSIX_FREERTOS_QUEUE_H_
+#define POSIX_FREERTOS_QUEUE_H_
+
+#include "FreeRTOS.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef void * QueueHandle_t;
+typedef QueueHandle_t xQueueHandle;
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size);
+void vQueueDelete(QueueHandle_t queue);
+BaseType_t xQueueSend(QueueHandle_t queue, const void * item, TickType_t ticks);
+BaseType_t xQueueSendToBack(QueueHandle_t queue, const void * item, TickType_t ticks);
+BaseType_t xQueueSendToFront(QueueHandle_t queue, const void * item, TickType_t ticks);
+BaseType_t xQueueReceive(QueueHandle_t queue, void * item, TickType_t ticks);
+BaseType_t xQueuePeek(QueueHandle_t queue, void * item, TickType_t ticks);
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue);
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t queue);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* POSIX_FREERTOS_QUEUE_H_ */
@@ -0,0 +1,25 @@
+#ifndef POSIX_FREERTOS_SEMPHR_H_
+#define POSIX_FREERTOS_SEMPHR_H_
+
+#include "queue.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//queues of empty items, like in FreeRTOS (the mutex is not recursive and has no priority inheritance)
+typedef QueueHandle_t SemaphoreHandle_t;
+
+SemaphoreHandle_t xSemaphoreCreateBinary();
+SemaphoreHandle_t xSemaphoreCreateMutex();
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max, UBaseType_t initial);
+
+#define xSemaphoreTake(sem, ticks) xQueueReceive((sem), NULL, (ticks))
+#define xSemaphoreGive(sem) xQueueSend((sem), NULL, 0)
+#define vSemaphoreDelete(sem) vQueueDelete(sem)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* POSIX_FREERTOS_SEMPHR_H_ */
@@ -0,0 +1,24 @@
+#ifndef POSIX_FREERTOS_TASK_H_
+#define POSIX_FREERTOS_TASK_H_
+
+#include "FreeRTOS.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef void * TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+//a detached thread, priority and core are ignored
+BaseType_t xTaskCreateUniversal(TaskFunction_t task, const char * name, uint32_t stack_size, void * arg, UBaseType_t priority, TaskHandle_t * handle, BaseType_t core);
+void vTaskDelete(TaskHandle_t task);//only the calling task (NULL) can be deleted
+TaskHandle_t xTaskGetCurrentTaskHandle();
+TickType_t xTaskGetTickCount();
+void vTaskDelay(TickType_t ticks);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* POSIX_FREERTOS_TASK_H_ */
@@ -0,0 +1,20 @@
+#ifndef POSIX_LWIP_DNS_H_
+#define POSIX_LWIP_DNS_H_
+
+#include "ip_addr.h"
+#include "err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef void (*dns_found_callback)(const char * name, const ip_addr_t * ipaddr, void * arg);
+
+//ERR_OK for an address literal, else ERR_INPROGRESS and the callback runs on the TCP/IP thread
+err_t dns_gethostbyname(const char * hostname, ip_addr_t * addr, dns_found_callback found, void * arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* POSIX_LWIP_DNS_H_ */
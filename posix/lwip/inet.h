@@ -0,0 +1,6 @@
+#ifndef POSIX_LWIP_INET_H_
+#define POSIX_LWIP_INET_H_
+
+#include "ip_addr.h"
+
+#endif /* POSIX_LWIP_INET_H_ */
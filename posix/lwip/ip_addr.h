@@ -0,0 +1,41 @@
+#ifndef POSIX_LWIP_IP_ADDR_H_
+#define POSIX_LWIP_IP_ADDR_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct ip4_addr {
+    uint32_t addr;//network byte order
+} ip4_addr_t;
+
+typedef struct ip6_addr {
+    uint32_t addr[4];
+    uint8_t zone;
+} ip6_addr_t;
+
+typedef struct ip_addr {
+    union {
+        ip6_addr_t ip6;
+        ip4_addr_t ip4;
+    } u_addr;
+    uint8_t type;
+} ip_addr_t;
+
+#define IPADDR_TYPE_V4 0U
+#define IPADDR_TYPE_V6 6U
+#define IPADDR_TYPE_ANY 46U
+
+#define IPADDR_ANY ((uint32_t)0x00000000UL)
+
+#define ip_addr_copy(dest, src) ((dest) = (src))
+
+char * ipaddr_ntoa(const ip_addr_t * addr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* POSIX_LWIP_IP_ADDR_H_ */
@@ -0,0 +1,30 @@
+/*
+  Sizes of the POSIX port of the LwIP TCP API, every value can be overridden with -D
+*/
+
+#ifndef POSIX_LWIP_OPT_H_
+#define POSIX_LWIP_OPT_H_
+
+#ifndef TCP_MSS
+#define TCP_MSS 1460 //only used for sizing, the kernel picks the real MSS
+#endif
+
+#ifndef TCP_WND
+#define TCP_WND (64 * 1024) //received bytes the application may hold before reading stops
+#endif
+
+#ifndef TCP_SND_BUF
+#define TCP_SND_BUF (64 * 1024) //bytes written and not yet acknowledged by the peer
+#endif
+
+#ifndef TCP_SLOW_INTERVAL
+#define TCP_SLOW_INTERVAL 500 //milliseconds per tcp_poll() interval unit
+#endif
+
+#ifndef TCPIP_MBOX_SIZE
+#define TCPIP_MBOX_SIZE 1024 //callbacks queued for the TCP/IP thread before tcpip_try_callback() fails
+#endif
+
+#define LWIP_IPV6 0
+
+#endif /* POSIX_LWIP_OPT_H_ */
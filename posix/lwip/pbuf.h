@@ -0,0 +1,53 @@
+/*
+  Heap pbufs, payload and header in one allocation
+*/
+
+#ifndef POSIX_LWIP_PBUF_H_
+#define POSIX_LWIP_PBUF_H_
+
+#include <stdint.h>
+#include "err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    PBUF_TRANSPORT,
+    PBUF_IP,
+    PBUF_LINK,
+    PBUF_RAW
+} pbuf_layer;
+
+typedef enum {
+    PBUF_RAM,
+    PBUF_ROM,
+    PBUF_REF,
+    PBUF_POOL
+} pbuf_type;
+
+struct pbuf {
+    struct pbuf * next;
+    void * payload;
+    uint16_t tot_len;//this and all following pbufs of the chain
+    uint16_t len;
+    uint8_t type_internal;
+    uint8_t flags;
+    uint16_t ref;
+};
+
+struct pbuf * pbuf_alloc(pbuf_layer layer, uint16_t length, pbuf_type type);
+uint8_t pbuf_free(struct pbuf * p);
+void pbuf_ref(struct pbuf * p);
+void pbuf_cat(struct pbuf * head, struct pbuf * tail);
+void pbuf_chain(struct pbuf * head, struct pbuf * tail);
+uint16_t pbuf_clen(const struct pbuf * p);
+uint16_t pbuf_copy_partial(const struct pbuf * p, void * dataptr, uint16_t len, uint16_t offset);
+uint8_t pbuf_get_at(const struct pbuf * p, uint16_t offset);
+int pbuf_try_get_at(const struct pbuf * p, uint16_t offset);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* POSIX_LWIP_PBUF_H_ */
@@ -0,0 +1,26 @@
+#ifndef POSIX_LWIP_TCPIP_PRIV_H_
+#define POSIX_LWIP_TCPIP_PRIV_H_
+
+#include "../err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct tcpip_api_call_data {
+    err_t err;
+};
+
+typedef err_t (*tcpip_api_call_fn)(struct tcpip_api_call_data * call);
+typedef void (*tcpip_callback_fn)(void * ctx);
+
+//runs fn on the TCP/IP thread and waits for it
+err_t tcpip_api_call(tcpip_api_call_fn fn, struct tcpip_api_call_data * call);
+err_t tcpip_callback(tcpip_callback_fn fn, void * ctx);
+err_t tcpip_try_callback(tcpip_callback_fn fn, void * ctx);//ERR_MEM when TCPIP_MBOX_SIZE calls are pending
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* POSIX_LWIP_TCPIP_PRIV_H_ */
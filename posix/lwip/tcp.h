@@ -0,0 +1,120 @@
+/*
+  The raw TCP API of LwIP on top of non-blocking sockets, see AsyncTCP_posix.cpp
+
+  Like in LwIP every call has to be made on the TCP/IP thread, except tcp_new_ip_type()
+  and the setters of a PCB that is not connected or listening yet. tcp_close() and
+  tcp_abort() are passed to the TCP/IP thread when called from another one.
+*/
+
+#ifndef POSIX_LWIP_TCP_H_
+#define POSIX_LWIP_TCP_H_
+
+#include <stdint.h>
+#include "err.h"
+#include "pbuf.h"
+#include "ip_addr.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum tcp_state {
+    CLOSED      = 0,
+    LISTEN      = 1,
+    SYN_SENT    = 2,
+    SYN_RCVD    = 3,
+    ESTABLISHED = 4,
+    FIN_WAIT_1  = 5,
+    FIN_WAIT_2  = 6,
+    CLOSE_WAIT  = 7,
+    CLOSING     = 8,
+    LAST_ACK    = 9,
+    TIME_WAIT   = 10
+};
+
+struct tcp_pcb;
+struct tcp_seg;
+
+typedef uint32_t tcpwnd_size_t;
+
+typedef err_t (*tcp_recv_fn)(void * arg, struct tcp_pcb * tpcb, struct pbuf * p, err_t err);
+typedef err_t (*tcp_sent_fn)(void * arg, struct tcp_pcb * tpcb, uint16_t len);
+typedef err_t (*tcp_poll_fn)(void * arg, struct tcp_pcb * tpcb);
+typedef void (*tcp_err_fn)(void * arg, err_t err);
+typedef err_t (*tcp_connected_fn)(void * arg, struct tcp_pcb * tpcb, err_t err);
+typedef err_t (*tcp_accept_fn)(void * arg, struct tcp_pcb * newpcb, err_t err);
+
+#define TF_NODELAY 0x40U
+
+struct tcp_pcb {
+    ip_addr_t local_ip;
+    ip_addr_t remote_ip;
+    uint16_t local_port;
+    uint16_t remote_port;
+    enum tcp_state state;
+    tcpwnd_size_t snd_buf;//room for tcp_write()
+    tcpwnd_size_t rcv_wnd;//bytes that may be read before the application calls tcp_recved()
+    uint16_t mss;
+    uint8_t flags;
+
+    void * callback_arg;
+    tcp_recv_fn recv;
+    tcp_sent_fn sent;
+    tcp_poll_fn poll;
+    tcp_err_fn errf;
+    tcp_accept_fn accept;
+    tcp_connected_fn connected;
+    uint8_t pollinterval;
+    uint8_t polltmr;
+
+    /* socket state of the port */
+    int fd;
+    uint32_t events;//registered with epoll, 0 when not registered
+    struct tcp_seg * unsent;
+    struct tcp_seg * unsent_tail;
+    uint32_t unsent_len;
+    uint32_t written;//bytes handed to the kernel
+    uint32_t acked;//of them acknowledged by the peer
+    struct pbuf * refused_data;
+    err_t pending_err;//reported by the next pass of the TCP/IP thread
+    uint8_t nodelay_set;//TF_NODELAY as applied to the socket
+    uint8_t closing;//closed by the application, still flushing
+    uint8_t busy;//on the list checked after every epoll_wait
+    struct tcp_pcb * next;
+    struct tcp_pcb * prev;
+};
+
+struct tcp_pcb * tcp_new();
+struct tcp_pcb * tcp_new_ip_type(uint8_t type);
+void tcp_arg(struct tcp_pcb * pcb, void * arg);
+void tcp_recv(struct tcp_pcb * pcb, tcp_recv_fn recv);
+void tcp_sent(struct tcp_pcb * pcb, tcp_sent_fn sent);
+void tcp_err(struct tcp_pcb * pcb, tcp_err_fn err);
+void tcp_poll(struct tcp_pcb * pcb, tcp_poll_fn poll, uint8_t interval);
+void tcp_accept(struct tcp_pcb * pcb, tcp_accept_fn accept);
+
+err_t tcp_bind(struct tcp_pcb * pcb, const ip_addr_t * ipaddr, uint16_t port);
+struct tcp_pcb * tcp_listen_with_backlog(struct tcp_pcb * pcb, uint8_t backlog);
+#define tcp_listen(pcb) tcp_listen_with_backlog((pcb), 0xFF)
+err_t tcp_connect(struct tcp_pcb * pcb, const ip_addr_t * ipaddr, uint16_t port, tcp_connected_fn connected);
+
+err_t tcp_write(struct tcp_pcb * pcb, const void * dataptr, uint32_t len, uint8_t apiflags);
+err_t tcp_output(struct tcp_pcb * pcb);
+void tcp_recved(struct tcp_pcb * pcb, uint32_t len);
+err_t tcp_close(struct tcp_pcb * pcb);
+void tcp_abort(struct tcp_pcb * pcb);
+
+#define tcp_sndbuf(pcb) ((pcb)->snd_buf)
+#define tcp_mss(pcb) ((pcb)->mss)
+#define tcp_nagle_disable(pcb) ((pcb)->flags |= TF_NODELAY)
+#define tcp_nagle_enable(pcb) ((pcb)->flags &= (uint8_t)~TF_NODELAY)
+#define tcp_nagle_disabled(pcb) (((pcb)->flags & TF_NODELAY) != 0)
+
+#define TCP_WRITE_FLAG_COPY 0x01 //else the data has to stay valid until it is acknowledged
+#define TCP_WRITE_FLAG_MORE 0x02 //sockets have no PSH flag to clear, only kept for the API
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* POSIX_LWIP_TCP_H_ */
@@ -0,0 +1,16 @@
+/*
+  Configuration of the Linux build, every value can be overridden with -D
+*/
+
+#ifndef POSIX_SDKCONFIG_H_
+#define POSIX_SDKCONFIG_H_
+
+#ifndef CONFIG_LWIP_MAX_ACTIVE_TCP
+#define CONFIG_LWIP_MAX_ACTIVE_TCP 4096
+#endif
+
+#ifndef CONFIG_FREERTOS_HZ
+#define CONFIG_FREERTOS_HZ 1000
+#endif
+
+#endif /* POSIX_SDKCONFIG_H_ */